@@ -0,0 +1,445 @@
+/* ban.c - channel ban lists. a mask is compiled when it's set: folded the
+ * rfc1459 way and cut at its *s into segments, so matching it is a
+ * compare per segment, with ? standing in for any one character, and
+ * never backtracks. the first segment has to sit at the start and the
+ * last at the end, unless the mask starts or ends with *, and the ones in
+ * between are taken wherever they first fit, which leaves the most room
+ * for the rest and so is all a * ever needs.
+ * most bans end in something literal, *!*@*.example.com or a whole
+ * address, so each list keeps those in a trie by their literal tail,
+ * reversed. checking someone walks their nick!user@host backwards down
+ * the trie and only tries the masks hanging off the nodes it passes. the
+ * rest mostly have something literal straight after the @, *!*@10.0.0.*,
+ * or at the start, nick!*@*, and go in two more tries the right way round,
+ * walked from each @ in the subject and from its start. only masks like
+ * *foo*!*@* are tried every time. a channel with thousands of bans costs
+ * a JOIN a few walks the length of a hostname rather than thousands of
+ * matches
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ban.h"
+#include "casemap.h"
+
+/* _fold_text(buf, text, len)
+ * folded copy of len bytes of text, cut short at MASK_MAX */
+static int
+_fold_text (char *buf, const char *text, int len)
+{
+    return casemap_fold(buf, text, len > MASK_MAX ? MASK_MAX : len);
+}
+
+/* mask_compile(mask, text)
+ * returns -1 if text is too long */
+int
+mask_compile (mask_t *mask, const char *text)
+{
+    int i, len = strlen(text), start = 0;
+
+    if (len > MASK_MAX)
+        return -1;
+    mask->len = 0;
+    mask->nr_segs = 0;
+    mask->head = len && text[0] != '*';
+    mask->tail = len && text[len - 1] != '*';
+    for (i = 0; i <= len; ++i)
+    {
+        if (i < len && text[i] != '*')
+        {
+            mask->pattern[mask->len++] = casemap_char(text[i]);
+            continue;
+        }
+        /* a * or the end closes whatever segment there is */
+        if (mask->len > start)
+        {
+            mask->segs[mask->nr_segs][0] = start;
+            mask->segs[mask->nr_segs++][1] = mask->len - start;
+        }
+        start = mask->len;
+    }
+    mask->pattern[mask->len] = '\0';
+    return 0;
+}
+
+/* _seg_at(s, p, n)
+ * whether segment p (n long) matches at s */
+static inline int
+_seg_at (const char *s, const char *p, int n)
+{
+    int i;
+
+    for (i = 0; i < n; ++i)
+        if (p[i] != s[i] && p[i] != '?')
+            return 0;
+    return 1;
+}
+
+/* mask_match(mask, s, len)
+ * whether the mask matches s, which must already be folded */
+int
+mask_match (const mask_t *mask, const char *s, int len)
+{
+    const char *p, *hit;
+    int i = 0, n = mask->nr_segs, pos = 0, end = len, seglen;
+
+    if (!n)
+        return !mask->head || !len;
+    if (mask->head)
+    {
+        seglen = mask->segs[0][1];
+        if (seglen > len || !_seg_at(s, mask->pattern, seglen))
+            return 0;
+        if (n == 1 && mask->tail)
+            return seglen == len;
+        pos = seglen;
+        i = 1;
+    }
+    if (mask->tail && i < n)
+    {
+        seglen = mask->segs[n - 1][1];
+        if (len - seglen < pos || !_seg_at(s + len - seglen,
+                                mask->pattern + mask->segs[n - 1][0], seglen))
+            return 0;
+        end = len - seglen;
+        n--;
+    }
+    for (; i < n; ++i)
+    {
+        p = mask->pattern + mask->segs[i][0];
+        seglen = mask->segs[i][1];
+        for (;; ++pos)
+        {
+            if (end - pos < seglen)
+                return 0;
+            if (p[0] != '?')
+            {
+                if (!(hit = memchr(s + pos, p[0], end - pos - seglen + 1)))
+                    return 0;
+                pos = hit - s;
+            }
+            if (_seg_at(s + pos, p, seglen))
+                break;
+        }
+        pos += seglen;
+    }
+    return 1;
+}
+
+/* ban_normalize(buf, mask)
+ * fill mask out the usual way into buf (MASK_MAX+1 bytes): nick means
+ * nick!*@*, user@host means *!user@host and nick!user means nick!user@*
+ * returns -1 if it's empty, too long or has a space in it */
+int
+ban_normalize (char *buf, const slice_t *mask)
+{
+    const char *bang, *at;
+    int len;
+
+    if (!mask->len || memchr(mask->ptr, ' ', mask->len))
+        return -1;
+    bang = memchr(mask->ptr, '!', mask->len);
+    at = memchr(mask->ptr, '@', mask->len);
+    len = snprintf(buf, MASK_MAX + 1, "%s%.*s%s%s", bang || !at ? "" : "*!",
+                    mask->len, mask->ptr, bang || at ? "" : "!*",
+                    at ? "" : "@*");
+    return len > MASK_MAX ? -1 : 0;
+}
+
+banlist_t *
+ban_new (void)
+{
+    banlist_t *list;
+
+    if (!(list = calloc(1, sizeof(*list))))
+        return NULL;
+    list->gen = 1;
+    hash_init(&list->index);
+    return list;
+}
+
+static void
+_free_nodes (ban_node_t *node)
+{
+    ban_node_t *next;
+
+    for (; node; node = next)
+    {
+        next = node->sibling;
+        _free_nodes(node->child);
+        free(node);
+    }
+}
+
+/* ban_free(list)
+ * the list and every ban in it */
+void
+ban_free (banlist_t *list)
+{
+    int i;
+
+    for (i = 0; i < list->nr_bans; ++i)
+        free(list->bans[i]);
+    free(list->bans);
+    _free_nodes(list->tails.child);
+    _free_nodes(list->hosts.child);
+    _free_nodes(list->heads.child);
+    hash_free(&list->index);
+    free(list);
+}
+
+/* _tail(mask, len)
+ * the literal end of a mask, after its last wildcard, as a pointer into
+ * the pattern, or NULL if it ends in one */
+static const char *
+_tail (const mask_t *mask, int *len)
+{
+    const char *seg, *q;
+    int n;
+
+    if (!mask->tail)
+        return NULL;
+    seg = mask->pattern + mask->segs[mask->nr_segs - 1][0];
+    n = mask->segs[mask->nr_segs - 1][1];
+    for (q = seg + n; q > seg && q[-1] != '?'; --q)
+        ;
+    *len = seg + n - q;
+    return *len ? q : NULL;
+}
+
+/* _host(mask, len)
+ * the literal run after a mask's first @, or NULL if there isn't one */
+static const char *
+_host (const mask_t *mask, int *len)
+{
+    const char *at, *end;
+    int i;
+
+    for (i = 0; i < mask->nr_segs; ++i)
+    {
+        at = mask->pattern + mask->segs[i][0];
+        end = at + mask->segs[i][1];
+        if (!(at = memchr(at, '@', end - at)))
+            continue;
+        for (*len = 0; at + 1 + *len < end && at[1 + *len] != '?'; ++*len)
+            ;
+        return *len ? at + 1 : NULL;
+    }
+    return NULL;
+}
+
+/* _head(mask, len)
+ * the literal start of a mask, before its first wildcard, or NULL if it
+ * starts with one */
+static const char *
+_head (const mask_t *mask, int *len)
+{
+    int n = mask->segs[0][1];
+
+    if (!mask->head)
+        return NULL;
+    for (*len = 0; *len < n && mask->pattern[*len] != '?'; ++*len)
+        ;
+    return *len ? mask->pattern : NULL;
+}
+
+/* _child(node, c, create)
+ * node's child for c, made if it's not there and create says so */
+static ban_node_t *
+_child (ban_node_t *node, char c, int create)
+{
+    ban_node_t *child;
+
+    for (child = node->child; child; child = child->sibling)
+        if (child->c == c)
+            return child;
+    if (!create || !(child = calloc(1, sizeof(*child))))
+        return NULL;
+    child->c = c;
+    child->parent = node;
+    child->sibling = node->child;
+    node->child = child;
+    return child;
+}
+
+/* _prune(node)
+ * take out nodes left with nothing under them, up to the root */
+static void
+_prune (ban_node_t *node)
+{
+    ban_node_t *parent, **p;
+
+    while (node->parent && !node->bans && !node->child)
+    {
+        parent = node->parent;
+        for (p = &parent->child; *p != node; p = &(*p)->sibling)
+            ;
+        *p = node->sibling;
+        free(node);
+        node = parent;
+    }
+}
+
+/* _path(node, key, len)
+ * the node key leads to from node, made as needed, NULL if we're out of
+ * memory */
+static ban_node_t *
+_path (ban_node_t *node, const char *key, int len)
+{
+    ban_node_t *next;
+    int i;
+
+    for (i = 0; i < len; ++i, node = next)
+    {
+        if (!(next = _child(node, key[i], 1)))
+        {
+            _prune(node);
+            return NULL;
+        }
+    }
+    return node;
+}
+
+/* ban_add(list, text, setter, when)
+ * text as ban_normalize() left it
+ * returns 0 if it was added, 1 if it was there already, -1 if it
+ * wouldn't compile or we're out of memory */
+int
+ban_add (banlist_t *list, const char *text, const char *setter, time_t when)
+{
+    char key[MASK_MAX+1], rev[MASK_MAX];
+    ban_node_t *node = NULL;
+    const char *lit;
+    ban_t *ban, **bans;
+    int i, len, n;
+
+    _fold_text(key, text, strlen(text));
+    if (hash_lookup(&list->index, key))
+        return 1;
+    if (list->nr_bans == list->max_bans)
+    {
+        n = list->max_bans ? list->max_bans * 2 : 4;
+        if (!(bans = realloc(list->bans, n * sizeof(*bans))))
+            return -1;
+        list->bans = bans;
+        list->max_bans = n;
+    }
+    if (!(ban = malloc(sizeof(*ban))))
+        return -1;
+    strcpy(ban->key, key);
+    if (mask_compile(&ban->mask, text)
+        || hash_insert(&list->index, ban->key, ban))
+    {
+        free(ban);
+        return -1;
+    }
+    snprintf(ban->text, sizeof(ban->text), "%s", text);
+    snprintf(ban->setter, sizeof(ban->setter), "%s", setter);
+    ban->when = when;
+
+    /* index it by its literal tail, backwards, hosts being what tells
+     * people apart best, or failing that the start of its host or the
+     * start of it */
+    if ((lit = _tail(&ban->mask, &len)))
+    {
+        for (i = 0; i < len; ++i)
+            rev[i] = lit[len - 1 - i];
+        node = _path(&list->tails, rev, len);
+    }
+    else if ((lit = _host(&ban->mask, &len)))
+        node = _path(&list->hosts, lit, len);
+    else if ((lit = _head(&ban->mask, &len)))
+        node = _path(&list->heads, lit, len);
+    if (lit && !node)
+    {
+        hash_remove(&list->index, key);
+        free(ban);
+        return -1;
+    }
+    ban->node = node;
+    list_push(node ? &node->bans : &list->unindexed, &ban->list_head);
+    ban->pos = list->nr_bans;
+    list->bans[list->nr_bans++] = ban;
+    list->gen++;
+    return 0;
+}
+
+/* ban_remove(list, text)
+ * returns -1 if there's no such ban */
+int
+ban_remove (banlist_t *list, const char *text)
+{
+    char key[MASK_MAX+1];
+    ban_t *ban, *last;
+
+    _fold_text(key, text, strlen(text));
+    if (!(ban = hash_remove(&list->index, key)))
+        return -1;
+    if (ban->node)
+    {
+        list_unlink(&ban->node->bans, &ban->list_head);
+        _prune(ban->node);
+    }
+    else
+        list_unlink(&list->unindexed, &ban->list_head);
+    last = list->bans[--list->nr_bans];
+    list->bans[ban->pos] = last;
+    last->pos = ban->pos;
+    free(ban);
+    list->gen++;
+    return 0;
+}
+
+/* _any(bans, s, len)
+ * whether any ban on a trie node's (or the unindexed) list matches */
+static int
+_any (list_t *bans, const char *s, int len)
+{
+    for (; bans; bans = bans->next)
+        if (mask_match(&((ban_t *)bans)->mask, s, len))
+            return 1;
+    return 0;
+}
+
+/* _walk(node, s, len, from)
+ * whether any ban down the trie along s, starting at from, matches */
+static int
+_walk (ban_node_t *node, const char *s, int len, int from)
+{
+    int i;
+
+    for (i = from; i < len; ++i)
+    {
+        if (!(node = _child(node, s[i], 0)))
+            return 0;
+        if (node->bans && _any(node->bans, s, len))
+            return 1;
+    }
+    return 0;
+}
+
+/* ban_match(list, subject, len)
+ * whether anything on the list matches subject, a nick!user@host */
+int
+ban_match (banlist_t *list, const char *subject, int len)
+{
+    char s[MASK_MAX+1];
+    ban_node_t *node;
+    const char *at;
+    int i;
+
+    len = _fold_text(s, subject, len);
+    if (_any(list->unindexed, s, len))
+        return 1;
+    for (node = &list->tails, i = len - 1; i >= 0; --i)
+    {
+        if (!(node = _child(node, s[i], 0)))
+            break;
+        if (node->bans && _any(node->bans, s, len))
+            return 1;
+    }
+    for (at = s; (at = memchr(at, '@', s + len - at)); ++at)
+        if (_walk(&list->hosts, s, len, at + 1 - s))
+            return 1;
+    return _walk(&list->heads, s, len, 0);
+}
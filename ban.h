@@ -0,0 +1,84 @@
+#ifndef BAN_H
+#define BAN_H
+/* ban.h - channel ban lists and the compiled masks in them, see ban.c
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#include <time.h>       /* for time_t */
+#include "list.h"
+#include "hash.h"       /* for struct hash_table */
+#include "irc.h"        /* for IRC_PREFIX_MAX */
+#include "parse.h"      /* for slice_t */
+
+#define BAN_MAX         8192    /* bans per channel */
+#define MASK_MAX        IRC_PREFIX_MAX
+#define MASK_SEGS_MAX   (MASK_MAX / 2 + 1)
+
+typedef struct mask mask_t;
+typedef struct ban ban_t;
+typedef struct ban_node ban_node_t;
+typedef struct banlist banlist_t;
+
+/* struct mask is a compiled nick!user@host mask. pattern is the folded
+ * text with the *s taken out, segs are the runs between them as offset
+ * and length. head and tail say whether the first and last segments are
+ * pinned to the ends of what's matched, ie the mask didn't start or end
+ * with a * */
+struct mask {
+    char            pattern[MASK_MAX+1];
+    int             len;
+    int             head;
+    int             tail;
+    int             nr_segs;
+    unsigned char   segs[MASK_SEGS_MAX][2];
+};
+
+/* struct ban is one entry of a channel's ban list, text is the mask as it
+ * was set (filled out to nick!user@host), with who set it and when. it
+ * hangs off the trie node for its literal tail, host or head, or the
+ * list's unindexed masks if it has none of them. pos is where it is in
+ * banlist->bans */
+struct ban {
+    list_t      list_head;
+    ban_node_t  *node;
+    int         pos;
+    time_t      when;
+    char        text[MASK_MAX+1];
+    char        key[MASK_MAX+1];    /* text folded, for banlist->index */
+    char        setter[IRC_NICKNAME_MAX+1];
+    mask_t      mask;
+};
+
+/* struct ban_node is a node of a trie of literal tails, hosts or heads, the
+ * path from the root spells one (tails backwards), bans are those with
+ * exactly that */
+struct ban_node {
+    ban_node_t  *parent;
+    ban_node_t  *child;
+    ban_node_t  *sibling;
+    list_t      *bans;
+    char        c;
+};
+
+/* struct banlist is a channel's bans, in bans[] for listing and in one
+ * of the tries (or unindexed) for matching, and by folded text in index.
+ * gen goes up with every change, see member->ban_gen */
+struct banlist {
+    ban_t           **bans;
+    int             nr_bans;
+    int             max_bans;
+    unsigned long   gen;
+    list_t          *unindexed;
+    ban_node_t      tails;
+    ban_node_t      hosts;
+    ban_node_t      heads;
+    struct hash_table index;
+};
+
+int mask_compile (mask_t *, const char *);
+int mask_match (const mask_t *, const char *, int);
+int ban_normalize (char *, const slice_t *);
+banlist_t *ban_new (void);
+void ban_free (banlist_t *);
+int ban_add (banlist_t *, const char *, const char *, time_t);
+int ban_remove (banlist_t *, const char *);
+int ban_match (banlist_t *, const char *, int);
+#endif /* BAN_H */
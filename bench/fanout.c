@@ -0,0 +1,205 @@
+/* fanout.c - channel fan-out latency benchmark. registers a number of
+ * receivers and one sender, joins them all to one channel, then has the
+ * sender PRIVMSG it at a steady rate with a timestamp in every line.
+ * each receiver notes how long each line took to reach it, and we report
+ * the percentiles. bench/fanout.sh runs it against both backends and
+ * adds the daemon's syscalls per delivered line
+ * usage: fanout [host] [port] [receivers] [messages] [interval usecs]
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#define CHANNEL "#fanout"
+#define RECV_SIZE 65536
+
+static struct sockaddr_in addr;
+static int nr_receivers;
+static long nr_messages;
+static long *latencies;     /* nsecs, one per delivered line */
+static long nr_latencies;
+
+static long
+now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* _wait_for(fd, what)
+ * read (blocking) until what turns up in the stream */
+static int
+_wait_for (int fd, const char *what)
+{
+    static char buf[RECV_SIZE];
+    size_t len = 0;
+    ssize_t ret;
+
+    for (;;)
+    {
+        if (len == sizeof(buf) - 1)
+            len = 0;
+        if ((ret = recv(fd, buf + len, sizeof(buf) - 1 - len, 0)) <= 0)
+            return -1;
+        len += ret;
+        buf[len] = '\0';
+        if (strstr(buf, what))
+            return 0;
+    }
+}
+
+/* _client(nick)
+ * connect, register and join, returns the socket */
+static int
+_client (const char *nick)
+{
+    char line[256];
+    int fd;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1
+        || connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+    {
+        fprintf(stderr, "%s: %s\n", nick, strerror(errno));
+        exit(1);
+    }
+    snprintf(line, sizeof(line), "NICK %s\r\nUSER %s 0 * :%s\r\nJOIN "
+                                    CHANNEL "\r\n", nick, nick, nick);
+    if (send(fd, line, strlen(line), 0) == -1 || _wait_for(fd, " 366 "))
+    {
+        fprintf(stderr, "%s: couldn't register\n", nick);
+        exit(1);
+    }
+    return fd;
+}
+
+/* _receive(fds)
+ * collect every receiver's copy of every line */
+static void *
+_receive (void *arg)
+{
+    int *fds = arg, epfd, i, n, fd;
+    struct epoll_event ev, events[64];
+    char *buf, *p, *eol, *stamp;
+    size_t *lens;
+    long expected = (long)nr_receivers * nr_messages, t;
+    ssize_t ret;
+
+    buf = malloc((size_t)nr_receivers * RECV_SIZE);
+    lens = calloc(nr_receivers, sizeof(*lens));
+    epfd = epoll_create1(0);
+    for (i = 0; i < nr_receivers; ++i)
+    {
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev);
+    }
+    while (nr_latencies < expected)
+    {
+        if ((n = epoll_wait(epfd, events, 64, 5000)) <= 0)
+            break;      /* lines went missing, report what we have */
+        for (i = 0; i < n; ++i)
+        {
+            fd = events[i].data.u32;
+            p = buf + (size_t)fd * RECV_SIZE;
+            ret = recv(fds[fd], p + lens[fd], RECV_SIZE - 1 - lens[fd], 0);
+            if (ret <= 0)
+                continue;
+            t = now_ns();
+            lens[fd] += ret;
+            p[lens[fd]] = '\0';
+            while ((eol = strstr(p, "\r\n")))
+            {
+                if ((stamp = strstr(p, " PRIVMSG " CHANNEL " :"))
+                    && stamp < eol)
+                    latencies[nr_latencies++] = t
+                        - atol(stamp + sizeof(" PRIVMSG " CHANNEL " :") - 1);
+                eol += 2;
+                lens[fd] -= eol - p;
+                memmove(p, eol, lens[fd] + 1);
+            }
+        }
+    }
+    free(lens);
+    free(buf);
+    close(epfd);
+    return NULL;
+}
+
+static int
+_cmp (const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+int
+main (int argc, char **argv)
+{
+    const char *host = argc > 1 ? argv[1] : "127.0.0.1";
+    int port = argc > 2 ? atoi(argv[2]) : 6667;
+    long interval = argc > 5 ? atol(argv[5]) : 1000;
+    char nick[16], line[128];
+    pthread_t thread;
+    int *fds, sender, i;
+    long m, start, elapsed;
+
+    nr_receivers = argc > 3 ? atoi(argv[3]) : 500;
+    nr_messages = argc > 4 ? atol(argv[4]) : 2000;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+    {
+        fprintf(stderr, "bad address: %s\n", host);
+        return 1;
+    }
+    fds = calloc(nr_receivers, sizeof(*fds));
+    latencies = malloc((size_t)nr_receivers * nr_messages * sizeof(long));
+    if (!fds || !latencies)
+        return 1;
+    for (i = 0; i < nr_receivers; ++i)
+    {
+        snprintf(nick, sizeof(nick), "r%d", i);
+        fds[i] = _client(nick);
+    }
+    sender = _client("sender");
+
+    pthread_create(&thread, NULL, &_receive, fds);
+    start = now_ns();
+    for (m = 0; m < nr_messages; ++m)
+    {
+        snprintf(line, sizeof(line), "PRIVMSG " CHANNEL " :%ld\r\n",
+                                                                now_ns());
+        if (send(sender, line, strlen(line), 0) == -1)
+            break;
+        if (interval)
+            usleep(interval);
+    }
+    pthread_join(thread, NULL);
+    elapsed = now_ns() - start;
+
+    if (!nr_latencies)
+    {
+        fprintf(stderr, "nothing arrived\n");
+        return 1;
+    }
+    qsort(latencies, nr_latencies, sizeof(*latencies), &_cmp);
+    printf("%ld lines delivered (%ld expected) in %.2fs, latency usecs: "
+           "p50 %.1f p99 %.1f max %.1f\n", nr_latencies,
+           (long)nr_receivers * nr_messages, elapsed / 1e9,
+           latencies[nr_latencies / 2] / 1e3,
+           latencies[nr_latencies * 99 / 100] / 1e3,
+           latencies[nr_latencies - 1] / 1e3);
+    return 0;
+}
@@ -0,0 +1,32 @@
+#!/bin/sh
+# fanout.sh - run bench/fanout against the epoll and io_uring backends
+# and work out the daemon's socket syscalls per delivered line from what
+# it logs to ircd.err on the way out
+# usage: bench/fanout.sh [receivers] [messages] [interval usecs]
+# expects ./ircd (make IO_URING=1) and bench/fanout to be
+# built, uses 127.0.0.1:6667
+RECEIVERS=${1:-500}
+MESSAGES=${2:-2000}
+INTERVAL=${3:-1000}
+
+for backend in epoll io_uring
+do
+    flags=
+    [ "$backend" = io_uring ] && flags=-U
+    ./ircd -f -R 0 $flags &
+    pid=$!
+    sleep 1
+    printf '%-9s ' "$backend:"
+    out=$(bench/fanout 127.0.0.1 6667 "$RECEIVERS" "$MESSAGES" "$INTERVAL")
+    echo "$out"
+    kill -TERM "$pid"
+    wait "$pid"
+    delivered=${out%% lines*}
+    awk -v lines="$delivered" '/socket syscalls/ {
+            for (i = 2; i <= NF; ++i) {
+                if ($i == "socket") calls += $(i - 1)
+                if ($i == "loop") loops += $(i - 1) } }
+        END { if (lines) printf "          %.3f syscalls per line " \
+                "(%.3f counting loop wakeups)\n", calls / lines,
+                (calls + loops) / lines }' ircd.err
+done
@@ -0,0 +1,153 @@
+/* format.c - reply formatting benchmark, builds the same relayed lines and
+ * numerics with vsnprintf() (the way net_sendvf() does) and from reply.c's
+ * templates with cached user prefixes, and reports output bytes/sec
+ * usage: format [rounds]
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include "../ircd.h"
+#include "../reply.h"
+#include "../parse.h"
+
+#define DEFAULT_ROUNDS  200000
+#define NR_USERS        64
+#define SERVER_NAME     "irc.example.org"
+
+static const char *texts[] = {
+    "hi",
+    "anyone around who knows how to get libev to build on this thing?",
+    "lol",
+    "the quick brown fox jumps over the lazy dog, repeatedly, until the "
+        "dog finally gets up and leaves the channel in disgust",
+    "brb"
+};
+#define NR_TEXTS (sizeof(texts) / sizeof(*texts))
+
+static user_t users[NR_USERS];
+static char buffer[IRC_MESSAGE_MAX+1];
+
+static double
+now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static slice_t
+str (const char *s)
+{
+    slice_t slice;
+
+    slice.ptr = s;
+    slice.len = strlen(s);
+    return slice;
+}
+
+/* the old way, as net_sendvf() builds a line */
+static int
+format (const char *fmt, ...)
+{
+    va_list ap;
+    int size;
+
+    va_start(ap, fmt);
+    size = vsnprintf(buffer, IRC_MESSAGE_MAX, fmt, ap);
+    va_end(ap);
+    if (size > IRC_MESSAGE_MAX - 2)
+        size = IRC_MESSAGE_MAX - 2;
+    strcpy(buffer + size, "\r\n");
+    return size + 2;
+}
+
+static double
+run_printf (long rounds, long *bytes)
+{
+    user_t *u;
+    const char *text;
+    double start = now();
+    long r;
+
+    *bytes = 0;
+    for (r = 0; r < rounds; ++r)
+    {
+        u = &users[r % NR_USERS];
+        text = texts[r % NR_TEXTS];
+        *bytes += format(":%s!%s@%s PRIVMSG %s :%s", u->nickname, u->user,
+                                                u->host, "#bench", text);
+        *bytes += format(":%s!%s@%s JOIN %s", u->nickname, u->user, u->host,
+                                                                "#bench");
+        *bytes += format(":%s 433 %s %s :Nickname is already in use",
+                                    SERVER_NAME, u->nickname, u->nickname);
+    }
+    return now() - start;
+}
+
+static double
+run_template (long rounds, long *bytes)
+{
+    slice_t args[3], server = str(SERVER_NAME), chan = str("#bench");
+    slice_t text[NR_TEXTS];
+    user_t *u;
+    double start = now();
+    long r;
+    unsigned int i;
+
+    /* params arrive as slices from the parser, no strlen() for them */
+    for (i = 0; i < NR_TEXTS; ++i)
+        text[i] = str(texts[i]);
+
+    *bytes = 0;
+    for (r = 0; r < rounds; ++r)
+    {
+        u = &users[r % NR_USERS];
+        args[0] = user_prefix(u);
+        args[1] = chan;
+        args[2] = text[r % NR_TEXTS];
+        *bytes += reply_build(buffer, REPLY_PRIVMSG, args, 3);
+        *bytes += reply_build(buffer, REPLY_JOIN, args, 2);
+        args[0] = server;
+        args[1] = str(u->nickname);
+        args[2] = args[1];
+        *bytes += reply_build(buffer, ERR_NICKNAMEINUSE, args, 3);
+    }
+    return now() - start;
+}
+
+int
+main (int argc, char **argv)
+{
+    long rounds = argc > 1 ? atol(argv[1]) : DEFAULT_ROUNDS;
+    long bytes_printf, bytes_template;
+    double t_printf, t_template;
+    int i;
+
+    reply_init();
+    for (i = 0; i < NR_USERS; ++i)
+    {
+        snprintf(users[i].nickname, sizeof(users[i].nickname), "nick%d", i);
+        snprintf(users[i].user, sizeof(users[i].user), "~user%d", i);
+        snprintf(users[i].host, sizeof(users[i].host),
+                                    "host-%d.dsl.example.net", i * 7919);
+    }
+
+    t_printf = run_printf(rounds, &bytes_printf);
+    t_template = run_template(rounds, &bytes_template);
+    if (bytes_printf != bytes_template)
+    {
+        fprintf(stderr, "output differs: %ld vs %ld bytes\n", bytes_printf,
+                                                            bytes_template);
+        return 1;
+    }
+
+    printf("vsnprintf: %ld lines in %.3fs: %.1f MB/sec\n", rounds * 3,
+                            t_printf, bytes_printf / t_printf / 1e6);
+    printf("templates: %ld lines in %.3fs: %.1f MB/sec (%.2fx)\n", rounds * 3,
+                            t_template, bytes_template / t_template / 1e6,
+                            t_printf / t_template);
+    return 0;
+}
@@ -0,0 +1,376 @@
+/* loadgen.c - load generator, opens a number of clients against the
+ * daemon, registers them, joins each to a few channels picked from a
+ * size distribution (zipf by default, so a few big channels and a long
+ * tail of small ones, like a real network) and then has random clients
+ * PRIVMSG random channels of theirs at a steady rate for a while. every
+ * line carries the time it was sent, so each copy that comes back gives
+ * a delivery latency. reports messages and lines/sec, latency
+ * percentiles, and with -p the daemon's RSS along the way. bench/loadgen.sh
+ * builds and runs the lot
+ * usage: loadgen [-c clients] [-n channels] [-j joins] [-d uniform|zipf:s]
+ *                [-r msgs/sec] [-t seconds] [-p ircd pid] [host [port]]
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include "../ircd.h"    /* for IRCD_HOST, IRCD_PORT */
+
+#define RECV_SIZE       8192
+#define SETUP_TIMEOUT   60      /* seconds to register and join */
+#define DRAIN_TIME      1.0     /* seconds to wait for stragglers */
+#define LATENCY_MAX     1000000 /* usecs, slower counts as the max */
+
+/* struct conn is one client, seen counts the replies we're waiting for
+ * while setting up, chans are indexes into members */
+struct conn {
+    int         fd;
+    char        buf[RECV_SIZE];
+    size_t      len;
+    int         seen;
+    int         *chans;
+    int         nr_chans;
+};
+
+static struct conn *conns;
+static int nr_conns = 1000;
+static int nr_channels = 100;
+static int nr_joins = 2;
+static double zipf_s = 1.0;     /* 0 for uniform */
+static double *cdf;             /* channel popularity */
+static int *members;            /* per channel */
+
+static unsigned int latencies[LATENCY_MAX + 1];
+static long nr_sent, nr_expected, nr_delivered;
+
+static double
+now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long
+now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* rss(pid)
+ * resident set size in KB, or -1 if we can't tell */
+static long
+rss (int pid)
+{
+    char path[64], line[256];
+    long kb = -1;
+    FILE *file;
+
+    if (!pid)
+        return -1;
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    if (!(file = fopen(path, "r")))
+        return -1;
+    while (fgets(line, sizeof(line), file))
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1)
+            break;
+    fclose(file);
+    return kb;
+}
+
+/* pick_channel()
+ * a channel index from the distribution */
+static int
+pick_channel (void)
+{
+    double x = drand48();
+    int lo = 0, hi = nr_channels - 1, mid;
+
+    if (zipf_s == 0)
+        return lrand48() % nr_channels;
+    while (lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if (cdf[mid] < x)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void
+send_line (struct conn *conn, const char *line)
+{
+    if (send(conn->fd, line, strlen(line), MSG_NOSIGNAL) == -1
+        && errno != EAGAIN)
+    {
+        perror("send");
+        exit(1);
+    }
+}
+
+/* on_line(conn, line)
+ * a line from the daemon, while setting up we count the numerics we're
+ * waiting for, after that it's timestamped channel traffic */
+static void
+on_line (struct conn *conn, char *line, long t)
+{
+    char *p;
+    long us;
+
+    if ((p = strstr(line, " PRIVMSG #")) && (p = strstr(p, " :")))
+    {
+        us = (t - atol(p + 2)) / 1000;
+        latencies[us < 0 ? 0 : us > LATENCY_MAX ? LATENCY_MAX : us]++;
+        nr_delivered++;
+    }
+    else if (strstr(line, " 001 ") || strstr(line, " 366 "))
+        conn->seen++;
+    else if (!strncmp(line, "ERROR", 5))
+    {
+        fprintf(stderr, "dropped: %s\n", line);
+        exit(1);
+    }
+}
+
+/* poll_conns(epfd, timeout)
+ * read whatever's arrived, line by line */
+static void
+poll_conns (int epfd, int timeout)
+{
+    struct epoll_event events[256];
+    struct conn *conn;
+    char *p, *eol;
+    ssize_t ret;
+    long t;
+    int i, n;
+
+    n = epoll_wait(epfd, events, 256, timeout);
+    t = now_ns();
+    for (i = 0; i < n; ++i)
+    {
+        conn = events[i].data.ptr;
+        ret = recv(conn->fd, conn->buf + conn->len,
+                                    RECV_SIZE - 1 - conn->len, 0);
+        if (ret <= 0)
+        {
+            if (ret == 0 || errno != EAGAIN)
+            {
+                fprintf(stderr, "connection closed by the daemon\n");
+                exit(1);
+            }
+            continue;
+        }
+        conn->len += ret;
+        conn->buf[conn->len] = '\0';
+        for (p = conn->buf; (eol = strstr(p, "\r\n")); p = eol + 2)
+        {
+            *eol = '\0';
+            on_line(conn, p, t);
+        }
+        conn->len -= p - conn->buf;
+        memmove(conn->buf, p, conn->len);
+        if (conn->len == RECV_SIZE - 1)
+            conn->len = 0;  /* one huge line, never mind */
+    }
+}
+
+/* wait_for(epfd, count, what)
+ * poll until every connection has seen count of the numerics */
+static void
+wait_for (int epfd, int count, const char *what)
+{
+    double deadline = now() + SETUP_TIMEOUT;
+    int i;
+
+    for (i = 0; i < nr_conns; )
+    {
+        if (conns[i].seen >= count)
+        {
+            ++i;
+            continue;
+        }
+        if (now() > deadline)
+        {
+            fprintf(stderr, "timed out waiting for %s\n", what);
+            exit(1);
+        }
+        poll_conns(epfd, 100);
+    }
+}
+
+/* percentile(p)
+ * latency in usecs that fraction p of deliveries beat */
+static long
+percentile (double p)
+{
+    long want = (long)ceil(nr_delivered * p), count = 0;
+    long us;
+
+    for (us = 0; us < LATENCY_MAX; ++us)
+        if ((count += latencies[us]) >= want)
+            break;
+    return us;
+}
+
+int
+main (int argc, char **argv)
+{
+    const char *host = IRCD_HOST;
+    int port = IRCD_PORT, pid = 0, rate = 1000, opt, epfd, i, j, k;
+    double seconds = 10, start, elapsed, sum;
+    struct sockaddr_in addr;
+    struct epoll_event ev;
+    char line[512];
+    long rss_idle, rss_loaded, largest = 0;
+
+    while ((opt = getopt(argc, argv, "c:d:j:n:p:r:t:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c':   nr_conns = atoi(optarg);
+                        break;
+            case 'd':   if (!strcmp(optarg, "uniform"))
+                            zipf_s = 0;
+                        else if (sscanf(optarg, "zipf:%lf", &zipf_s) != 1)
+                            goto usage;
+                        break;
+            case 'j':   nr_joins = atoi(optarg);
+                        break;
+            case 'n':   nr_channels = atoi(optarg);
+                        break;
+            case 'p':   pid = atoi(optarg);
+                        break;
+            case 'r':   rate = atoi(optarg);
+                        break;
+            case 't':   seconds = atof(optarg);
+                        break;
+            default:
+            usage:      fprintf(stderr, "usage: %s [-c clients] [-n channels] "
+                                "[-j joins] [-d uniform|zipf:s] [-r msgs/sec] "
+                                "[-t seconds] [-p ircd pid] [host [port]]\n",
+                                                                    argv[0]);
+                        return 1;
+        }
+    }
+    if (optind < argc)
+        host = argv[optind++];
+    if (optind < argc)
+        port = atoi(argv[optind]);
+    if (nr_conns < 2 || nr_channels < 1 || nr_joins < 1
+        || nr_joins > nr_channels || rate < 1)
+        goto usage;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+    {
+        fprintf(stderr, "bad address: %s\n", host);
+        return 1;
+    }
+    conns = calloc(nr_conns, sizeof(*conns));
+    cdf = malloc(nr_channels * sizeof(*cdf));
+    members = calloc(nr_channels, sizeof(*members));
+    if (!conns || !cdf || !members || (epfd = epoll_create1(0)) == -1)
+        return 1;
+    srand48(getpid());
+    for (sum = 0, k = 0; k < nr_channels; ++k)
+        sum += cdf[k] = zipf_s ? 1 / pow(k + 1, zipf_s) : 1;
+    for (k = 0; k < nr_channels; ++k)
+        cdf[k] = (k ? cdf[k - 1] : 0) + cdf[k] / sum;
+
+    /* connect and register everyone */
+    rss_idle = rss(pid);
+    start = now();
+    for (i = 0; i < nr_conns; ++i)
+    {
+        conns[i].fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (conns[i].fd == -1
+            || connect(conns[i].fd, (struct sockaddr *)&addr, sizeof(addr)))
+        {
+            fprintf(stderr, "connection %d: %s\n", i, strerror(errno));
+            return 1;
+        }
+        fcntl(conns[i].fd, F_SETFL, O_NONBLOCK);
+        ev.events = EPOLLIN;
+        ev.data.ptr = &conns[i];
+        epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i].fd, &ev);
+        snprintf(line, sizeof(line), "NICK lg%d\r\nUSER lg%d 0 * :loadgen\r\n",
+                                                                    i, i);
+        send_line(&conns[i], line);
+    }
+    wait_for(epfd, 1, "registration");
+
+    /* everyone joins nr_joins different channels */
+    for (i = 0; i < nr_conns; ++i)
+    {
+        conns[i].chans = malloc(nr_joins * sizeof(int));
+        while (conns[i].nr_chans < nr_joins)
+        {
+            k = pick_channel();
+            for (j = 0; j < conns[i].nr_chans && conns[i].chans[j] != k; ++j)
+                ;
+            if (j < conns[i].nr_chans)
+                continue;
+            conns[i].chans[conns[i].nr_chans++] = k;
+            if (++members[k] > largest)
+                largest = members[k];
+            snprintf(line, sizeof(line), "JOIN #lg%d\r\n", k);
+            send_line(&conns[i], line);
+        }
+    }
+    wait_for(epfd, 1 + nr_joins, "joins");
+    for (k = 0, j = 0; k < nr_channels; ++k)
+        j += members[k] > 0;
+    printf("%d clients in %d channels (largest %ld), set up in %.2fs\n",
+                            nr_conns, j, largest, now() - start);
+    rss_loaded = rss(pid);
+
+    /* traffic, paced against the clock so we don't fall behind when the
+     * daemon's slow, the backlog just goes out in a burst */
+    start = now();
+    while ((elapsed = now() - start) < seconds)
+    {
+        while (nr_sent < elapsed * rate)
+        {
+            i = lrand48() % nr_conns;
+            k = conns[i].chans[lrand48() % nr_joins];
+            snprintf(line, sizeof(line), "PRIVMSG #lg%d :%ld\r\n", k,
+                                                                now_ns());
+            send_line(&conns[i], line);
+            nr_sent++;
+            nr_expected += members[k] - 1;
+        }
+        poll_conns(epfd, 1);
+    }
+    while (nr_delivered < nr_expected && now() - start < seconds + DRAIN_TIME)
+        poll_conns(epfd, 10);
+    elapsed = now() - start;
+
+    printf("%ld messages, %ld of %ld lines delivered in %.2fs: "
+           "%.0f msgs/sec, %.0f lines/sec\n", nr_sent, nr_delivered,
+           nr_expected, elapsed, nr_sent / elapsed, nr_delivered / elapsed);
+    if (nr_delivered)
+        printf("latency usecs: p50 %ld p99 %ld p999 %ld\n", percentile(0.5),
+                            percentile(0.99), percentile(0.999));
+    if (pid)
+        printf("ircd RSS: %ld KB idle, %ld KB with clients, %ld KB after "
+               "traffic\n", rss_idle, rss_loaded, rss(pid));
+    for (i = 0; i < nr_conns; ++i)
+        close(conns[i].fd);
+    return 0;
+}
@@ -0,0 +1,17 @@
+#!/bin/sh
+# loadgen.sh - build the daemon and bench/loadgen, start ./ircd and run
+# the load generator against it, any arguments are passed on to loadgen
+# (see bench/loadgen.c). set IRCD_FLAGS for the daemon, eg -w 4 or -U
+# usage: bench/loadgen.sh [loadgen options]
+# uses IRCD_HOST:IRCD_PORT, from ircd.h
+make ircd bench/loadgen || exit 1
+
+# hostname lookups are off, they're not what we're measuring
+./ircd -f -R 0 $IRCD_FLAGS &
+pid=$!
+sleep 1
+bench/loadgen -p "$pid" "$@"
+status=$?
+kill -TERM "$pid"
+wait "$pid"
+exit $status
@@ -0,0 +1,493 @@
+/* micro.c - microbenchmarks for the daemon's inner loops: the nick/channel
+ * hash table at 1k, 10k and 100k keys, folding names for it, the
+ * intrusive list, formatting a line with net_sendvf() onto a send queue,
+ * send queue block churn through the buffer pool, and checking a JOIN
+ * against 10 to 10k bans. each benchmark sets up, runs its steady state
+ * loop over and over and reports ns/op, plus allocations/op: malloc()s,
+ * which we count by standing in for malloc, and pool misses, which had
+ * to carve fresh buffers out of the pool rather than reuse one. a number
+ * going up from one build to the next is a regression
+ * usage: micro [rounds] [filter]
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include "../ircd.h"
+#include "../ban.h"
+#include "../casemap.h"
+#include "../hash.h"
+#include "../list.h"
+#include "../net.h"
+#include "../pool.h"
+#include "../worker.h"
+
+#define DEFAULT_ROUNDS  20
+#define LIST_NODES      10000
+#define SEND_BATCH      64      /* lines queued between flushes */
+#define BAN_SUBJECTS    1024    /* people checked against the bans */
+
+/* the bits of ircd.c the objects we link against expect */
+void
+drop (client_t *client, int reason)
+{
+    fprintf(stderr, "client dropped (%d)\n", reason);
+    exit(1);
+}
+
+void
+client_unref (client_t *client)
+{
+    __atomic_sub_fetch(&client->refs, 1, __ATOMIC_ACQ_REL);
+}
+
+void
+client_reap (worker_t *worker)
+{
+}
+
+/* counting malloc, forwarding to glibc's own */
+extern void *__libc_malloc (size_t);
+extern void *__libc_calloc (size_t, size_t);
+extern void *__libc_realloc (void *, size_t);
+static unsigned long nr_mallocs;
+
+void *
+malloc (size_t size)
+{
+    nr_mallocs++;
+    return __libc_malloc(size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+    nr_mallocs++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+    nr_mallocs++;
+    return __libc_realloc(ptr, size);
+}
+
+static long
+now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* pool_misses()
+ * buffers carved out of the pool so far, over every class */
+static unsigned long
+pool_misses (void)
+{
+    pool_stats_t stats;
+    unsigned long misses = 0;
+    int i;
+
+    for (i = 0; i < POOL_CLASSES; ++i)
+    {
+        pool_stats(i, &stats);
+        misses += stats.misses;
+    }
+    return misses;
+}
+
+/* struct run is one benchmark's tally, see run_start()/run_stop() */
+struct run {
+    const char      *name;
+    long            start;
+    unsigned long   mallocs;
+    unsigned long   misses;
+};
+
+static const char *filter;
+
+/* run_start(run, name)
+ * returns 0 if the filter on the command line says skip it */
+static int
+run_start (struct run *run, const char *name)
+{
+    if (filter && !strstr(name, filter))
+        return 0;
+    run->name = name;
+    run->mallocs = nr_mallocs;
+    run->misses = pool_misses();
+    run->start = now_ns();
+    return 1;
+}
+
+static void
+run_stop (struct run *run, double ops)
+{
+    long elapsed = now_ns() - run->start;
+
+    printf("%-24s %12.0f ops %9.1f ns/op %9.3f mallocs/op %9.3f pool "
+           "misses/op\n", run->name, ops, elapsed / ops,
+           (nr_mallocs - run->mallocs) / ops,
+           (pool_misses() - run->misses) / ops);
+}
+
+/* make_nick(buf, seed)
+ * something that looks like a nick off a real network: mostly a word
+ * or two of 3 to 9 letters with some capitals, often followed by a few
+ * digits, an underscore or an |away style suffix */
+static void
+make_nick (char *buf, unsigned int *seed)
+{
+    static const char *syllables[] = {
+        "ka", "ro", "ne", "mi", "to", "dar", "xen", "ly", "ph", "oe",
+        "zz", "th", "qu", "in", "ster", "bo", "vi", "ck", "al", "jo"
+    };
+    static const char *suffixes[] = {
+        "", "", "", "", "_", "__", "|away", "|work", "`", "^"
+    };
+    int len = 0, n, i;
+
+    n = 1 + rand_r(seed) % 4;
+    for (i = 0; i < n; ++i)
+    {
+        len += sprintf(buf + len, "%s", syllables[rand_r(seed) % 20]);
+        if (rand_r(seed) % 4 == 0)
+            buf[len - 2] &= ~0x20;  /* CamelCase */
+    }
+    if (rand_r(seed) % 3 == 0)
+        len += sprintf(buf + len, "%d", rand_r(seed) % 1000);
+    snprintf(buf + len, IRC_NICKNAME_MAX + 1 - len, "%s",
+                                        suffixes[rand_r(seed) % 10]);
+    if (buf[0] >= '0' && buf[0] <= '9')
+        buf[0] = 'x';
+}
+
+/* make_nicks(n, seed)
+ * n distinct nicks, folded as they'd be in the nick table */
+static char **
+make_nicks (int n, unsigned int seed)
+{
+    struct hash_table seen;
+    char **nicks, nick[IRC_NICKNAME_MAX + 8];
+    int i;
+
+    hash_init(&seen);
+    nicks = malloc(n * sizeof(*nicks));
+    for (i = 0; i < n; )
+    {
+        make_nick(nick, &seed);
+        nick[IRC_NICKNAME_MAX] = '\0';
+        casemap_fold(nick, nick, strlen(nick));
+        if (hash_lookup(&seen, nick))
+        {
+            /* common nicks collide, people then stick digits on */
+            sprintf(nick + strlen(nick) / 2, "%d", i);
+            if (hash_lookup(&seen, nick))
+                continue;
+        }
+        nicks[i] = strdup(nick);
+        hash_insert(&seen, nicks[i], nicks[i]);
+        i++;
+    }
+    hash_free(&seen);
+    return nicks;
+}
+
+static void
+bench_hash (int n, long rounds)
+{
+    struct hash_table table;
+    struct run run;
+    char **nicks, **typed, **misses, name[64], key[IRC_NICKNAME_MAX+1];
+    const char *what;
+    unsigned int seed = n;
+    long r, found = 0;
+    int i;
+
+    nicks = make_nicks(n, 1);
+    misses = make_nicks(n, 2);
+
+    /* lookups come in whatever case the client typed */
+    typed = malloc(n * sizeof(*typed));
+    for (i = 0; i < n; ++i)
+    {
+        typed[i] = strdup(nicks[i]);
+        if (i % 3 == 0 && typed[i][0] >= 'a')
+            typed[i][0] ^= 0x20;
+    }
+
+    hash_init(&table);
+    snprintf(name, sizeof(name), "hash_insert %dk", n / 1000);
+    if (run_start(&run, name))
+    {
+        for (r = 0; r < rounds; ++r)
+        {
+            for (i = 0; i < n; ++i)
+                hash_insert(&table, nicks[i], nicks[i]);
+            if (r < rounds - 1)
+                for (i = 0; i < n; ++i)
+                    hash_remove(&table, nicks[i]);
+        }
+        run_stop(&run, (double)rounds * n);
+    }
+    else
+        for (i = 0; i < n; ++i)
+            hash_insert(&table, nicks[i], nicks[i]);
+
+    /* a realistic mix, most PRIVMSGs are to nicks that exist, folded
+     * first the way command.c does */
+    snprintf(name, sizeof(name), "hash_lookup %dk", n / 1000);
+    if (run_start(&run, name))
+    {
+        for (r = 0; r < rounds * 10; ++r)
+            for (i = 0; i < n; ++i)
+            {
+                what = rand_r(&seed) % 8 ? typed[i] : misses[i];
+                casemap_fold(key, what, strlen(what));
+                found += !!hash_lookup(&table, key);
+            }
+        run_stop(&run, (double)rounds * 10 * n);
+    }
+
+    /* nick changes, out with the old and in with a new one */
+    snprintf(name, sizeof(name), "hash_remove+insert %dk", n / 1000);
+    if (run_start(&run, name))
+    {
+        for (r = 0; r < rounds; ++r)
+            for (i = 0; i < n; ++i)
+            {
+                hash_remove(&table, r & 1 ? misses[i] : nicks[i]);
+                hash_insert(&table, r & 1 ? nicks[i] : misses[i], nicks[i]);
+            }
+        run_stop(&run, (double)rounds * n);
+    }
+    if (found < 0)
+        printf("%ld\n", found);
+    hash_free(&table);
+    for (i = 0; i < n; ++i)
+    {
+        free(nicks[i]);
+        free(typed[i]);
+        free(misses[i]);
+    }
+    free(nicks);
+    free(typed);
+    free(misses);
+}
+
+/* bench_casemap(len, rounds)
+ * folding a name len long, nicks are short and never see the wide path,
+ * a ban check folds a whole nick!user@host */
+static void
+bench_casemap (int len, long rounds)
+{
+    char text[IRC_PREFIX_MAX+1], buf[IRC_PREFIX_MAX+1], name[64];
+    struct run run;
+    long r, sum = 0;
+    int i;
+
+    for (i = 0; i < len; ++i)
+        text[i] = "Nick[Away]!~User@Host.Example.NET"[i % 33];
+    snprintf(name, sizeof(name), "casemap_fold %d", len);
+    if (run_start(&run, name))
+    {
+        for (r = 0; r < rounds; ++r)
+        {
+            casemap_fold(buf, text, len);
+            /* keep the fold from being thrown away */
+            sum += buf[r % len];
+            text[0] = buf[len - 1];
+        }
+        run_stop(&run, (double)rounds);
+    }
+    if (sum < 0)
+        printf("%ld\n", sum);
+}
+
+static void
+bench_list (long rounds)
+{
+    list_t *nodes, *head = NULL;
+    struct run run;
+    long r;
+    int i, *order, j, tmp;
+    unsigned int seed = 1;
+
+    nodes = calloc(LIST_NODES, sizeof(*nodes));
+    order = malloc(LIST_NODES * sizeof(*order));
+    for (i = 0; i < LIST_NODES; ++i)
+        order[i] = i;
+    for (i = LIST_NODES - 1; i > 0; --i)
+    {
+        j = rand_r(&seed) % (i + 1);
+        tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    if (run_start(&run, "list_push+pop"))
+    {
+        for (r = 0; r < rounds * 100; ++r)
+        {
+            for (i = 0; i < LIST_NODES; ++i)
+                list_push(&head, &nodes[i]);
+            while (list_pop(&head))
+                ;
+        }
+        run_stop(&run, (double)rounds * 100 * LIST_NODES);
+    }
+    /* clients leave in no particular order */
+    if (run_start(&run, "list_push+unlink"))
+    {
+        for (r = 0; r < rounds * 100; ++r)
+        {
+            for (i = 0; i < LIST_NODES; ++i)
+                list_push(&head, &nodes[i]);
+            for (i = 0; i < LIST_NODES; ++i)
+                list_unlink(&head, &nodes[order[i]]);
+        }
+        run_stop(&run, (double)rounds * 100 * LIST_NODES);
+    }
+    free(order);
+    free(nodes);
+}
+
+/* _sendf(client, fmt, ...)
+ * so we go through net_sendvf() itself, like net_sendf() does */
+static ssize_t
+_sendf (client_t *client, const char *fmt, ...)
+{
+    va_list ap;
+    ssize_t ret;
+
+    va_start(ap, fmt);
+    ret = net_sendvf(client, fmt, ap);
+    va_end(ap);
+    return ret;
+}
+
+/* _reset(client)
+ * throw away what's been queued, as if it had been written */
+static void
+_reset (client_t *client)
+{
+    net_free_sendq(client);
+    client->dirty = 0;
+    client->worker->dirty_list = NULL;
+}
+
+static void
+bench_net (long rounds)
+{
+    static client_t client;
+    worker_t *worker = &workers[0];
+    send_buffer_t *blocks[SEND_BATCH];
+    struct run run;
+    long r, ops;
+    int i;
+
+    /* a client of ours that never gets flushed */
+    worker_self = worker;
+    client.worker = worker;
+    client.refs = 1;
+    client.fd = 0;
+    client.out_buf.max = (size_t)-1;
+
+    if (run_start(&run, "net_sendvf"))
+    {
+        for (ops = 0, r = 0; r < rounds * 1000; ++r)
+        {
+            for (i = 0; i < SEND_BATCH; ++i, ++ops)
+                _sendf(&client, ":%s!%s@%s PRIVMSG %s :%s %ld", "someone",
+                            "user", "host.example.org", "#channel",
+                            "the quick brown fox jumps over the lazy dog", r);
+            _reset(&client);
+        }
+        run_stop(&run, ops);
+    }
+    if (run_start(&run, "net_alloc/free_sendbuf"))
+    {
+        for (ops = 0, r = 0; r < rounds * 10000; ++r)
+        {
+            for (i = 0; i < SEND_BATCH; ++i, ++ops)
+                blocks[i] = net_alloc_sendbuf();
+            for (i = 0; i < SEND_BATCH; ++i)
+                net_free_sendbuf(blocks[i]);
+        }
+        run_stop(&run, ops);
+    }
+}
+
+/* bench_ban(n, rounds)
+ * n bans the way they pile up on a busy channel, mostly hosts and
+ * domains with a few nick bans and the odd *!*@* style wildcard, then
+ * people joining, one in eight of whom is banned */
+static void
+bench_ban (int n, long rounds)
+{
+    char subjects[BAN_SUBJECTS][IRC_PREFIX_MAX+1], text[MASK_MAX+1];
+    int lens[BAN_SUBJECTS];
+    banlist_t *list;
+    struct run run;
+    unsigned int seed = n;
+    long r, banned = 0;
+    int i;
+
+    list = ban_new();
+    for (i = 0; i < n; ++i)
+    {
+        switch (i % 16)
+        {
+            case 0:     snprintf(text, sizeof(text), "spam%d*!*@*", i);
+                        break;
+            case 1:     snprintf(text, sizeof(text), "nick%d!*@*", i);
+                        break;
+            case 2:     snprintf(text, sizeof(text), "*!*@10.%d.%d.*",
+                                                    i / 256 % 256, i % 256);
+                        break;
+            default:    snprintf(text, sizeof(text),
+                                        "*!*@*.Host%d.example.net", i);
+                        break;
+        }
+        ban_add(list, text, "op", 0);
+    }
+    for (i = 0; i < BAN_SUBJECTS; ++i)
+        lens[i] = sprintf(subjects[i], "Someone%d!~user@%s%d.example.net",
+                            i, "dsl.host", rand_r(&seed) % 8 ? n + i
+                                                    : (i * 16 + 3) % n);
+
+    snprintf(text, sizeof(text), "ban_match %d", n);
+    if (run_start(&run, text))
+    {
+        for (r = 0; r < rounds; ++r)
+            for (i = 0; i < BAN_SUBJECTS; ++i)
+                banned += ban_match(list, subjects[i], lens[i]);
+        run_stop(&run, (double)rounds * BAN_SUBJECTS);
+    }
+    if (banned < 0)
+        printf("%ld\n", banned);
+    ban_free(list);
+}
+
+int
+main (int argc, char **argv)
+{
+    long rounds = argc > 1 ? atol(argv[1]) : DEFAULT_ROUNDS;
+
+    filter = argc > 2 ? argv[2] : NULL;
+    bench_hash(1000, rounds * 100);
+    bench_hash(10000, rounds * 10);
+    bench_hash(100000, rounds);
+    bench_casemap(IRC_NICKNAME_MAX, rounds * 100000);
+    bench_casemap(64, rounds * 100000);
+    bench_list(rounds);
+    bench_net(rounds);
+    bench_ban(10, rounds * 100);
+    bench_ban(1000, rounds * 100);
+    bench_ban(10000, rounds * 100);
+    return 0;
+}
@@ -0,0 +1,95 @@
+/* parse_bench.c - parse_message() microbenchmark, reports parsed lines/sec
+ * over a recorded corpus of \r\n terminated lines (bench/corpus.irc)
+ * usage: parse_bench [corpus] [rounds]
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "../parse.h"
+
+#define DEFAULT_CORPUS "bench/corpus.irc"
+#define DEFAULT_ROUNDS 20000
+
+static double
+now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main (int argc, char **argv)
+{
+    const char *path = argc > 1 ? argv[1] : DEFAULT_CORPUS;
+    long rounds = argc > 2 ? atol(argv[2]) : DEFAULT_ROUNDS;
+    FILE *fp;
+    char *corpus, *p, *eol;
+    long size, r, nr_lines, bad, params;
+    slice_t *lines;
+    message_t msg;
+    double start, elapsed;
+    int i;
+
+    if (!(fp = fopen(path, "rb")))
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    rewind(fp);
+    corpus = malloc(size + 1);
+    lines = malloc((size + 1) * sizeof(*lines));
+    if (!corpus || !lines || fread(corpus, 1, size, fp) != (size_t)size)
+    {
+        fprintf(stderr, "couldn't read %s\n", path);
+        return 1;
+    }
+    fclose(fp);
+    corpus[size] = '\0';
+
+    /* frame the corpus once up front, we're only timing the parser */
+    nr_lines = 0;
+    for (p = corpus; p < corpus + size; p = eol + 1)
+    {
+        if (!(eol = memchr(p, '\n', corpus + size - p)))
+            eol = corpus + size;
+        lines[nr_lines].ptr = p;
+        lines[nr_lines].len = eol - p;
+        if (lines[nr_lines].len && p[lines[nr_lines].len - 1] == '\r')
+            lines[nr_lines].len--;
+        if (lines[nr_lines].len)
+            nr_lines++;
+    }
+    if (!nr_lines)
+    {
+        fprintf(stderr, "%s: no lines\n", path);
+        return 1;
+    }
+
+    bad = params = 0;
+    start = now();
+    for (r = 0; r < rounds; ++r)
+    {
+        for (i = 0; i < nr_lines; ++i)
+        {
+            if (parse_message(&msg, lines[i].ptr, lines[i].len))
+                bad++;
+            else
+                params += msg.nr_params;
+        }
+    }
+    elapsed = now() - start;
+
+    printf("%ld lines x %ld rounds in %.3fs: %.0f lines/sec, %.1f ns/line "
+           "(%ld rejected, %ld params)\n", nr_lines, rounds, elapsed,
+           nr_lines * rounds / elapsed, elapsed * 1e9 / (nr_lines * rounds),
+           bad / rounds, params / rounds);
+    free(lines);
+    free(corpus);
+    return 0;
+}
@@ -0,0 +1,159 @@
+/* scale.c - worker mode scaling benchmark, opens a number of connections
+ * to the daemon, registers each and joins it to a channel of its own,
+ * then pipelines PRIVMSGs to that channel down all of them as fast as
+ * it will take them for a while. the daemon reads, frames, parses and
+ * dispatches everything but has nobody to relay it to, so once it's
+ * saturated TCP backpressure caps our write rate and lines/sec is its
+ * ingest rate. bench/scale.sh runs this against 1..N workers
+ * usage: scale [host] [port] [connections] [seconds]
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#define LINE "PRIVMSG #bench%d :the quick brown fox jumps over the lazy dog\r\n"
+#define BATCH 64        /* lines per write() */
+#define SETUP "NICK sc%d\r\nUSER sc%d 0 * :scale\r\nJOIN #bench%d\r\n"
+
+static double
+now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* _join(fd, i)
+ * register and join connection i, returns -1 if that didn't work */
+static int
+_join (int fd, int i)
+{
+    char buf[4096];
+    size_t len = 0;
+    ssize_t ret;
+
+    len = snprintf(buf, sizeof(buf), SETUP, i, i, i);
+    if (write(fd, buf, len) != (ssize_t)len)
+        return -1;
+    for (len = 0; ; )
+    {
+        if (len == sizeof(buf) - 1)
+            len = 0;
+        if ((ret = read(fd, buf + len, sizeof(buf) - 1 - len)) <= 0)
+            return -1;
+        len += ret;
+        buf[len] = '\0';
+        if (strstr(buf, " 366 "))
+            return 0;
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+    const char *host = argc > 1 ? argv[1] : "127.0.0.1";
+    int port = argc > 2 ? atoi(argv[2]) : 6667;
+    int nr_conns = argc > 3 ? atoi(argv[3]) : 256;
+    double seconds = argc > 4 ? atof(argv[4]) : 5;
+    struct sockaddr_in addr;
+    struct pollfd *fds;
+    char line[sizeof(LINE) + 16], **batch;
+    size_t *offset, *len, *line_len;
+    double lines = 0, start, end;
+    long long bytes = 0;
+    ssize_t ret;
+    int i, j;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+    {
+        fprintf(stderr, "bad address: %s\n", host);
+        return 1;
+    }
+    fds = calloc(nr_conns, sizeof(*fds));
+    offset = calloc(nr_conns, sizeof(*offset));
+    len = calloc(nr_conns, sizeof(*len));
+    line_len = calloc(nr_conns, sizeof(*line_len));
+    batch = calloc(nr_conns, sizeof(*batch));
+    if (!fds || !offset || !len || !line_len || !batch)
+        return 1;
+    for (i = 0; i < nr_conns; ++i)
+    {
+        fds[i].fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fds[i].fd == -1
+            || connect(fds[i].fd, (struct sockaddr *)&addr, sizeof(addr)))
+        {
+            fprintf(stderr, "connection %d: %s\n", i, strerror(errno));
+            return 1;
+        }
+        if (_join(fds[i].fd, i))
+        {
+            fprintf(stderr, "connection %d: couldn't join\n", i);
+            return 1;
+        }
+        fcntl(fds[i].fd, F_SETFL, O_NONBLOCK);
+        fds[i].events = POLLOUT;
+
+        /* every connection talks to its own channel */
+        line_len[i] = snprintf(line, sizeof(line), LINE, i);
+        if (!(batch[i] = malloc(line_len[i] * BATCH)))
+            return 1;
+        for (j = 0; j < BATCH; ++j, len[i] += line_len[i])
+            memcpy(batch[i] + len[i], line, line_len[i]);
+    }
+
+    /* offset[i] is how far into the batch connection i got, so every
+     * byte counted is part of a whole line stream */
+    start = now();
+    end = start + seconds;
+    while (now() < end)
+    {
+        if (poll(fds, nr_conns, 100) <= 0)
+            continue;
+        for (i = 0; i < nr_conns; ++i)
+        {
+            if (!(fds[i].revents & POLLOUT))
+                continue;
+            ret = write(fds[i].fd, batch[i] + offset[i], len[i] - offset[i]);
+            if (ret <= 0)
+            {
+                if (ret == -1 && errno != EAGAIN)
+                {
+                    fprintf(stderr, "connection %d: %s\n", i, strerror(errno));
+                    return 1;
+                }
+                continue;
+            }
+            bytes += ret;
+            lines += (double)ret / line_len[i];
+            offset[i] = (offset[i] + ret) % len[i];
+        }
+    }
+    seconds = now() - start;
+
+    printf("%d connections, %.1fs: %.0f lines/sec, %.1f MB/sec\n",
+           nr_conns, seconds, lines / seconds,
+           bytes / seconds / 1e6);
+    for (i = 0; i < nr_conns; ++i)
+    {
+        close(fds[i].fd);
+        free(batch[i]);
+    }
+    free(batch);
+    free(line_len);
+    free(len);
+    free(offset);
+    free(fds);
+    return 0;
+}
@@ -0,0 +1,20 @@
+#!/bin/sh
+# scale.sh - run bench/scale against ircd with 1..N workers
+# usage: bench/scale.sh [max workers] [connections] [seconds]
+# expects ./ircd and bench/scale to be built, uses 127.0.0.1:6667
+MAX=${1:-$(nproc)}
+CONNS=${2:-256}
+SECS=${3:-5}
+
+n=1
+while [ "$n" -le "$MAX" ]
+do
+    ./ircd -f -R 0 -w "$n" &
+    pid=$!
+    sleep 1
+    printf 'workers %2d: ' "$n"
+    bench/scale 127.0.0.1 6667 "$CONNS" "$SECS"
+    kill -TERM "$pid"
+    wait "$pid"
+    n=$((n + 1))
+done
@@ -0,0 +1,66 @@
+/* casemap.c - rfc1459 case folding. nicks and channel names are the same
+ * whatever case they're in, and to rfc1459 []\^ are the upper case of
+ * {}|~ as well as A-Z being that of a-z. everything that compares or
+ * hashes a name does it on a folded copy made once, user->folded and
+ * chan->folded for the ones we keep, so the tables in hash.c can compare
+ * keys byte for byte. folding is a table lookup a byte, or with SSE2 or
+ * AVX2 16 or 32 bytes at a time, which is what channel names and the
+ * nick!user@host of a ban check mostly get
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#include "casemap.h"
+
+#define _F(c)       ((c) >= 'A' && (c) <= '^' ? (c) + ('a' - 'A') : (c))
+#define _F4(c)      _F(c), _F((c) + 1), _F((c) + 2), _F((c) + 3)
+#define _F16(c)     _F4(c), _F4((c) + 4), _F4((c) + 8), _F4((c) + 12)
+#define _F64(c)     _F16(c), _F16((c) + 16), _F16((c) + 32), _F16((c) + 48)
+
+const unsigned char casemap[256] = {
+    _F64(0), _F64(64), _F64(128), _F64(192)
+};
+
+/* casemap_fold(buf, text, len)
+ * folded copy of len bytes of text, NUL terminated, so buf needs len + 1
+ * bytes. buf may be text to fold it in place. returns len
+ * the wide paths take A-^ as the bytes above @ and below _, signed, which
+ * leaves anything with the top bit set alone, and set 0x20 on those */
+size_t
+casemap_fold (char *buf, const char *text, size_t len)
+{
+    size_t i = 0;
+#ifdef __AVX2__
+    const __m256i lo32 = _mm256_set1_epi8('A' - 1);
+    const __m256i hi32 = _mm256_set1_epi8('^' + 1);
+    const __m256i bit32 = _mm256_set1_epi8('a' - 'A');
+    __m256i c32, m32;
+
+    for (; i + 32 <= len; i += 32)
+    {
+        c32 = _mm256_loadu_si256((const __m256i *)(text + i));
+        m32 = _mm256_and_si256(_mm256_cmpgt_epi8(c32, lo32),
+                               _mm256_cmpgt_epi8(hi32, c32));
+        _mm256_storeu_si256((__m256i *)(buf + i),
+                    _mm256_or_si256(c32, _mm256_and_si256(m32, bit32)));
+    }
+#endif
+#ifdef __SSE2__
+    const __m128i lo = _mm_set1_epi8('A' - 1);
+    const __m128i hi = _mm_set1_epi8('^' + 1);
+    const __m128i bit = _mm_set1_epi8('a' - 'A');
+    __m128i c, m;
+
+    for (; i + 16 <= len; i += 16)
+    {
+        c = _mm_loadu_si128((const __m128i *)(text + i));
+        m = _mm_and_si128(_mm_cmpgt_epi8(c, lo), _mm_cmpgt_epi8(hi, c));
+        _mm_storeu_si128((__m128i *)(buf + i),
+                         _mm_or_si128(c, _mm_and_si128(m, bit)));
+    }
+#endif
+    for (; i < len; ++i)
+        buf[i] = casemap[(unsigned char)text[i]];
+    buf[len] = '\0';
+    return len;
+}
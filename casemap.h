@@ -0,0 +1,18 @@
+#ifndef CASEMAP_H
+#define CASEMAP_H
+/* casemap.h - rfc1459 case folding, see casemap.c
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#include <stddef.h>     /* for size_t */
+
+extern const unsigned char casemap[256];
+
+/* casemap_char(c)
+ * c the way nicks and channels compare, lower case */
+static inline char
+casemap_char (char c)
+{
+    return casemap[(unsigned char)c];
+}
+
+size_t casemap_fold (char *, const char *, size_t);
+#endif /* CASEMAP_H */
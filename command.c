@@ -0,0 +1,1171 @@
+/* command.c - every line a client sends ends up here, routed by command
+ * name through a perfect hash built at compile time, or by numeric
+ * through a plain table. each command records how many params it needs
+ * and who may use it, so the handlers only deal with the interesting
+ * part. Copyright Joe Doyle 2011 (See COPYING)
+ * NB: handlers run under ircd_lock unless they're CMD_NOLOCK */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+#include "command.h"
+#include "ircd.h"
+#include "irc.h"
+#include "net.h"
+#include "hash.h"
+#include "member.h"
+#include "ban.h"
+#include "casemap.h"
+#include "log.h"
+#include "reply.h"
+#include "stats.h"
+#include "upgrade.h"
+
+#define NAMES_MAX   400     /* nicks per RPL_NAMREPLY, in bytes */
+
+static int cmd_pass (client_t *, message_t *);
+static int cmd_nick (client_t *, message_t *);
+static int cmd_user (client_t *, message_t *);
+static int cmd_ping (client_t *, message_t *);
+static int cmd_pong (client_t *, message_t *);
+static int cmd_join (client_t *, message_t *);
+static int cmd_part (client_t *, message_t *);
+static int cmd_privmsg (client_t *, message_t *);
+static int cmd_notice (client_t *, message_t *);
+static int cmd_mode (client_t *, message_t *);
+static int cmd_stats (client_t *, message_t *);
+static int cmd_quit (client_t *, message_t *);
+static int cmd_numeric (client_t *, message_t *);
+
+/* the table is indexed by COMMAND_HASH() of each name, two names landing
+ * in the same slot is a duplicate initializer, which is made an error
+ * here whatever the build flags, so pick new names' slots with care.
+ * command_init() checks each name sits in its own slot.
+ * command_dispatch() compares the whole name after hashing */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Woverride-init"
+static command_t commands[COMMAND_SLOTS] = {
+    [COMMAND_HASH('A', 'S', 4)] =
+        { "PASS",    &cmd_pass,    1, CMD_UNREGISTERED, 0, 0 },
+    [COMMAND_HASH('I', 'K', 4)] =
+        { "NICK",    &cmd_nick,    0, CMD_UNREGISTERED | CMD_USER, 0, 0 },
+    [COMMAND_HASH('S', 'R', 4)] =
+        { "USER",    &cmd_user,    4, CMD_UNREGISTERED, 0, 0 },
+    [COMMAND_HASH('I', 'G', 4)] =
+        { "PING",    &cmd_ping,    1, CMD_ANY | CMD_NOLOCK, 0, 0 },
+    [COMMAND_HASH('O', 'G', 4)] =
+        { "PONG",    &cmd_pong,    0, CMD_ANY | CMD_NOLOCK, 0, 0 },
+    [COMMAND_HASH('O', 'N', 4)] =
+        { "JOIN",    &cmd_join,    1, CMD_USER, 0, 0 },
+    [COMMAND_HASH('A', 'T', 4)] =
+        { "PART",    &cmd_part,    1, CMD_USER, 0, 0 },
+    [COMMAND_HASH('R', 'G', 7)] =
+        { "PRIVMSG", &cmd_privmsg, 2, CMD_USER, 0, 0 },
+    [COMMAND_HASH('O', 'E', 6)] =
+        { "NOTICE",  &cmd_notice,  2, CMD_USER, 0, 0 },
+    [COMMAND_HASH('O', 'E', 4)] =
+        { "MODE",    &cmd_mode,    1, CMD_USER, 0, 0 },
+    [COMMAND_HASH('T', 'S', 5)] =
+        { "STATS",   &cmd_stats,   0, CMD_USER, 0, 0 },
+    [COMMAND_HASH('U', 'T', 4)] =
+        { "QUIT",    &cmd_quit,    0, CMD_ANY, 0, 0 }
+};
+#pragma GCC diagnostic pop
+
+/* numerics only ever come from other servers, they all go to the same
+ * handler but get counters of their own */
+static command_t numerics[NUMERICS_MAX];
+
+static unsigned long seen_stamp = 0;
+
+/* command_init()
+ * check every named command hashes to the slot it was put in, and fill
+ * in the numerics table, call once before any dispatching
+ * returns -1 if the command table is broken */
+int
+command_init (void)
+{
+    const char *name;
+    int i, len;
+
+    for (i = 0; i < COMMAND_SLOTS; ++i)
+    {
+        if (!(name = commands[i].name))
+            continue;
+        len = strlen(name);
+        if (COMMAND_HASH(name[len > 1], name[len - 1], len) != i)
+        {
+            log_error("command table: %s is in slot %d, not %d", name, i,
+                            COMMAND_HASH(name[len > 1], name[len - 1], len));
+            return -1;
+        }
+    }
+    for (i = 0; i < NUMERICS_MAX; ++i)
+    {
+        numerics[i].handler = &cmd_numeric;
+        numerics[i].min_params = 1;
+        numerics[i].flags = CMD_SERVER;
+    }
+    return 0;
+}
+
+/* _lookup(command)
+ * find the table entry for a command, or NULL if we don't know it */
+static command_t *
+_lookup (const slice_t *command)
+{
+    const char *p = command->ptr;
+    command_t *cmd;
+    int n;
+
+    /* the parser only lets through letters or three digits */
+    if (p[0] >= '0' && p[0] <= '9')
+    {
+        n = (p[0] - '0') * 100 + (p[1] - '0') * 10 + (p[2] - '0');
+        return &numerics[n];
+    }
+    cmd = &commands[COMMAND_HASH(p[command->len > 1] & ~0x20,
+                                 p[command->len - 1] & ~0x20, command->len)];
+    if (!cmd->name || strncasecmp(cmd->name, p, command->len)
+                    || cmd->name[command->len])
+        return NULL;
+    return cmd;
+}
+
+/* _str(s)
+ * wrap a C string up as a slice, for reply_build() */
+static slice_t
+_str (const char *s)
+{
+    slice_t slice;
+
+    slice.ptr = s;
+    slice.len = strlen(s);
+    return slice;
+}
+
+/* _nick(client)
+ * the client's nick for addressing replies to, * until it has one */
+static slice_t
+_nick (client_t *client)
+{
+    user_t *user = client->more;
+
+    if (client->type == CLIENT_SERVER || !user || !user->nickname[0])
+        return _str("*");
+    return _str(user->nickname);
+}
+
+/* _copy(buf, size, slice)
+ * NUL terminated copy of a slice, cut short to fit */
+static void
+_copy (char *buf, size_t size, const slice_t *slice)
+{
+    size_t len = (size_t)slice->len < size - 1 ? (size_t)slice->len : size - 1;
+
+    memcpy(buf, slice->ptr, len);
+    buf[len] = '\0';
+}
+
+/* _key(buf, size, slice)
+ * slice folded into buf, the way nick_table and chan_table are keyed
+ * returns -1 if it won't fit, cutting it short could name someone else */
+static int
+_key (char *buf, size_t size, const slice_t *slice)
+{
+    if ((size_t)slice->len >= size)
+        return -1;
+    casemap_fold(buf, slice->ptr, slice->len);
+    return 0;
+}
+
+/* _numeric(client, id, arg, text)
+ * send one of our numerics, arg and text fill in whatever holes it has
+ * after the server name and the client's nick */
+static int
+_numeric (client_t *client, int id, slice_t arg, slice_t text)
+{
+    slice_t args[4];
+
+    args[0] = _str(ircd_name);
+    args[1] = _nick(client);
+    args[2] = arg;
+    args[3] = text;
+    return net_sendt(client, id, args, 4) == -1 ? -1 : 0;
+}
+
+/* _split(list, item)
+ * pop the next item off a comma separated list, returns 0 when it's
+ * used up */
+static int
+_split (slice_t *list, slice_t *item)
+{
+    const char *comma;
+
+    if (list->len <= 0)
+        return 0;
+    item->ptr = list->ptr;
+    comma = memchr(list->ptr, ',', list->len);
+    item->len = comma ? comma - list->ptr : list->len;
+    list->ptr += item->len + 1;
+    list->len -= item->len + 1;
+    return 1;
+}
+
+/* command_dispatch(client, msg)
+ * route a parsed line to its handler, after checking the client's
+ * allowed to use it and gave it enough params
+ * returns -1 if the client got dropped */
+int
+command_dispatch (client_t *client, message_t *msg)
+{
+    command_t *cmd;
+    unsigned long start;
+    int ret;
+
+    if (!(cmd = _lookup(&msg->command)))
+    {
+        /* servers get no replies to things they shouldn't be sending */
+        if (client->type == CLIENT_SERVER)
+            return 0;
+        return _numeric(client, ERR_UNKNOWNCOMMAND, msg->command, _str(""));
+    }
+    if (!(cmd->flags & (1 << client->type)))
+    {
+        if (client->type == CLIENT_UNREGISTERED)
+            return _numeric(client, ERR_NOTREGISTERED, _str(""), _str(""));
+        if (client->type == CLIENT_USER)
+            return _numeric(client, ERR_ALREADYREGISTRED, _str(""), _str(""));
+        return 0;
+    }
+    if (msg->nr_params < cmd->min_params)
+        return _numeric(client, ERR_NEEDMOREPARAMS, msg->command, _str(""));
+
+    start = stats_nsecs();
+    if (cmd->flags & CMD_NOLOCK)
+        ret = cmd->handler(client, msg);
+    else
+    {
+        pthread_mutex_lock(&ircd_lock);
+        ret = cmd->handler(client, msg);
+        pthread_mutex_unlock(&ircd_lock);
+    }
+    __atomic_add_fetch(&cmd->calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&cmd->nsecs, stats_nsecs() - start, __ATOMIC_RELAXED);
+    return ret;
+}
+
+/* command_iter(pos)
+ * walk the named commands, start with *pos = 0, NULL at the end */
+const command_t *
+command_iter (int *pos)
+{
+    while (*pos < COMMAND_SLOTS)
+        if (commands[(*pos)++].name)
+            return &commands[*pos - 1];
+    return NULL;
+}
+
+/* command_numeric(n)
+ * the counters for numeric n */
+const command_t *
+command_numeric (int n)
+{
+    return &numerics[n];
+}
+
+/* _user(client)
+ * the user a client is registering as, made on first use. a server's
+ * client->more is its server_t, so servers must never get here */
+static user_t *
+_user (client_t *client)
+{
+    user_t *user = client->more;
+
+    assert(client->type == CLIENT_UNREGISTERED
+           || client->type == CLIENT_USER);
+    if (user)
+        return user;
+    if (!(user = slab_alloc(&user_slab)))
+        return NULL;
+    memset(user, 0, sizeof(*user));
+    user->client = client;
+    client->more = user;
+    return user;
+}
+
+/* _neighbours(user)
+ * everyone who shares a channel with user, each client once, plus user
+ * itself, as a NULL terminated list to free() afterwards */
+static client_t **
+_neighbours (user_t *user)
+{
+    client_t **clients;
+    chan_t *chan;
+    int i, j, n;
+
+    n = 1;
+    for (i = 0; i < user->nr_chans; ++i)
+        n += user->chans[i]->chan->nr_members;
+    if (!(clients = malloc((n + 1) * sizeof(*clients))))
+        return NULL;
+
+    /* the stamp saves us checking for duplicates the slow way */
+    seen_stamp++;
+    n = 0;
+    clients[n++] = user->client;
+    user->client->seen = seen_stamp;
+    for (i = 0; i < user->nr_chans; ++i)
+    {
+        chan = user->chans[i]->chan;
+        for (j = 0; j < chan->nr_members; ++j)
+        {
+            if (chan->clients[j]->seen == seen_stamp)
+                continue;
+            chan->clients[j]->seen = seen_stamp;
+            clients[n++] = chan->clients[j];
+        }
+    }
+    clients[n] = NULL;
+    return clients;
+}
+
+/* _relay(user, except, id, arg, text)
+ * tell user and everyone sharing a channel with it about something
+ * user did, except may be user->client to leave it out */
+static void
+_relay (user_t *user, client_t *except, int id, slice_t arg, slice_t text)
+{
+    client_t **clients;
+    slice_t args[3];
+
+    if (!(clients = _neighbours(user)))
+        return;
+    args[0] = user_prefix(user);
+    args[1] = arg;
+    args[2] = text;
+    net_manysendt(clients, except, id, args, 3);
+    free(clients);
+}
+
+/* _register(client)
+ * once we have both NICK and USER, and know the client's host or have
+ * given up waiting, the client becomes a user */
+static int
+_register (client_t *client)
+{
+    user_t *user = client->more;
+    slice_t args[6];
+
+    if (!user->nickname[0] || !user->user[0] || client->resolving)
+        return 0;
+
+    strcpy(user->host, client->host);
+    user_touch(user);
+    client->type = CLIENT_USER;
+    client->out_buf.max = ircd_classes[CLIENT_USER].sendq;
+    list_push((list_t **)&user_list, (list_t *)user);
+    nr_users++;
+
+    args[0] = _str(ircd_name);
+    args[1] = _str(user->nickname);
+    args[2] = user_prefix(user);
+    if (net_sendt(client, RPL_WELCOME, args, 3) == -1)
+        return -1;
+    args[2] = _str(ircd_name);
+    args[3] = _str(IRCD_VERSION);
+    if (net_sendt(client, RPL_YOURHOST, args, 4) == -1)
+        return -1;
+    args[2] = _str(ircd_created);
+    if (net_sendt(client, RPL_CREATED, args, 3) == -1)
+        return -1;
+    args[2] = _str(ircd_name);
+    args[3] = _str(IRCD_VERSION);
+    args[4] = _str("o");
+    args[5] = _str("o");
+    return net_sendt(client, RPL_MYINFO, args, 6) == -1 ? -1 : 0;
+}
+
+/* _valid_nick(nick)
+ * RFC 2812 nickname: a letter or special, then letters, digits,
+ * specials or '-' */
+static int
+_valid_nick (const slice_t *nick)
+{
+    int i;
+    char c;
+
+    if (nick->len == 0 || nick->len > IRC_NICKNAME_MAX)
+        return 0;
+    for (i = 0; i < nick->len; ++i)
+    {
+        c = nick->ptr[i];
+        if ((c >= 'A' && c <= '}') || (i && ((c >= '0' && c <= '9')
+                                                        || c == '-')))
+            continue;
+        return 0;
+    }
+    return 1;
+}
+
+static int
+cmd_pass (client_t *client, message_t *msg)
+{
+    /* nothing is password protected yet */
+    return 0;
+}
+
+static int
+cmd_nick (client_t *client, message_t *msg)
+{
+    char nick[IRC_NICKNAME_MAX+1], key[IRC_NICKNAME_MAX+1];
+    user_t *user, *owner;
+    int i;
+
+    if (msg->nr_params == 0)
+        return _numeric(client, ERR_NONICKNAMEGIVEN, _str(""), _str(""));
+    if (!_valid_nick(&msg->params[0])
+        || _key(key, sizeof(key), &msg->params[0]))
+        return _numeric(client, ERR_ERRONEUSNICKNAME, msg->params[0],
+                                                                _str(""));
+    _copy(nick, sizeof(nick), &msg->params[0]);
+    owner = hash_lookup(&nick_table, key);
+    if (owner && owner->client != client)
+        return _numeric(client, ERR_NICKNAMEINUSE, msg->params[0], _str(""));
+    if (!(user = _user(client)))
+    {
+        drop(client, QUIT_OUT_OF_MEMORY);
+        return -1;
+    }
+    if (user->nickname[0] && client->type == CLIENT_USER)
+        _relay(user, NULL, REPLY_NICK, msg->params[0], _str(""));
+
+    /* owner is us if this is just a change of case, otherwise the table
+     * points at user->folded, so out with the old key before it changes */
+    if (!owner)
+    {
+        if (user->nickname[0])
+            hash_remove(&nick_table, user->folded);
+        strcpy(user->folded, key);
+        if (hash_insert(&nick_table, user->folded, user))
+        {
+            user->nickname[0] = '\0';
+            drop(client, QUIT_OUT_OF_MEMORY);
+            return -1;
+        }
+    }
+    strcpy(user->nickname, nick);
+    user_touch(user);
+    /* bans that matched the old nick might not match the new one */
+    for (i = 0; i < user->nr_chans; ++i)
+        user->chans[i]->ban_gen = 0;
+    if (client->type == CLIENT_UNREGISTERED)
+        return _register(client);
+    return 0;
+}
+
+static int
+cmd_user (client_t *client, message_t *msg)
+{
+    user_t *user;
+
+    if (!(user = _user(client)))
+    {
+        drop(client, QUIT_OUT_OF_MEMORY);
+        return -1;
+    }
+    if (user->user[0])
+        return _numeric(client, ERR_ALREADYREGISTRED, _str(""), _str(""));
+    _copy(user->user, sizeof(user->user), &msg->params[0]);
+    return _register(client);
+}
+
+static int
+cmd_ping (client_t *client, message_t *msg)
+{
+    slice_t args[3];
+
+    args[0] = _str(ircd_name);
+    args[1] = args[0];
+    args[2] = msg->params[0];
+    return net_sendt(client, REPLY_PONG, args, 3) == -1 ? -1 : 0;
+}
+
+static int
+cmd_pong (client_t *client, message_t *msg)
+{
+    /* client_line() already noted it's alive */
+    return 0;
+}
+
+/* _valid_chan(name)
+ * RFC 2812 channel name, we only do # and & channels */
+static int
+_valid_chan (const slice_t *name)
+{
+    if (name->len < 2 || name->len > IRC_CHANNAME_MAX)
+        return 0;
+    if (name->ptr[0] != '#' && name->ptr[0] != '&')
+        return 0;
+    return !memchr(name->ptr, ' ', name->len)
+        && !memchr(name->ptr, '\007', name->len)
+        && !memchr(name->ptr, ':', name->len);
+}
+
+/* _chan_new(name)
+ * create an empty channel, NULL if chan_slab is full (or, rarely,
+ * chan_table couldn't grow) */
+static chan_t *
+_chan_new (const char *name)
+{
+    chan_t *chan;
+
+    if (!(chan = slab_alloc(&chan_slab)))
+        return NULL;
+    memset(chan, 0, sizeof(*chan));
+    strcpy(chan->name, name);
+    casemap_fold(chan->folded, name, strlen(name));
+    if (hash_insert(&chan_table, chan->folded, chan))
+    {
+        slab_free(&chan_slab, chan);
+        return NULL;
+    }
+    list_push((list_t **)&chan_list, (list_t *)chan);
+    nr_chans++;
+    return chan;
+}
+
+/* _chan_free(chan)
+ * get rid of a channel the last user has left */
+static void
+_chan_free (chan_t *chan)
+{
+    hash_remove(&chan_table, chan->folded);
+    list_unlink((list_t **)&chan_list, (list_t *)chan);
+    nr_chans--;
+    member_free_chan(chan);
+    if (chan->bans)
+        ban_free(chan->bans);
+    slab_free(&chan_slab, chan);
+}
+
+/* _quit(user)
+ * take user out of every channel it's in, from the back so nothing
+ * moves under us, getting rid of any it leaves empty */
+static void
+_quit (user_t *user)
+{
+    member_t *member;
+    chan_t *chan;
+
+    while (user->nr_chans)
+    {
+        member = user->chans[user->nr_chans - 1];
+        chan = member->chan;
+        member_part(member);
+        if (!chan->nr_members)
+            _chan_free(chan);
+    }
+}
+
+/* _banned(user, chan, member)
+ * whether chan's bans keep user out, or quiet if member says it's in
+ * already, where the answer is kept until the bans change. ops are
+ * never quieted */
+static int
+_banned (user_t *user, chan_t *chan, member_t *member)
+{
+    slice_t prefix;
+    int banned;
+
+    if (!chan->bans || !chan->bans->nr_bans)
+        return 0;
+    if (member)
+    {
+        if (member->modes & MEMBER_OP)
+            return 0;
+        if (member->ban_gen == chan->bans->gen)
+            return member->banned;
+    }
+    prefix = user_prefix(user);
+    banned = ban_match(chan->bans, prefix.ptr, prefix.len);
+    if (member)
+    {
+        member->banned = banned;
+        member->ban_gen = chan->bans->gen;
+    }
+    return banned;
+}
+
+/* _names(client, chan)
+ * RPL_NAMREPLY as many times as it takes, then RPL_ENDOFNAMES */
+static int
+_names (client_t *client, chan_t *chan)
+{
+    char names[NAMES_MAX + IRC_NICKNAME_MAX + 3];
+    slice_t args[4];
+    member_t *member;
+    int i, len = 0;
+
+    args[0] = _str(ircd_name);
+    args[1] = _nick(client);
+    args[2] = _str(chan->name);
+    for (i = 0; i < chan->nr_members; ++i)
+    {
+        member = chan->members[i];
+        if (len)
+            names[len++] = ' ';
+        if (member->modes & MEMBER_OP)
+            names[len++] = '@';
+        len += sprintf(names + len, "%s", member->user->nickname);
+        if (len < NAMES_MAX && i + 1 < chan->nr_members)
+            continue;
+        args[3].ptr = names;
+        args[3].len = len;
+        if (net_sendt(client, RPL_NAMREPLY, args, 4) == -1)
+            return -1;
+        len = 0;
+    }
+    return net_sendt(client, RPL_ENDOFNAMES, args, 3) == -1 ? -1 : 0;
+}
+
+static int
+cmd_join (client_t *client, message_t *msg)
+{
+    char name[IRC_CHANNAME_MAX+1], key[IRC_CHANNAME_MAX+1];
+    user_t *user = client->more;
+    slice_t list = msg->params[0], item, args[3];
+    chan_t *chan;
+
+    while (_split(&list, &item))
+    {
+        if (!_valid_chan(&item) || _key(key, sizeof(key), &item))
+        {
+            if (_numeric(client, ERR_NOSUCHCHANNEL, item, _str("")))
+                return -1;
+            continue;
+        }
+        _copy(name, sizeof(name), &item);
+        if (!(chan = hash_lookup(&chan_table, key)))
+        {
+            /* no room for another channel is no reason to drop them */
+            if (!(chan = _chan_new(name)))
+            {
+                if (_numeric(client, ERR_TOOMANYCHANNELS, item, _str("")))
+                    return -1;
+                continue;
+            }
+            /* whoever makes a channel gets ops on it */
+            if (!member_join(user, chan, MEMBER_OP))
+                goto nomem;
+        }
+        else if (member_find(user, chan))
+            continue;
+        else if (_banned(user, chan, NULL))
+        {
+            if (_numeric(client, ERR_BANNEDFROMCHAN, item, _str("")))
+                return -1;
+            continue;
+        }
+        else if (!member_join(user, chan, 0))
+            goto nomem;
+
+        args[0] = user_prefix(user);
+        args[1] = _str(chan->name);
+        net_manysendt(chan->clients, NULL, REPLY_JOIN, args, 2);
+        if (chan->topic[0] && _numeric(client, RPL_TOPIC, args[1],
+                                                        _str(chan->topic)))
+            return -1;
+        if (_names(client, chan))
+            return -1;
+    }
+    return 0;
+
+nomem:
+    if (chan && !chan->nr_members)
+        _chan_free(chan);
+    drop(client, QUIT_OUT_OF_MEMORY);
+    return -1;
+}
+
+static int
+cmd_part (client_t *client, message_t *msg)
+{
+    char name[IRC_CHANNAME_MAX+1];
+    user_t *user = client->more;
+    slice_t list = msg->params[0], item, args[3];
+    member_t *member;
+    chan_t *chan;
+
+    while (_split(&list, &item))
+    {
+        if (_key(name, sizeof(name), &item)
+            || !(chan = hash_lookup(&chan_table, name)))
+        {
+            if (_numeric(client, ERR_NOSUCHCHANNEL, item, _str("")))
+                return -1;
+            continue;
+        }
+        if (!(member = member_find(user, chan)))
+        {
+            if (_numeric(client, ERR_NOTONCHANNEL, item, _str("")))
+                return -1;
+            continue;
+        }
+        args[0] = user_prefix(user);
+        args[1] = _str(chan->name);
+        args[2] = msg->nr_params > 1 ? msg->params[1]
+                                     : _str(user->nickname);
+        net_manysendt(chan->clients, NULL, REPLY_PART, args, 3);
+        member_part(member);
+        if (!chan->nr_members)
+            _chan_free(chan);
+    }
+    return 0;
+}
+
+/* _message(client, msg, id)
+ * PRIVMSG and NOTICE, the only difference is NOTICE never gets an
+ * error back */
+static int
+_message (client_t *client, message_t *msg, int id)
+{
+    char target[IRC_CHANNAME_MAX+1];
+    user_t *user = client->more, *to;
+    slice_t list = msg->params[0], item, args[3];
+    member_t *member;
+    chan_t *chan;
+    int error;
+
+    args[0] = user_prefix(user);
+    args[2] = msg->params[1];
+    while (_split(&list, &item))
+    {
+        args[1] = item;
+        if (_key(target, sizeof(target), &item))
+            error = item.ptr[0] == '#' || item.ptr[0] == '&'
+                                        ? ERR_NOSUCHCHANNEL : ERR_NOSUCHNICK;
+        else if (target[0] == '#' || target[0] == '&')
+        {
+            error = ERR_NOSUCHCHANNEL;
+            /* anyone in it may talk, and only them, unless they're banned */
+            if ((chan = hash_lookup(&chan_table, target))
+                && (member = member_find(user, chan)))
+            {
+                if (!_banned(user, chan, member))
+                {
+                    net_manysendt(chan->clients, client, id, args, 3);
+                    continue;
+                }
+                error = ERR_CANNOTSENDTOCHAN;
+            }
+        }
+        else
+        {
+            error = ERR_NOSUCHNICK;
+            if ((to = hash_lookup(&nick_table, target))
+                && to->client->type == CLIENT_USER)
+            {
+                net_sendt(to->client, id, args, 3);
+                continue;
+            }
+        }
+        if (id == REPLY_PRIVMSG && _numeric(client, error, item, _str("")))
+            return -1;
+    }
+    return 0;
+}
+
+static int
+cmd_privmsg (client_t *client, message_t *msg)
+{
+    return _message(client, msg, REPLY_PRIVMSG);
+}
+
+static int
+cmd_notice (client_t *client, message_t *msg)
+{
+    return _message(client, msg, REPLY_NOTICE);
+}
+
+/* _banlist(client, chan)
+ * RPL_BANLIST for each ban, then RPL_ENDOFBANLIST */
+static int
+_banlist (client_t *client, chan_t *chan)
+{
+    char when[24];
+    slice_t args[6];
+    ban_t *ban;
+    int i;
+
+    args[0] = _str(ircd_name);
+    args[1] = _nick(client);
+    args[2] = _str(chan->name);
+    for (i = 0; chan->bans && i < chan->bans->nr_bans; ++i)
+    {
+        ban = chan->bans->bans[i];
+        snprintf(when, sizeof(when), "%ld", (long)ban->when);
+        args[3] = _str(ban->text);
+        args[4] = _str(ban->setter);
+        args[5] = _str(when);
+        if (net_sendt(client, RPL_BANLIST, args, 6) == -1)
+            return -1;
+    }
+    return net_sendt(client, RPL_ENDOFBANLIST, args, 3) == -1 ? -1 : 0;
+}
+
+/* _ban(client, chan, adding, mask)
+ * +b or -b mask on chan, everyone in it hears about it if it made a
+ * difference. returns -1 if the client got dropped */
+static int
+_ban (client_t *client, chan_t *chan, int adding, const slice_t *mask)
+{
+    char text[MASK_MAX+1];
+    user_t *user = client->more;
+    slice_t args[4];
+    int ret;
+
+    if (ban_normalize(text, mask))
+        return 0;
+    if (!adding)
+        ret = chan->bans ? ban_remove(chan->bans, text) : -1;
+    else if (chan->bans && chan->bans->nr_bans >= BAN_MAX)
+        return _numeric(client, ERR_BANLISTFULL, _str(chan->name),
+                                                                _str(text));
+    else if ((!chan->bans && !(chan->bans = ban_new()))
+        || (ret = ban_add(chan->bans, text, user->nickname, time(NULL))) < 0)
+    {
+        drop(client, QUIT_OUT_OF_MEMORY);
+        return -1;
+    }
+    if (ret)
+        return 0;
+    args[0] = user_prefix(user);
+    args[1] = _str(chan->name);
+    args[2] = _str(adding ? "+b" : "-b");
+    args[3] = _str(text);
+    net_manysendt(chan->clients, NULL, REPLY_MODE, args, 4);
+    return 0;
+}
+
+/* cmd_mode
+ * channel bans are the only mode so far: b with no mask lists them, +b
+ * and -b with one set and unset them, ops only. user modes are taken
+ * and ignored */
+static int
+cmd_mode (client_t *client, message_t *msg)
+{
+    char name[IRC_CHANNAME_MAX+1], c[2] = "";
+    user_t *user = client->more;
+    const slice_t *modes = &msg->params[1];
+    member_t *member;
+    chan_t *chan;
+    int i, adding = 1, param = 2, listed = 0;
+
+    if (!msg->params[0].len || (msg->params[0].ptr[0] != '#'
+                                && msg->params[0].ptr[0] != '&'))
+        return 0;
+    if (_key(name, sizeof(name), &msg->params[0])
+        || !(chan = hash_lookup(&chan_table, name)))
+        return _numeric(client, ERR_NOSUCHCHANNEL, msg->params[0], _str(""));
+    if (msg->nr_params < 2)
+        return _numeric(client, RPL_CHANNELMODEIS, _str(chan->name),
+                                                                _str("+"));
+    member = member_find(user, chan);
+    for (i = 0; i < modes->len; ++i)
+    {
+        switch (modes->ptr[i])
+        {
+            case '+':   adding = 1;
+                        break;
+            case '-':   adding = 0;
+                        break;
+            case 'b':   if (param == msg->nr_params)
+                        {
+                            if (!listed++ && _banlist(client, chan))
+                                return -1;
+                            break;
+                        }
+                        if (!member || !(member->modes & MEMBER_OP))
+                        {
+                            param++;
+                            if (_numeric(client, ERR_CHANOPRIVSNEEDED,
+                                                _str(chan->name), _str("")))
+                                return -1;
+                            break;
+                        }
+                        if (_ban(client, chan, adding,
+                                                &msg->params[param++]))
+                            return -1;
+                        break;
+            default:    c[0] = modes->ptr[i];
+                        c[1] = '\0';
+                        if (_numeric(client, ERR_UNKNOWNMODE, _str(c),
+                                                        _str(chan->name)))
+                            return -1;
+                        break;
+        }
+    }
+    return 0;
+}
+
+/* struct stats_reply is where _stats_line() sends, it stops sending
+ * if the client gets dropped on the way */
+struct stats_reply {
+    client_t    *client;
+    int         dropped;
+};
+
+static void
+_stats_line (void *data, const char *line)
+{
+    struct stats_reply *reply = data;
+
+    if (!reply->dropped && _numeric(reply->client, RPL_STATSDEBUG,
+                                                    _str(line), _str("")))
+        reply->dropped = 1;
+}
+
+/* cmd_stats
+ * m is how often each command's been used, u is the uptime, and z is
+ * all our own counters and histograms, see stats.c */
+static int
+cmd_stats (client_t *client, message_t *msg)
+{
+    struct stats_reply reply = { client, 0 };
+    const command_t *cmd;
+    char query[2] = "*", buf[64];
+    long up;
+    int pos;
+
+    if (msg->nr_params && msg->params[0].len)
+        query[0] = msg->params[0].ptr[0];
+    switch (query[0])
+    {
+        case 'm':
+            for (pos = 0; (cmd = command_iter(&pos)); )
+            {
+                snprintf(buf, sizeof(buf), "%lu",
+                        __atomic_load_n(&cmd->calls, __ATOMIC_RELAXED));
+                if (_numeric(client, RPL_STATSCOMMANDS, _str(cmd->name),
+                                                                _str(buf)))
+                    return -1;
+            }
+            break;
+        case 'u':
+            up = stats_uptime();
+            snprintf(buf, sizeof(buf), "%ld days %ld:%02ld:%02ld",
+                    up / 86400, up / 3600 % 24, up / 60 % 60, up % 60);
+            if (_numeric(client, RPL_STATSUPTIME, _str(buf), _str("")))
+                return -1;
+            break;
+        case 'z':
+            stats_lines(&_stats_line, &reply);
+            if (reply.dropped)
+                return -1;
+            break;
+    }
+    return _numeric(client, RPL_ENDOFSTATS, _str(query), _str(""));
+}
+
+static int
+cmd_quit (client_t *client, message_t *msg)
+{
+    user_t *user = client->more;
+
+    /* tell everyone now, while we still have the user's own words */
+    if (client->type == CLIENT_USER)
+    {
+        _relay(user, client, REPLY_QUIT, msg->nr_params ? msg->params[0]
+                                        : _str(user->nickname), _str(""));
+        _quit(user);
+    }
+    drop(client, QUIT_USER_MSG);
+    return -1;
+}
+
+static int
+cmd_numeric (client_t *client, message_t *msg)
+{
+    char nick[IRC_NICKNAME_MAX+1];
+    const slice_t *last = &msg->params[msg->nr_params - 1];
+    const char *line;
+    user_t *to;
+    int len;
+
+    /* pass it on to whoever it's addressed to, prefix and all */
+    if (_key(nick, sizeof(nick), &msg->params[0])
+        || !(to = hash_lookup(&nick_table, nick)) || to->client == client)
+        return 0;
+    line = msg->prefix.len ? msg->prefix.ptr - 1 : msg->command.ptr;
+    len = last->ptr + last->len - line;
+    /* a line with no room left for its \r\n would lose its tail in
+     * net_sendf(), pass it on whole or not at all */
+    if (len > IRC_MESSAGE_MAX - 2)
+        return 0;
+    net_sendf(to->client, "%.*s", len, line);
+    return 0;
+}
+
+/* command_register(client)
+ * the client's hostname lookup is over one way or another, so if it
+ * already sent NICK and USER it can go ahead and register
+ * returns -1 if the client got dropped
+ * NB: hold ircd_lock */
+int
+command_register (client_t *client)
+{
+    if (client->type != CLIENT_UNREGISTERED || !client->more)
+        return 0;
+    return _register(client);
+}
+
+/* command_drop(client, reason)
+ * forget the user a dropped client was, telling its channels why. by
+ * the time this runs the connection is already gone
+ * NB: hold ircd_lock */
+void
+command_drop (client_t *client, const char *reason)
+{
+    user_t *user = client->more;
+
+    if (!user || client->type == CLIENT_SERVER)
+        return;
+    if (user->nr_chans)
+    {
+        _relay(user, client, REPLY_QUIT, _str(reason), _str(""));
+        _quit(user);
+    }
+    member_free_user(user);
+    if (user->nickname[0])
+        hash_remove(&nick_table, user->folded);
+    if (client->type == CLIENT_USER)
+    {
+        list_unlink((list_t **)&user_list, (list_t *)user);
+        nr_users--;
+    }
+    client->more = NULL;
+    slab_free(&user_slab, user);
+}
+
+/* command_save_user(u, client)
+ * the user behind a client, for the next process, see upgrade.c
+ * NB: hold ircd_lock */
+void
+command_save_user (upgrade_t *u, client_t *client)
+{
+    user_t *user = client->more;
+
+    upgrade_put_int(u, user != NULL);
+    if (!user)
+        return;
+    upgrade_put_str(u, user->nickname);
+    upgrade_put_str(u, user->user);
+    upgrade_put_str(u, user->host);
+}
+
+/* command_restore_user(u, client)
+ * the user command_save_user() saved, back as it was, client->type has
+ * to be restored first. returns -1 if it won't fit
+ * NB: hold ircd_lock */
+int
+command_restore_user (upgrade_t *u, client_t *client)
+{
+    user_t *user;
+
+    if (!upgrade_get_int(u))
+        return 0;
+    if (!(user = _user(client)))
+        return -1;
+    upgrade_get_str(u, user->nickname, sizeof(user->nickname));
+    upgrade_get_str(u, user->user, sizeof(user->user));
+    upgrade_get_str(u, user->host, sizeof(user->host));
+    casemap_fold(user->folded, user->nickname, strlen(user->nickname));
+    if (u->failed
+        || (user->nickname[0]
+            && hash_insert(&nick_table, user->folded, user)))
+        return -1;
+    if (client->type == CLIENT_USER)
+    {
+        list_push((list_t **)&user_list, (list_t *)user);
+        nr_users++;
+    }
+    return 0;
+}
+
+/* command_save_chans(u)
+ * every channel with its members by nickname, so it has to come after
+ * all the users, and its bans
+ * NB: hold ircd_lock */
+void
+command_save_chans (upgrade_t *u)
+{
+    chan_t *chan;
+    int i;
+
+    upgrade_put_int(u, nr_chans);
+    for (chan = chan_list; chan; chan = (chan_t *)chan->list_head.next)
+    {
+        upgrade_put_str(u, chan->name);
+        upgrade_put_str(u, chan->topic);
+        upgrade_put_int(u, chan->nr_members);
+        for (i = 0; i < chan->nr_members; ++i)
+        {
+            upgrade_put_str(u, chan->members[i]->user->nickname);
+            upgrade_put_int(u, chan->members[i]->modes);
+        }
+        upgrade_put_int(u, chan->bans ? chan->bans->nr_bans : 0);
+        for (i = 0; chan->bans && i < chan->bans->nr_bans; ++i)
+        {
+            upgrade_put_str(u, chan->bans->bans[i]->text);
+            upgrade_put_str(u, chan->bans->bans[i]->setter);
+            upgrade_put_int(u, chan->bans->bans[i]->when);
+        }
+    }
+}
+
+/* command_restore_chans(u)
+ * the channels command_save_chans() saved, returns -1 if they won't fit
+ * or name someone who isn't here
+ * NB: hold ircd_lock */
+int
+command_restore_chans (upgrade_t *u)
+{
+    char name[IRC_CHANNAME_MAX+1], nick[IRC_NICKNAME_MAX+1];
+    char text[MASK_MAX+1], setter[IRC_NICKNAME_MAX+1];
+    user_t *user;
+    chan_t *chan;
+    long n, m;
+    int modes;
+    time_t when;
+
+    for (n = upgrade_get_int(u); n > 0 && !u->failed; --n)
+    {
+        upgrade_get_str(u, name, sizeof(name));
+        if (u->failed || !(chan = _chan_new(name)))
+            return -1;
+        upgrade_get_str(u, chan->topic, sizeof(chan->topic));
+        for (m = upgrade_get_int(u); m > 0 && !u->failed; --m)
+        {
+            upgrade_get_str(u, nick, sizeof(nick));
+            casemap_fold(nick, nick, strlen(nick));
+            modes = upgrade_get_int(u);
+            if (u->failed || !(user = hash_lookup(&nick_table, nick))
+                || !member_join(user, chan, modes))
+                return -1;
+        }
+        for (m = upgrade_get_int(u); m > 0 && !u->failed; --m)
+        {
+            upgrade_get_str(u, text, sizeof(text));
+            upgrade_get_str(u, setter, sizeof(setter));
+            when = upgrade_get_int(u);
+            if (u->failed || (!chan->bans && !(chan->bans = ban_new()))
+                || ban_add(chan->bans, text, setter, when) < 0)
+                return -1;
+        }
+    }
+    return u->failed ? -1 : 0;
+}
@@ -0,0 +1,51 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+/* command.h - routing parsed lines to their handlers
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#include "ircd.h"       /* for client_t */
+#include "parse.h"      /* for message_t */
+#include "upgrade.h"    /* for upgrade_t */
+
+/* the command table is a perfect hash on the second and last letters
+ * of the (upper cased) command and its length, see command.c before
+ * adding one */
+#define COMMAND_SLOTS   32
+#define COMMAND_HASH(second, last, len) \
+        (((second) + (last) * 10 + (len) * 2) & (COMMAND_SLOTS - 1))
+#define NUMERICS_MAX    1000
+
+/* which kinds of client may use a command, by client type */
+#define CMD_UNREGISTERED    (1 << CLIENT_UNREGISTERED)
+#define CMD_USER            (1 << CLIENT_USER)
+#define CMD_SERVER          (1 << CLIENT_SERVER)
+#define CMD_REGISTERED      (CMD_USER | CMD_SERVER)
+#define CMD_ANY             (CMD_UNREGISTERED | CMD_REGISTERED)
+#define CMD_NOLOCK          (1 << 8)    /* handler leaves shared state be */
+
+typedef struct command command_t;
+
+/* handlers return -1 if the client got dropped */
+typedef int (*command_cb) (client_t *, message_t *);
+
+/* struct command is a command we understand, calls and nsecs are
+ * profiling counters, bumped by every worker so they're atomic */
+struct command {
+    const char      *name;
+    command_cb      handler;
+    int             min_params;
+    int             flags;      /* CMD_ */
+    unsigned long   calls;
+    unsigned long   nsecs;      /* time spent in handler */
+};
+
+int command_init (void);
+int command_dispatch (client_t *, message_t *);
+const command_t *command_iter (int *);
+const command_t *command_numeric (int);
+void command_drop (client_t *, const char *);
+int command_register (client_t *);
+void command_save_user (upgrade_t *, client_t *);
+int command_restore_user (upgrade_t *, client_t *);
+void command_save_chans (upgrade_t *);
+int command_restore_chans (upgrade_t *);
+#endif /* COMMAND_H */
@@ -1,121 +1,322 @@
+#include <sys/random.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <time.h>
+#include <limits.h>
+#include <pthread.h>
 #include "hash.h"
 
-/* make all hash keys case insensitive by copying the key to
- * dynamic memory, then making any lowercase letters uppercase */
-static char *
-_ncasedup (const char *str)
+/* every table gets its own seed, drawn from a key picked once per
+ * process, so making tables at runtime costs no syscalls and leaves
+ * the random() everyone else uses alone */
+static uint64_t seed_key;
+static uint64_t seed_count;
+static pthread_once_t seed_once = PTHREAD_ONCE_INIT;
+
+/* entry i lives in page i / HASH_PAGE_SZ, pages never move or shrink
+ * so neither do entries */
+#define _entry(table, i) \
+		(&(table)->pages[(i) >> HASH_PAGE_SHIFT][(i) & (HASH_PAGE_SZ - 1)])
+
+/* keyed 64 bit hash of the key, FNV-1a style mixing from
+ * a per table seed, then the murmur3 finalizer so the low bits we
+ * index with depend on every byte of the key */
+static uint64_t
+_hash (struct hash_table *table, const char *key)
+{
+	const unsigned char *tmp;
+	uint64_t hash;
+	hash = table->seed;
+	for (tmp = (const unsigned char *)key; *tmp; tmp++)
+		hash = (hash ^ *tmp) * 0x100000001b3ULL;
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+
+/* _seed_init()
+ * pick seed_key, once per process, from getrandom() if it has anything
+ * for us yet, or else whatever time, pid and ASLR give us */
+static void
+_seed_init (void)
+{
+	if (getrandom(&seed_key, sizeof(seed_key), GRND_NONBLOCK)
+		!= sizeof(seed_key))
+		seed_key = ((uint64_t)time(NULL) << 32) ^ (uint64_t)getpid()
+				^ (uint64_t)(uintptr_t)&seed_key;
+}
+
+/* _seed()
+ * the next table's seed, splitmix64 over a counter from seed_key */
+static uint64_t
+_seed (void)
+{
+	uint64_t z;
+	pthread_once(&seed_once, &_seed_init);
+	z = seed_key + __atomic_add_fetch(&seed_count, 0x9e3779b97f4a7c15ULL,
+				__ATOMIC_RELAXED);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+void
+hash_init (struct hash_table *table)
+{
+	memset (table, 0, sizeof(*table));
+	table->seed = _seed();
+}
+
+static int
+_index_alloc (struct hash_index *index, uint32_t nr_slots)
+{
+	index->slots = calloc(nr_slots, sizeof(*index->slots));
+	if (!index->slots) return -1;
+	index->mask = nr_slots - 1;
+	index->used = 0;
+	return 0;
+}
+
+/* robin hood insertion, walking from the home slot, whichever of us
+ * and the current occupant is further from home gets to stay */
+static void
+_index_insert (struct hash_index *index, uint32_t hash, uint32_t entry)
 {
-	char *new;
-	int i;
-	new = strdup(str);
-	for (i = 0; new && new[i]; ++i)
+	struct hash_slot cur, tmp;
+	uint32_t pos, dist, their_dist;
+	cur.hash = hash;
+	cur.entry = entry;
+	pos = hash & index->mask;
+	for (dist = 0;; dist++, pos = (pos + 1) & index->mask)
 	{
-		if (new[i] >= 'a' && new[i] <= 'z')
-			new[i] -= 'a' - 'A';
+		if (!index->slots[pos].entry)
+		{
+			index->slots[pos] = cur;
+			index->used++;
+			return;
+		}
+		their_dist = (pos - index->slots[pos].hash) & index->mask;
+		if (their_dist < dist)
+		{
+			tmp = index->slots[pos];
+			index->slots[pos] = cur;
+			cur = tmp;
+			dist = their_dist;
+		}
 	}
-	return new;
 }
 
-/* shamelessly stolen from http://en.wikipedia.org/wiki/Pearson_hash */
-static unsigned char
-_pearson_hash (struct hash_table *table, const char *key)
+/* find the slot for key, -1 if it isn't there. the probe stops as soon
+ * as we meet a slot closer to its home than we are to ours, robin hood
+ * insertion would have put us there */
+static long
+_index_find (struct hash_table *table, struct hash_index *index,
+				uint64_t hash, const char *key)
 {
-	unsigned char hash, index, *tmp;
-	hash = 0;
-	for (tmp = (unsigned char *)key; *tmp; tmp++)
+	struct hash_slot *slot;
+	struct hash_bucket *bucket;
+	uint32_t pos, dist;
+	if (!index->slots) return -1;
+	pos = (uint32_t)hash & index->mask;
+	for (dist = 0;; dist++, pos = (pos + 1) & index->mask)
 	{
-		index = hash ^ *tmp;
-		hash = table->permut_table[index];
+		slot = &index->slots[pos];
+		if (!slot->entry || ((pos - slot->hash) & index->mask) < dist)
+			return -1;
+		if (slot->hash != (uint32_t)hash)
+			continue;
+		bucket = _entry(table, slot->entry - 1);
+		if (bucket->hash == hash && !strcmp(bucket->key, key))
+			return pos;
 	}
-	return hash;
 }
 
-void
-hash_init (struct hash_table *table)
+/* as above, but we know which entry we're after */
+static long
+_index_find_entry (struct hash_index *index, uint32_t hash, uint32_t entry)
 {
-	int i, j, randint;
-	memset (table, 0, sizeof(*table));
-	srandom(time(NULL));
-	for (i = 0; i < PERM_TABLE_SZ; i++)
+	struct hash_slot *slot;
+	uint32_t pos, dist;
+	pos = hash & index->mask;
+	for (dist = 0;; dist++, pos = (pos + 1) & index->mask)
 	{
-		randint = random();
-		for (j = 0; j < 4 && i < PERM_TABLE_SZ; j++)
+		slot = &index->slots[pos];
+		if (!slot->entry || ((pos - slot->hash) & index->mask) < dist)
+			return -1;
+		if (slot->entry == entry)
+			return pos;
+	}
+}
+
+/* empty a slot, shifting the rest of its run back one so there
+ * are no tombstones to step over later */
+static void
+_index_delete (struct hash_index *index, uint32_t pos)
+{
+	uint32_t next;
+	for (;;)
+	{
+		next = (pos + 1) & index->mask;
+		if (!index->slots[next].entry
+			|| ((next - index->slots[next].hash) & index->mask) == 0)
+			break;
+		index->slots[pos] = index->slots[next];
+		pos = next;
+	}
+	index->slots[pos].entry = 0;
+	index->used--;
+}
+
+/* move up to steps entries from the old index into the new one,
+ * in entry order. anything not found in the old index was inserted
+ * since the resize started, or has gone. frees the old index once
+ * it's empty */
+static void
+_migrate (struct hash_table *table, unsigned int steps)
+{
+	struct hash_bucket *bucket;
+	unsigned int i;
+	long pos;
+	while (table->old.slots && steps--)
+	{
+		if (!table->old.used || table->migrate_pos >= table->high)
 		{
-			table->permut_table[i] = (char)(randint & 0xff);
-			randint >>= 8;
-			i++;
+			free(table->old.slots);
+			table->old.slots = NULL;
+			return;
 		}
+		i = table->migrate_pos++;
+		bucket = _entry(table, i);
+		if (!bucket->key) continue;
+		pos = _index_find_entry(&table->old, (uint32_t)bucket->hash, i + 1);
+		if (pos == -1) continue;
+		_index_delete(&table->old, pos);
+		_index_insert(&table->index, (uint32_t)bucket->hash, i + 1);
 	}
 }
 
+/* start a resize: a new index twice the size takes over inserts,
+ * the current one becomes old and is drained by _migrate() */
+static int
+_grow (struct hash_table *table)
+{
+	struct hash_index new;
+	uint32_t nr_slots;
+	/* still draining the last one, finish that first */
+	_migrate(table, UINT_MAX);
+	nr_slots = table->index.slots ? (table->index.mask + 1) * 2 : HASH_MIN_SLOTS;
+	if (_index_alloc(&new, nr_slots)) return -1;
+	if (table->index.slots)
+	{
+		table->old = table->index;
+		table->migrate_pos = 0;
+	}
+	table->index = new;
+	return 0;
+}
+
+/* hand out an entry, reusing free ones first, returns its index
+ * or -1 if we're out of memory */
+static long
+_entry_alloc (struct hash_table *table)
+{
+	struct hash_bucket **pages;
+	unsigned int i;
+	if (table->free_list)
+	{
+		i = table->free_list - 1;
+		table->free_list = (unsigned int)_entry(table, i)->hash;
+		return i;
+	}
+	if (table->high == table->nr_pages << HASH_PAGE_SHIFT)
+	{
+		pages = realloc(table->pages, (table->nr_pages + 1) * sizeof(*pages));
+		if (!pages) return -1;
+		table->pages = pages;
+		pages[table->nr_pages] = malloc(HASH_PAGE_SZ * sizeof(**pages));
+		if (!pages[table->nr_pages]) return -1;
+		table->nr_pages++;
+	}
+	return table->high++;
+}
+
+static void
+_entry_free (struct hash_table *table, unsigned int i)
+{
+	struct hash_bucket *bucket;
+	bucket = _entry(table, i);
+	bucket->key = NULL;
+	bucket->hash = table->free_list;
+	table->free_list = i + 1;
+}
+
 /* table must be initialised by hash_init() already
- * we dynamically allocate a new bucket entry,
- * with a pointer to a *copy* of the key, also dynamic
+ * we take a new entry pointing at the key itself, not a copy, so
+ * it has to stay where it is, unchanged, until it's removed. keys
+ * are compared byte for byte, callers wanting case insensitive
+ * ones fold them first, see casemap.c. nothing is allocated here
+ * beyond the odd page of entries or a bigger index
  * success: return 0, otherwise return -1
  * NB: its up to the callers to ensure there are no duplicate
  *     keys. why should we have to do it here? Besides,
- *     duplicate keys doesnt stop the hash table functioning
- *     the duplicates simply behave as a FILO stack type thing
+ *     duplicate keys doesnt stop the hash table functioning,
+ *     lookups just find one of them
  */
 int
 hash_insert (struct hash_table *table, const char *key, void *value)
 {
 	struct hash_bucket *bucket;
-	unsigned char hash;
-	bucket = malloc(sizeof(*bucket));
-	if (!bucket) return -1;
-	bucket->key = _ncasedup(key);
-	if (!bucket->key)
-	{
-		free(bucket);
+	uint64_t hash;
+	long i;
+	/* keep the load factor under 0.8, counting whatever is
+	 * still waiting in the old index */
+	if ((!table->index.slots
+		|| (uint64_t)(table->index.used + table->old.used + 1) * 5
+			> (uint64_t)(table->index.mask + 1) * 4)
+		&& _grow(table))
 		return -1;
-	}
+	i = _entry_alloc(table);
+	if (i == -1) return -1;
+	hash = _hash(table, key);
+	bucket = _entry(table, i);
+	bucket->hash = hash;
+	bucket->key = key;
 	bucket->value = value;
-	bucket->next = NULL;
-	hash = _pearson_hash (table, key);
-	/* deal with collision case */
-	if (table->bucket_array[hash])
-		bucket->next = table->bucket_array[hash];
-	table->bucket_array[hash] = bucket;
+	_index_insert(&table->index, (uint32_t)hash, i + 1);
 	table->nr_entries++;
+	_migrate(table, HASH_MIGRATE_STEP);
 	return 0;
 }
 
 /* look up a key in the hash table and return its bucket
  * makes sense to have a seperate function here as both
  * hash_lookup() and hash_remove() require this functionality
- * the latter needs args prev and hash_p, the former may
- * pass these as NULL */
+ * the latter needs args index_p and pos_p, the former may
+ * pass these as NULL. nothing is allocated here */
 static struct hash_bucket *
 _bucket_lookup (struct hash_table *table, const char *key,
-				struct hash_bucket **prev, unsigned char *hash_p)
+				struct hash_index **index_p, long *pos_p)
 {
-	unsigned char hash;
-	struct hash_bucket *bucket;
-	char *mykey;
-	mykey = _ncasedup(key);
-	hash = _pearson_hash(table, mykey);
-	if (hash_p) *hash_p = hash;
-	bucket = table->bucket_array[hash];
-	/* does any key exist for that hash? */
-	if (!bucket)
+	struct hash_index *index;
+	uint64_t hash;
+	long pos;
+	hash = _hash(table, key);
+	index = &table->index;
+	pos = _index_find(table, index, hash, key);
+	if (pos == -1 && table->old.slots)
 	{
-		free(mykey);
-		return NULL;
+		index = &table->old;
+		pos = _index_find(table, index, hash, key);
 	}
-	if (prev) *prev = NULL;
-	while (bucket)
-	{
-		if (!strcmp(mykey, bucket->key)) return bucket;
-		if (prev && bucket->next) *prev = bucket;
-		bucket = bucket->next;
-	}
-	free(mykey);
-	return NULL;
+	if (pos == -1) return NULL;
+	if (index_p) *index_p = index;
+	if (pos_p) *pos_p = pos;
+	return _entry(table, index->slots[pos].entry - 1);
 }
 
 /* look up a key in the table and return a pointer to
@@ -129,86 +330,99 @@ hash_lookup (struct hash_table *table, const char *key)
 	return bucket->value;
 }
 
-/* look up a key in the table and remove it, freeing
- * any dynamic data allocated by our hash table implementation
- * also return the data pointer so the caller can free() that
+/* look up a key in the table and remove it, freeing its entry
+ * for reuse, also return the data pointer so the caller can free() that
  * if necessary. we don't want to do that here */
 void *
 hash_remove (struct hash_table *table, const char *key)
 {
-	struct hash_bucket *bucket, *prev;
+	struct hash_bucket *bucket;
+	struct hash_index *index;
 	void *data;
-	unsigned char hash;
-	bucket = _bucket_lookup(table, key, &prev, &hash);
+	long pos;
+	uint32_t entry;
+	bucket = _bucket_lookup(table, key, &index, &pos);
 	if (!bucket) return NULL;
-	/* having retrieved the bucket, we can unlink it
-	 * by linking the previous bucket to the next bucket
-	 * or if there is no previous bucket we simply
-	 * point the hash to the next bucket
-	 * this also works fine if bucket->next is NULL */
-	if (prev) prev->next = bucket->next;
-	else table->bucket_array[hash] = bucket->next;
-	/* now we just have to free the dynamic memory */
 	/* WOAH WAIT, save the data pointer first */
 	data = bucket->value;
-	free(bucket->key);
-	free(bucket);
+	entry = index->slots[pos].entry;
+	_index_delete(index, pos);
+	_entry_free(table, entry - 1);
 	table->nr_entries--;
+	_migrate(table, HASH_MIGRATE_STEP);
 	return data;
 }
 
-/* cleanup function, searches entire table, delinking
- * and freeing buckets */
+/* cleanup function, frees every entry and both indexes,
+ * the table can be reused afterwards */
 void
 hash_free (struct hash_table *table)
 {
-	int i;
+	unsigned int i;
+	for (i = 0; i < table->nr_pages; ++i)
+		free(table->pages[i]);
+	free(table->pages);
+	free(table->index.slots);
+	free(table->old.slots);
+	table->pages = NULL;
+	table->nr_pages = 0;
+	table->high = 0;
+	table->free_list = 0;
+	table->index.slots = NULL;
+	table->old.slots = NULL;
+	table->index.used = table->old.used = 0;
+	table->nr_entries = 0;
+}
+
+/* hash_iter_init (iter, table)
+ * point a cursor at the first entry of table, nothing is allocated
+ * so there's nothing to clean up when the walk is abandoned */
+void
+hash_iter_init (struct hash_iter *iter, struct hash_table *table)
+{
+	iter->table = table;
+	iter->pos = 0;
+}
+
+/* struct hash_bucket *hash_iter_next (iter)
+ * return the next entry and step past it, NULL once the walk is done.
+ * callers walking a big table should take a few at a time and pick up
+ * where they left off on a later loop iteration */
+struct hash_bucket *
+hash_iter_next (struct hash_iter *iter)
+{
+	struct hash_table *table = iter->table;
 	struct hash_bucket *bucket;
-	i = 0;
-	while (i < TABLE_SZ)
+	while (iter->pos < table->high)
 	{
-		bucket = table->bucket_array[i];
-		if (bucket)
-		{
-			table->bucket_array[i] = bucket->next;
-			free(bucket->key);
-			free(bucket);
-		}
-		else
-		{
-			i++;
-		}
+		bucket = _entry(table, iter->pos);
+		iter->pos++;
+		if (bucket->key)
+			return bucket;
 	}
+	return NULL;
 }
 
-/* char **hash_keys (table)
+/* const char **hash_keys (table)
  * return a pointer to an array of pointers
  * to keys, the caller must be aware that these are
  * the actual keys in the table not copies */
-char **
+const char **
 hash_keys (struct hash_table *table)
 {
 	struct hash_bucket *bucket;
-	char **keys;
-	int i, j;
+	struct hash_iter iter;
+	const char **keys;
+	unsigned int j;
 
 	/* entries + 1 to provide a NULL terminal */
 	keys = malloc((table->nr_entries + 1) * sizeof(*keys));
 	if (!keys) return NULL;
 
-	/* iterate thru array */
-	i = j = 0;
-	while (i < TABLE_SZ)
-	{
-		bucket = table->bucket_array[i];
-		/* iterate thru linked list */
-		while (bucket)
-		{
-			keys[j] = bucket->key;
-			j++;
-			bucket = bucket->next;
-		}
-	}
+	j = 0;
+	hash_iter_init(&iter, table);
+	while ((bucket = hash_iter_next(&iter)))
+		keys[j++] = bucket->key;
 
 	/* NULL terminal */
 	keys[j] = NULL;
@@ -221,26 +435,19 @@ void **
 hash_values (struct hash_table *table)
 {
 	struct hash_bucket *bucket;
+	struct hash_iter iter;
 	void **ptr_array;
-	int i, j;
+	unsigned int j;
 
 	/* entries + 1 to provide NULL terminal, users may have inserted NULL
 	 * keys and if so, they can use table->nr_entries instead of our NULL */
 	ptr_array = malloc((table->nr_entries + 1) * sizeof(*ptr_array));
 	if (!ptr_array) return NULL;
 
-	/* iterate thru array */
-	i = j = 0;
-	while (i < TABLE_SZ)
-	{
-		bucket = table->bucket_array[i];
-		while (bucket)
-		{
-			ptr_array[j] = bucket->value;
-			j++;
-			bucket = bucket->next;
-		}
-	}
+	j = 0;
+	hash_iter_init(&iter, table);
+	while ((bucket = hash_iter_next(&iter)))
+		ptr_array[j++] = bucket->value;
 
 	/* NULL terminal */
 	ptr_array[j] = NULL;
@@ -253,24 +460,17 @@ struct hash_bucket **
 hash_buckets (struct hash_table *table)
 {
 	struct hash_bucket *bucket, **buckets;
-	int i, j;
+	struct hash_iter iter;
+	unsigned int j;
 
 	/* entries + 1 for NULL terminal */
 	buckets = malloc((table->nr_entries + 1) * sizeof(*buckets));
 	if (!buckets) return NULL;
 
-	/* unroll hash table */
-	i = j = 0;
-	while (i < TABLE_SZ)
-	{
-		bucket = table->bucket_array[i];
-		while (bucket)
-		{
-			buckets[j] = bucket;
-			j++;
-			bucket = bucket->next;
-		}
-	}
+	j = 0;
+	hash_iter_init(&iter, table);
+	while ((bucket = hash_iter_next(&iter)))
+		buckets[j++] = bucket;
 
 	/* NULL terminal */
 	buckets[j] = NULL;
@@ -1,20 +1,58 @@
 /* hash.h - header file for hash table implementation */
 #ifndef __HASH_H__
 #define __HASH_H__
+#include <stdint.h>
 
-#define PERM_TABLE_SZ 256
-#define TABLE_SZ 256
+#define HASH_PAGE_SHIFT 10
+#define HASH_PAGE_SZ (1 << HASH_PAGE_SHIFT) /* entries per page */
+#define HASH_MIN_SLOTS 64
+#define HASH_MIGRATE_STEP 8 /* entries moved to a grown index per insert/remove */
 
+/* an entry, these live in fixed pages and never move once inserted.
+ * key is the caller's own, or NULL if the entry is free, in which
+ * case hash is the index + 1 of the next free entry */
 struct hash_bucket {
-	char *key;
+	uint64_t hash;
+	const char *key;
 	void *value; /* pointer to whatever */
-	void *next; /* this will be a pointer to another struct_bucket */
 };
 
+/* a slot in the open addressed (robin hood) index, hash is the low half
+ * of the entry's hash so most mismatches never touch the entry,
+ * entry is the entry index + 1, 0 means the slot is empty */
+struct hash_slot {
+	uint32_t hash;
+	uint32_t entry;
+};
+
+struct hash_index {
+	struct hash_slot *slots;
+	uint32_t mask;
+	uint32_t used;
+};
+
+/* when the index fills up a new one twice the size takes over and the
+ * old one is drained into it a few entries at a time, old.slots is
+ * NULL when no resize is in progress */
 struct hash_table {
 	unsigned int nr_entries;
-	struct hash_bucket *bucket_array[TABLE_SZ];
-	char permut_table[PERM_TABLE_SZ];
+	uint64_t seed;
+	struct hash_index index;
+	struct hash_index old;
+	unsigned int migrate_pos;
+	struct hash_bucket **pages;
+	unsigned int nr_pages;
+	unsigned int high; /* entries ever handed out */
+	unsigned int free_list;
+};
+
+/* a cursor over a table's entries, it's just a position and entries
+ * never move, so it can be kept around across event loop iterations
+ * while the table changes. every entry present for the whole walk is
+ * returned exactly once, entries inserted meanwhile may or may not be */
+struct hash_iter {
+	struct hash_table *table;
+	unsigned int pos;
 };
 
 void hash_init(struct hash_table *);
@@ -24,8 +62,10 @@ void *hash_remove(struct hash_table *, const char *key);
 void hash_free(struct hash_table *); /* NB this just delinks and frees all buckets */
 #define hash_assert(table_ptr) \
 		assert((table_ptr)->nr_entries == 0)
-char **hash_keys(struct hash_table *);
+const char **hash_keys(struct hash_table *);
 void **hash_values(struct hash_table *);
 struct hash_bucket **hash_buckets(struct hash_table *);
+void hash_iter_init(struct hash_iter *, struct hash_table *);
+struct hash_bucket *hash_iter_next(struct hash_iter *);
 
 #endif /* __HASH_H__ */
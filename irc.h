@@ -10,5 +10,9 @@
 #define IRC_CHANNAME_MAX    23
 #define IRC_TOPIC_MAX       127
 #define IRC_MESSAGE_MAX     512
+#define IRC_PARAMS_MAX      15
+#define IRC_PREFIX_MAX      (IRC_NICKNAME_MAX + IRC_USERNAME_MAX \
+                                + IRC_HOSTNAME_MAX + 2)
+#define IRC_COMMAND_MAX     16  /* nothing in RFC 2812 comes close */
 
 #endif /* IRC_H */
@@ -7,146 +7,953 @@
 #include <errno.h>
 #include <signal.h>
 #include <time.h>
+#include <pthread.h>
 #include <ev.h>         /* requires libev */
 #include "unix.h"       /* for unix_listen/accept */
 #include "ircd.h"       /* essential data structure definitions */
+#include "worker.h"     /* for worker_t */
+#include "parse.h"      /* for parse_message */
+#include "member.h"     /* for member_t */
+#include "reply.h"      /* for reply_init */
+#include "command.h"    /* for command_dispatch */
+#include "hash.h"       /* for hash_init */
+#include "uring.h"      /* for uring_init */
+#include "link.h"       /* for link_t */
+#include "resolve.h"    /* for resolve_reverse */
+#include "log.h"        /* for log_info */
+#include "stats.h"      /* for stats_listen */
+#include "upgrade.h"    /* for upgrade_exec */
 
-#define ANY "0.0.0.0"
-#define IRCD_HOST ANY
-#define IRCD_PORT 6667
+#define ACCEPT_BATCH 64     /* most connections accepted per wakeup */
+#define IRCD_LINKS_MAX 16   /* -l options */
 
 FILE *logfile = NULL;
+char ircd_name[IRC_HOSTNAME_MAX+1];
+char ircd_created[64];
+pthread_mutex_t     ircd_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static int          server_fd = 0;
-static ev_io        server_w;
 static ev_signal    sigterm_w;
+static ev_signal    sighup_w;
+static int          upgrading = 0;
+static char         **ircd_argv;
+static int          foreground = 0;
+static int          slab_flags = 0;
+#ifdef HAVE_IO_URING
+static int          use_uring = 0;
+#endif
+static int          resolve_deadline = IRCD_RESOLVE_DEADLINE;
+static const char   *hosts_path = NULL;
+static const char   *metrics_path = NULL;
 
-static client_t     *client_list = NULL;
-static int          nr_clients = 0;
-static user_t       *user_list = NULL;
-static int          nr_users = 0;
-static chan_t       *chan_list = NULL;
-static int          nr_chans = 0;
+/* user, channel, server and membership pools, these are shared
+ * by every worker so they're under ircd_lock as well */
+slab_t              user_slab;
+slab_t              chan_slab;
+slab_t              server_slab;
+slab_t              member_slab;
+
+/* registered users and channels, by name as well */
+struct hash_table   nick_table;
+struct hash_table   chan_table;
+user_t              *user_list = NULL;
+int                 nr_users = 0;
+chan_t              *chan_list = NULL;
+int                 nr_chans = 0;
 static server_t     *server_list = NULL;
 static int          nr_servers = 0;
 
+/* servers we connect out to, from -l host:port, all run by worker 0 */
+static link_t       links[IRCD_LINKS_MAX];
+static char         *link_args[IRCD_LINKS_MAX];
+static in_port_t    link_ports[IRCD_LINKS_MAX];
+static int          nr_links = 0;
+
+/* connection classes, indexed by client type */
+class_t ircd_classes[] = {
+    { "unregistered",   SENDQ_UNREGISTERED },
+    { "user",           SENDQ_USER },
+    { "server",         SENDQ_SERVER },
+    { NULL,             0 }
+};
+
+/* quit_reason(reason)
+ * turn a drop() reason into something readable */
+static const char *
+quit_reason (int reason)
+{
+    switch (reason)
+    {
+        case QUIT_MAX_SENDQ_EXCEEDED:   return "Max SendQ exceeded";
+        case QUIT_OUT_OF_MEMORY:        return "Out of memory";
+        case QUIT_USER_MSG:             return "Quit";
+        case QUIT_EOF:                  return "Connection closed";
+        case QUIT_PING_TIMEOUT:         return "Ping timeout";
+        case QUIT_REGISTER_TIMEOUT:     return "Registration timed out";
+        default:                        return strerror(reason);
+    }
+}
+
+/* client_unref(client)
+ * let go of a reference to a client, the last one frees it. only the
+ * owning worker ever lets go, so its slab needs no locking */
+void
+client_unref (client_t *client)
+{
+    if (__atomic_sub_fetch(&client->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        slab_free(&client->worker->client_slab, client);
+}
+
+/* drop(client, reason)
+ * close a client connection and forget all about it, must be called
+ * by the worker that owns the client. the memory lives on until any
+ * posts from other workers that still mention it have been delivered,
+ * and a user is only forgotten by client_reap(), so it's safe to drop
+ * clients in the middle of walking a channel's members
+ * NB: client no longer points to valid memory after this */
+void
+drop (client_t *client, int reason)
+{
+    worker_t *worker = client->worker;
+
+    log_info("dropping fd %d: %s", client->fd, quit_reason(reason));
+    stats_add(&worker->stats.drops, 1);
+    if (reason == QUIT_MAX_SENDQ_EXCEEDED)
+        stats_add(&worker->stats.sendq_drops, 1);
+    ev_io_stop(worker->loop, &client->w);
+    wheel_cancel(&worker->wheel, &client->timer);
+#ifdef HAVE_IO_URING
+    /* the kernel mustn't be left working on an fd we're about to close */
+    if (worker->ring)
+        uring_cancel(client);
+#endif
+    close(client->fd);
+    client->fd = -1;
+    net_free_sendq(client);
+    if (client->in_buf)
+        net_free_recvbuf(client->in_buf);
+    client->in_buf = NULL;
+    list_unlink((list_t **)&worker->client_list, (list_t *)client);
+    worker->nr_clients--;
+    if (!client->more)
+    {
+        client_unref(client);
+        return;
+    }
+    /* our reference goes with it onto the reap list */
+    client->reason = reason;
+    list_push((list_t **)&worker->reap_list, (list_t *)client);
+}
+
+/* server_free(server)
+ * forget a server whose connection is gone, and if it was one of our
+ * links start trying to get it back
+ * NB: hold ircd_lock */
+static void
+server_free (server_t *server)
+{
+    list_unlink((list_t **)&server_list, (list_t *)server);
+    nr_servers--;
+    server->client->more = NULL;
+    if (server->link)
+        link_lost(server->link);
+    slab_free(&server_slab, server);
+}
+
+/* client_reap(worker)
+ * forget the users behind the clients the worker dropped during this
+ * loop iteration, called from the worker's ev_prepare */
+void
+client_reap (worker_t *worker)
+{
+    client_t *client;
+
+    if (!worker->reap_list)
+        return;
+    pthread_mutex_lock(&ircd_lock);
+    while ((client = (client_t *)list_pop((list_t **)&worker->reap_list)))
+    {
+        if (client->type == CLIENT_SERVER)
+            server_free(client->more);
+        else
+            command_drop(client, quit_reason(client->reason));
+        client_unref(client);
+    }
+    pthread_mutex_unlock(&ircd_lock);
+}
+
+/* client_line(client, line, len)
+ * every complete line a client sends us ends up here
+ * returns -1 if the client got dropped along the way */
+static int
+client_line (client_t *client, const char *line, int len)
+{
+    message_t msg;
+
+    client->timestamp = ev_now(client->worker->loop);
+    /* RFC 2812 says to silently ignore anything we can't make sense of */
+    if (parse_message(&msg, line, len))
+        return 0;
+    return command_dispatch(client, &msg);
+}
+
+/* client_resume(client)
+ * registration was held up by the client's hostname lookup and isn't
+ * any more, it gets the rest of its time to register, or registers
+ * now if it's already sent NICK and USER */
+static void
+client_resume (client_t *client)
+{
+    client->resolving = 0;
+    wheel_arm(&client->worker->wheel, &client->timer,
+                                client->timestamp + IRCD_REGISTER_TIMEOUT);
+    pthread_mutex_lock(&ircd_lock);
+    command_register(client);
+    pthread_mutex_unlock(&ircd_lock);
+}
+
+/* client_resolved(lookup)
+ * a client's hostname lookup came back, the client's reference from
+ * client_new() kept it around even if it's been dropped since */
+static void
+client_resolved (lookup_t *lookup)
+{
+    client_t *client = lookup->data;
+
+    if (client->fd != -1 && client->resolving)
+    {
+        if (lookup->found)
+            strcpy(client->host, lookup->name);
+        client_resume(client);
+    }
+    client_unref(client);
+}
+
+/* client_timeout(timer)
+ * a client's timer went off. activity never touches the timer, only
+ * client->timestamp, so here we work out what's actually due: a client
+ * still waiting on its hostname lookup goes on without it, one that
+ * never registered is dropped, one that's been heard from since
+ * gets its timer pushed back, a quiet one gets a PING, and one that
+ * stayed quiet after the PING is dropped */
+static void
+client_timeout (wheel_timer_t *timer)
+{
+    client_t *client = timer->data;
+    worker_t *worker = client->worker;
+    ev_tstamp now = ev_now(worker->loop);
+    slice_t server;
+
+    if (client->type == CLIENT_UNREGISTERED)
+    {
+        if (client->resolving)
+            client_resume(client);
+        else
+            drop(client, QUIT_REGISTER_TIMEOUT);
+        return;
+    }
+    if (now - client->timestamp < IRCD_PING_FREQ)
+    {
+        client->pinged = 0;
+        wheel_arm(&worker->wheel, timer, client->timestamp + IRCD_PING_FREQ);
+        return;
+    }
+    if (client->pinged)
+    {
+        drop(client, QUIT_PING_TIMEOUT);
+        return;
+    }
+    server.ptr = ircd_name;
+    server.len = strlen(ircd_name);
+    if (net_sendt(client, REPLY_PING, &server, 1) == -1)
+        return;
+    client->pinged = 1;
+    wheel_arm(&worker->wheel, timer, now + IRCD_PING_TIMEOUT);
+}
+
 static void
 client_cb (EV_P_ ev_io *w, int revents)
 {
-    
+    client_t *client = w->data;
+
+    /* writeable again, EV_WRITE is only armed while there's a backlog */
+    if (revents & EV_WRITE && net_flush(client) == -1)
+        return;
+    if (revents & EV_READ)
+        net_recv(client, &client_line);
 }
     
+/* client_add(worker, fd, addr)
+ * register a freshly connected socket with the worker that's to own
+ * it and start watching it, or close it if we can't take it. addr is
+ * the peer's address if accepting it told us, NULL to ask the socket
+ * returns the new client, or NULL if we couldn't take it */
+static client_t *
+client_add (worker_t *worker, int new_fd, const char *addr)
+{
+    client_t *my_client;
+
+    /* register client connection in state, the limit is split
+     * evenly between the workers */
+    if (worker->nr_clients >= IRCD_CLIENTS_MAX / nr_workers)
+    {
+        /* we hit max clients?? */
+        log_warn("too many clients, dropping connection %d", new_fd);
+        close(new_fd);
+        return NULL;
+    }
+    if (!(my_client = slab_alloc(&worker->client_slab)))
+    {
+        log_warn("client slab exhausted");
+        close(new_fd);
+        return NULL;
+    }
+    log_debug("worker %d: new client on fd %d", worker->id, new_fd);
+    list_push((list_t **)&worker->client_list, (list_t *)my_client);
+    worker->nr_clients++;
+
+    /* save client info and init watcher */
+    my_client->worker = worker;
+    my_client->refs = 1;
+    my_client->fd = new_fd;
+    my_client->timestamp = ev_now(worker->loop);
+    my_client->pinged = 0;
+    my_client->type = CLIENT_UNREGISTERED;
+    my_client->more = NULL;
+    if (addr)
+        snprintf(my_client->host, sizeof(my_client->host), "%s",
+                                                addr[0] ? addr : "unknown");
+    else if (unix_peer(new_fd, my_client->host, sizeof(my_client->host)))
+        strcpy(my_client->host, "unknown");
+    my_client->resolving = 0;
+    my_client->in_buf = NULL;
+    my_client->out_buf.first = NULL;
+    my_client->out_buf.last = NULL;
+    my_client->out_buf.offset = 0;
+    my_client->out_buf.bytes = 0;
+    my_client->out_buf.max = ircd_classes[CLIENT_UNREGISTERED].sendq;
+    my_client->dirty = 0;
+    my_client->dirty_next = NULL;
+    my_client->reason = 0;
+    my_client->seen = 0;
+    wheel_timer_init(&my_client->timer, &client_timeout, my_client);
+    wheel_arm(&worker->wheel, &my_client->timer,
+                            my_client->timestamp + IRCD_REGISTER_TIMEOUT);
+    ev_io_init(&my_client->w, &client_cb, new_fd, EV_READ);
+    my_client->w.data = my_client; /* lol recursion */
+#ifdef HAVE_IO_URING
+    /* the ring reads for us, the watcher is never started */
+    if (worker->ring)
+    {
+        if (!uring_recv(my_client))
+            return my_client;
+        drop(my_client, QUIT_OUT_OF_MEMORY);
+        return NULL;
+    }
+#endif
+    ev_io_start(worker->loop, &my_client->w);
+    return my_client;
+}
+
+/* client_new(worker, fd, addr)
+ * a connection was accepted, find out what the client's called. if the
+ * cache doesn't know, registration waits for the lookup, but only for
+ * resolve_deadline and the lookup holds a reference to the client */
+static void
+client_new (worker_t *worker, int new_fd, const char *addr)
+{
+    char name[IRC_HOSTNAME_MAX+1];
+    client_t *client;
+
+    if (!(client = client_add(worker, new_fd, addr)) || !resolve_deadline)
+        return;
+    if (resolve_cached(client->host, name))
+    {
+        if (name[0])
+            strcpy(client->host, name);
+        return;
+    }
+    /* if the resolver's swamped it'll have to be known by its address */
+    if (!resolve_reverse(worker, client->host, &client_resolved, client))
+        return;
+    __atomic_add_fetch(&client->refs, 1, __ATOMIC_RELAXED);
+    client->resolving = 1;
+    wheel_arm(&worker->wheel, &client->timer,
+                                client->timestamp + resolve_deadline);
+}
+
+/* server_add(client, host, link)
+ * make a server client of a client, link is the link that made it if
+ * there was one. returns -1 if we're out of room */
+static int
+server_add (client_t *client, const char *host, link_t *link)
+{
+    server_t *server;
+
+    pthread_mutex_lock(&ircd_lock);
+    if ((server = slab_alloc(&server_slab)))
+    {
+        snprintf(server->host, sizeof(server->host), "%s", host);
+        server->client = client;
+        server->link = link;
+        list_push((list_t **)&server_list, (list_t *)server);
+        nr_servers++;
+    }
+    pthread_mutex_unlock(&ircd_lock);
+    if (!server)
+        return -1;
+    client->type = CLIENT_SERVER;
+    client->more = server;
+    client->out_buf.max = ircd_classes[CLIENT_SERVER].sendq;
+    return 0;
+}
+
+/* server_new(link, fd)
+ * a link came up, the connection is a server client from the start.
+ * we introduce ourselves, there's nothing yet to introduce to us */
+static void
+server_new (link_t *link, int new_fd)
+{
+    client_t *client;
+
+    if (!(client = client_add(link->worker, new_fd, NULL)))
+    {
+        link_lost(link);
+        return;
+    }
+    if (server_add(client, link->host, link))
+    {
+        drop(client, QUIT_OUT_OF_MEMORY);
+        link_lost(link);
+        return;
+    }
+    net_sendf(client, "SERVER %s 1 :%s", ircd_name, IRCD_VERSION);
+}
+
 static void
 server_cb (EV_P_ ev_io *w, int revents)
 {
-    int new_fd;
-    client_t *my_client;
+    worker_t *worker = w->data;
+    char addr[IRC_HOSTNAME_MAX+1];
+    int new_fd, nr_accepted;
 
     /* NOTES: possible event bits are EV_READ and EV_ERROR
      * however, EV_ERROR shouldn't really happen, so if (EV_ERROR) fatal
      * otherwise assume EV_READ */
     if (revents & EV_ERROR)
     {
-        fprintf(stderr, "FATAL: unexpected EV_ERROR on server event watcher\n");
+        log_error("FATAL: unexpected EV_ERROR on server event watcher");
         exit(1);
     }
 
-    /* assume EV_READ */
-    new_fd = unix_accept(server_fd);
-    if (new_fd == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
-        return;     /* nothing interesting happened */
-    else if (new_fd == -1)
+    /* assume EV_READ, drain the backlog but only up to ACCEPT_BATCH, the
+     * clients we already have deserve a look in during a connection storm
+     * and libev will be straight back if there are more waiting */
+    for (nr_accepted = 0; nr_accepted < ACCEPT_BATCH; ++nr_accepted)
     {
-        fprintf(stderr, "accept failed unexpectedly: %s\n", strerror(errno));
-        return;
+        new_fd = unix_accept(worker->server_fd, addr, sizeof(addr));
+        if (new_fd == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK
+                && errno != ECONNABORTED && errno != EINTR)
+                log_error("accept failed unexpectedly: %s",
+                                                        strerror(errno));
+            break;
+        }
+        client_new(worker, new_fd, addr);
     }
-    
-    fprintf(stderr, "accepted connection: fd: %d\n", new_fd);
-
-    /* register client connection in state */
-    if (nr_clients <= IRCD_CLIENTS_MAX
-        && (my_client = malloc(sizeof(*my_client))))
-    {
-        list_push((list_t **)&client_list, (list_t *)my_client);
-        nr_clients++;
-
-        /* save client info and init watcher */
-        my_client->fd = new_fd;
-        my_client->timestamp = time(NULL);
-        my_client->type = CLIENT_UNREGISTERED;
-        my_client->more = NULL;
-        my_client->in_buf.index = 0;
-        my_client->out_buf = NULL;
-        ev_io_init(&my_client->w, &client_cb, new_fd, EV_READ);
-        ev_io_start(EV_A_ &my_client->w);
-        my_client->w.data = my_client; /* lol recursion */
+
+    stats_add(&worker->accept_wakeups, 1);
+    stats_add(&worker->accepts, nr_accepted);
+    stats_add(&worker->syscalls, nr_accepted + 1);
+    if (nr_accepted > worker->accept_batch_max)
+        __atomic_store_n(&worker->accept_batch_max, nr_accepted,
+                                                        __ATOMIC_RELAXED);
+}
+
+static void
+sigterm_cb (EV_P_ ev_signal *w, int revents)
+{
+    log_info("received signal %d: breaking event loop", revents);
+    ev_break(EV_A_ EVBREAK_ALL);
+}
+
+/* sighup_cb
+ * SIGHUP hands everything over to whatever binary argv[0] is now, once
+ * the loops have stopped, see ircd_upgrade() */
+static void
+sighup_cb (EV_P_ ev_signal *w, int revents)
+{
+#ifdef HAVE_IO_URING
+    /* the kernel may be halfway through sending from a sendq, so there's
+     * no knowing what's left to hand over */
+    if (use_uring)
+    {
+        log_warn("received SIGHUP: can't upgrade with io_uring");
         return;
     }
-    else if (my_client)
-        /* we hit max clients?? */
-        fprintf(stderr, "too many clients, dropping connection %d\n", new_fd);
+#endif
+    log_info("received SIGHUP: upgrading");
+    upgrading = 1;
+    ev_break(EV_A_ EVBREAK_ALL);
+}
+
+/* ircd_save(u)
+ * everything the next process needs to carry on where we stopped: the
+ * listeners, then every client with the user or server behind it and
+ * what's in its buffers, then the channels. ircd_restore() reads it
+ * back in the same order */
+static void
+ircd_save (upgrade_t *u)
+{
+    client_t *client;
+    server_t *server;
+    int i, n;
+
+    upgrade_put_str(u, ircd_created);
+    upgrade_put_int(u, nr_workers);
+    for (n = i = 0; i < nr_workers; ++i)
+    {
+        upgrade_put_fd(u, workers[i].server_fd);
+        n += workers[i].nr_clients;
+    }
+    upgrade_put_int(u, n);
+    pthread_mutex_lock(&ircd_lock);
+    for (i = 0; i < nr_workers; ++i)
+    {
+        for (client = workers[i].client_list; client;
+                client = (client_t *)client->list_head.next)
+        {
+            upgrade_put_fd(u, client->fd);
+            upgrade_put_int(u, i);
+            upgrade_put_int(u, client->type);
+            upgrade_put_int(u, client->pinged);
+            upgrade_put_int(u, client->resolving);
+            upgrade_put_str(u, client->host);
+            upgrade_put(u, &client->timestamp, sizeof(client->timestamp));
+            if (client->type == CLIENT_SERVER)
+            {
+                server = client->more;
+                upgrade_put_str(u, server->host);
+                upgrade_put_int(u, server->link ? server->link - links : -1);
+            }
+            else
+                command_save_user(u, client);
+            net_save(u, client);
+        }
+    }
+    command_save_chans(u);
+    pthread_mutex_unlock(&ircd_lock);
+}
+
+/* client_restore(u)
+ * one client as ircd_save() saved it, with its timer armed as if
+ * nothing had happened. a hostname lookup that was under way belonged
+ * to the old process, so the client goes on without it
+ * returns -1 if it couldn't be */
+static int
+client_restore (upgrade_t *u)
+{
+    char host[IRC_HOSTNAME_MAX+1];
+    worker_t *worker;
+    client_t *client;
+    link_t *link;
+    int fd, resolving, ret;
+    long n;
+
+    fd = upgrade_get_fd(u);
+    n = upgrade_get_int(u);
+    /* the host comes with the rest, there's no need to ask the socket */
+    if (u->failed
+        || !(client = client_add(&workers[n % nr_workers], fd, "")))
+        return -1;
+    worker = client->worker;
+    client->type = upgrade_get_int(u);
+    client->pinged = upgrade_get_int(u);
+    resolving = upgrade_get_int(u);
+    upgrade_get_str(u, client->host, sizeof(client->host));
+    upgrade_get(u, &client->timestamp, sizeof(client->timestamp));
+    if (u->failed || client->type < CLIENT_UNREGISTERED
+        || client->type > CLIENT_SERVER)
+        return -1;
+    client->out_buf.max = ircd_classes[client->type].sendq;
+    if (client->type == CLIENT_SERVER)
+    {
+        upgrade_get_str(u, host, sizeof(host));
+        n = upgrade_get_int(u);
+        link = n >= 0 && n < nr_links ? &links[n] : NULL;
+        if (u->failed || server_add(client, host, link))
+            return -1;
+        if (link)
+            link_adopt(link);
+    }
+    else
+    {
+        pthread_mutex_lock(&ircd_lock);
+        ret = command_restore_user(u, client);
+        pthread_mutex_unlock(&ircd_lock);
+        if (ret)
+            return -1;
+    }
+
+    /* queued output goes out once the worker's loop is running */
+    worker_self = worker;
+    if (net_restore(u, client, &client_line))
+        return -1;
+    if (client->type == CLIENT_UNREGISTERED)
+        wheel_arm(&worker->wheel, &client->timer,
+                                client->timestamp + IRCD_REGISTER_TIMEOUT);
+    else if (client->pinged)
+        wheel_arm(&worker->wheel, &client->timer,
+                                ev_now(worker->loop) + IRCD_PING_TIMEOUT);
     else
-        fprintf(stderr, "malloc: %s\n", strerror(errno));
-    close(new_fd);
-    free(my_client);
+        wheel_arm(&worker->wheel, &client->timer,
+                                client->timestamp + IRCD_PING_FREQ);
+    if (resolving)
+        client_resume(client);
+    return 0;
 }
 
+/* ircd_restore(u)
+ * the clients, users and channels ircd_save() saved, the listeners have
+ * already been taken by ircd(). returns -1 if we can't carry on with
+ * them, and the old process does instead */
+static int
+ircd_restore (upgrade_t *u)
+{
+    long n, nr_clients;
+    int ret;
+
+    nr_clients = upgrade_get_int(u);
+    for (n = 0; n < nr_clients; ++n)
+        if (client_restore(u))
+            break;
+    worker_self = &workers[0];
+    pthread_mutex_lock(&ircd_lock);
+    ret = n < nr_clients || command_restore_chans(u);
+    pthread_mutex_unlock(&ircd_lock);
+    if (ret)
+    {
+        log_error("upgrade: couldn't restore what the old process sent");
+        return -1;
+    }
+    log_info("upgrade: carrying on with %ld clients, %d users "
+                                "and %d channels", n, nr_users, nr_chans);
+    return 0;
+}
+
+/* ircd_upgrade()
+ * the loops have stopped for SIGHUP, hand everything over to a new
+ * process, see upgrade.c. only returns if the new process didn't take
+ * over, and then we carry on as we were */
 static void
-sigterm_cb (EV_P_ ev_signal *w, int revents)
+ircd_upgrade (void)
 {
-    fprintf(stderr, "received signal %d: breaking event loop\n", revents);
-    ev_break(EV_A_ EVBREAK_ALL);
+    upgrade_t u;
+    int i, busy;
+
+    /* nothing must be left half delivered between the workers */
+    do
+        for (busy = i = 0; i < nr_workers; ++i)
+            busy += worker_quiesce(&workers[i]);
+    while (busy);
+    memset(&u, 0, sizeof(u));
+    u.sock = -1;
+    ircd_save(&u);
+    if (!upgrade_exec(&u, ircd_argv))
+        exit(0);
+    upgrade_free(&u);
+    /* the new process had the metrics socket's path off us */
+    if (metrics_path)
+    {
+        stats_close();
+        stats_listen(metrics_path);
+    }
 }
 
 static void
 ircd ()
 {
     struct ev_loop *loop;
+    worker_t *worker;
+    upgrade_t upgrade;
+    time_t now;
+    int i, upgraded = upgrade_pending();
 
-    /* reopn stderr to log to ircd.err */
-    logfile = freopen("ircd.err", "w", stderr);
+    /* reopn stderr to log to ircd.err, after an upgrade the old process
+     * may still be writing to it */
+    logfile = freopen("ircd.err", upgraded ? "a" : "w", stderr);
     if (logfile == NULL)
     {
         fprintf(stderr, "freopen: ircd.err: %s\n", strerror(errno));
         fprintf(stderr, "logging to stderr instead\n");
     }
+    /* and from here on the loops log through the ring, see log.c */
+    log_init(fileno(stderr));
 
-    /* bind/listen server socket */
-    server_fd = unix_listen(IRCD_HOST, IRCD_PORT);
-    if (server_fd == -1)
-    {
-        fprintf(stderr, "Could not register socket, exiting.");
+    /* who we are and when we started, for the welcome numerics */
+    if (!ircd_name[0] && gethostname(ircd_name, sizeof(ircd_name) - 1))
+        strcpy(ircd_name, "localhost");
+    now = time(NULL);
+    strftime(ircd_created, sizeof(ircd_created), "%a %b %d %Y at %H:%M:%S %Z",
+                                                            localtime(&now));
+    stats_init();
+    reply_init();
+    if (command_init() || resolve_init(hosts_path))
         exit(1);
+    hash_init(&nick_table);
+    hash_init(&chan_table);
+
+    /* or carry on from the old process, see upgrade.c */
+    if (upgraded)
+    {
+        if (upgrade_receive(&upgrade))
+            exit(1);
+        upgrade_get_str(&upgrade, ircd_created, sizeof(ircd_created));
+        if (upgrade_get_int(&upgrade) != nr_workers)
+        {
+            log_error("upgrade: the old process had a different number "
+                                                        "of workers");
+            exit(1);
+        }
     }
 
-    /* init libev default loop */
+    /* reserve the shared pools */
+    if (slab_init(&user_slab, "users", sizeof(user_t), IRCD_USERS_MAX,
+                                                            slab_flags)
+        || slab_init(&chan_slab, "chans", sizeof(chan_t), IRCD_CHANS_MAX,
+                                                            slab_flags)
+        || slab_init(&server_slab, "servers", sizeof(server_t),
+                                            IRCD_SERVERS_MAX, slab_flags)
+        || slab_init(&member_slab, "members", sizeof(member_t),
+                                        IRCD_MEMBERSHIPS_MAX, slab_flags))
+        exit(1);
+
+    /* init libev default loop, worker 0 runs it on this thread and
+     * any others get a loop and a thread of their own */
     loop = ev_default_loop(0);
+    for (i = 0; i < nr_workers; ++i)
+    {
+        worker = &workers[i];
+        if (worker_init(worker, i, i ? ev_loop_new(EVFLAG_AUTO) : loop))
+        {
+            log_error("Could not create event loop %d, exiting.", i);
+            exit(1);
+        }
+        if (slab_init(&worker->client_slab, "clients", sizeof(client_t),
+                        IRCD_CLIENTS_MAX / nr_workers, slab_flags))
+            exit(1);
+
+        /* bind/listen server socket, one each when there are several
+         * workers and let the kernel share connections out */
+        if (upgraded)
+            worker->server_fd = upgrade_get_fd(&upgrade);
+        else
+            worker->server_fd = unix_listen(IRCD_HOST, IRCD_PORT,
+                                    nr_workers > 1 ? UNIX_REUSEPORT : 0);
+        if (worker->server_fd == -1)
+        {
+            log_error("Could not register socket, exiting.");
+            exit(1);
+        }
+
+        /* set up libev callback for incoming connections */
+        ev_io_init(&worker->server_w, &server_cb, worker->server_fd, EV_READ);
+        worker->server_w.data = worker;
+#ifdef HAVE_IO_URING
+        /* or leave the accepting to the ring */
+        if (use_uring)
+        {
+            if (uring_init(worker, &client_new, &client_line)
+                || uring_accept(worker))
+            {
+                log_error("Could not set up io_uring, exiting.");
+                exit(1);
+            }
+            continue;
+        }
+#endif
+        ev_io_start(worker->loop, &worker->server_w);
+    }
 
-    /* set up libev callback for incoming connections */
-    ev_io_init(&server_w, &server_cb, server_fd, EV_READ);
-    ev_io_start(EV_A_ &server_w);
+    if (metrics_path && stats_listen(metrics_path))
+        exit(1);
+
+    /* links the old process had up come back with their server clients */
+    for (i = 0; i < nr_links; ++i)
+        link_init(&links[i], &workers[0], link_args[i], link_ports[i],
+                                                            &server_new);
+    if (upgraded && ircd_restore(&upgrade))
+        exit(1);
+    for (i = 0; i < nr_links; ++i)
+        link_start(&links[i]);
     
-    /* ignore some signals, catch TERM with our own handler, consider using
-     * libev for the SIGTERM callback for consistency's sake */
+    /* ignore some signals, catch TERM and HUP with our own handlers */
     signal(SIGPIPE, SIG_IGN);
-    signal(SIGHUP, SIG_IGN);
     ev_signal_init(&sigterm_w, &sigterm_cb, SIGTERM);
     ev_signal_start(EV_A_ &sigterm_w);
+    ev_signal_init(&sighup_w, &sighup_cb, SIGHUP);
+    ev_signal_start(EV_A_ &sighup_w);
 
-    /* enter main loop */
-    ev_run(EV_A_ 0);
+    /* the old process lets go once we've acked */
+    if (upgraded && upgrade_done(&upgrade))
+        exit(1);
 
-    /* clean server state here, in case later on I decide I want to handle
-     * SIGHUP to reboot the server without exiting the process or something */
-    ev_io_stop(EV_A_ &server_w);
-    
-    /* close socket */
-    close(server_fd);
+    for (;;)
+    {
+        for (i = 1; i < nr_workers; ++i)
+            if (worker_spawn(&workers[i]))
+                exit(1);
+
+        /* enter main loop */
+        worker_self = &workers[0];
+        ev_run(EV_A_ 0);
+
+        for (i = 1; i < nr_workers; ++i)
+            worker_stop(&workers[i]);
+        if (!upgrading)
+            break;
+        /* only back if the upgrade didn't happen */
+        upgrading = 0;
+        ircd_upgrade();
+    }
+
+    /* clean server state here */
+    for (i = 0; i < nr_links; ++i)
+        link_stop(&links[i]);
+    stats_close();
+    resolve_shutdown();
+    for (i = 0; i < nr_workers; ++i)
+    {
+        worker = &workers[i];
+        log_info("worker %d: %lu socket syscalls, %u loop iterations", i,
+                            worker->syscalls, ev_iteration(worker->loop));
+        ev_io_stop(worker->loop, &worker->server_w);
+#ifdef HAVE_IO_URING
+        uring_destroy(worker);
+#endif
+        /* close socket */
+        close(worker->server_fd);
+    }
+}
+
+/* set_sendq(arg)
+ * parse a class=bytes argument and set that class' sendq limit
+ * returns -1 if arg is nonsense */
+static int
+set_sendq (const char *arg)
+{
+    const char *eq;
+    char *end;
+    unsigned long bytes;
+    int i;
+
+    if (!(eq = strchr(arg, '=')))
+        return -1;
+    bytes = strtoul(eq + 1, &end, 10);
+    if (*end || !bytes)
+        return -1;
+    for (i = 0; ircd_classes[i].name; ++i)
+    {
+        if (strlen(ircd_classes[i].name) == (size_t)(eq - arg)
+            && !strncmp(ircd_classes[i].name, arg, eq - arg))
+        {
+            ircd_classes[i].sendq = bytes;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* add_link(arg)
+ * note a host:port argument for a link, it's set up by ircd()
+ * returns -1 if arg is nonsense or there are too many */
+static int
+add_link (char *arg)
+{
+    char *colon = strrchr(arg, ':');
+    int port;
+
+    if (nr_links == IRCD_LINKS_MAX || !colon || colon == arg)
+        return -1;
+    port = atoi(colon + 1);
+    if (port <= 0 || port > 65535)
+        return -1;
+    *colon = '\0';
+    link_args[nr_links] = arg;
+    link_ports[nr_links++] = port;
+    return 0;
 }
 
 int
 main (int argc, char **argv, char **envp)
 {
+    int opt;
+
+    /* a SIGHUP upgrade starts us again the same way, see upgrade.c */
+    ircd_argv = argv;
+    /* for link.c's backoff jitter, once, so links don't retry in step */
+    srandom(time(NULL) ^ getpid());
+    while ((opt = getopt(argc, argv, "fHl:m:n:q:r:R:Uvw:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'f':   foreground = 1;
+                        break;
+            case 'H':   slab_flags |= SLAB_HUGEPAGES;
+                        break;
+            case 'l':   if (add_link(optarg) == 0)
+                            break;
+                        fprintf(stderr, "bad link: %s\n", optarg);
+                        goto usage;
+            case 'm':   metrics_path = optarg;
+                        break;
+            case 'n':   snprintf(ircd_name, sizeof(ircd_name), "%s", optarg);
+                        break;
+            case 'q':   if (set_sendq(optarg) == 0)
+                            break;
+                        fprintf(stderr, "bad sendq: %s\n", optarg);
+                        goto usage;
+            case 'r':   hosts_path = optarg;
+                        break;
+            case 'R':   resolve_deadline = atoi(optarg);
+                        if (resolve_deadline >= 0
+                            && resolve_deadline < IRCD_REGISTER_TIMEOUT)
+                            break;
+                        fprintf(stderr, "resolve deadline must be 0 to %d\n",
+                                                IRCD_REGISTER_TIMEOUT - 1);
+                        goto usage;
+            case 'U':
+#ifdef HAVE_IO_URING
+                        use_uring = 1;
+                        break;
+#else
+                        fprintf(stderr, "built without io_uring\n");
+                        return 1;
+#endif
+            case 'v':   if (log_level < LEVEL_DEBUG)
+                            log_level++;
+                        break;
+            case 'w':   nr_workers = atoi(optarg);
+                        if (nr_workers >= 1 && nr_workers <= IRCD_WORKERS_MAX)
+                            break;
+                        fprintf(stderr, "workers must be 1 to %d\n",
+                                                        IRCD_WORKERS_MAX);
+                        /* fall through */
+            default:
+            usage:      fprintf(stderr, "usage: %s [-fHUv] [-l host:port] "
+                                "[-m metrics socket] [-n name] "
+                                "[-q class=bytes] [-r hosts] "
+                                "[-R seconds] [-w workers]\n", argv[0]);
+                        return 1;
+        }
+    }
+
+    /* after an upgrade we already have a parent that's about to go */
+    if (foreground || upgrade_pending())
+    {
+        ircd();
+        return 0;
+    }
     switch (fork())
     {
         case -1:    fprintf(stderr, "Fork: %s\n", strerror(errno));
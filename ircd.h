@@ -3,24 +3,55 @@
 /* ircd.h - key structure definitions for the main source file
  * Copyright Joe Doyle 2011 (See COPYING) */
 #include <time.h>       /* for time_t */
+#include <pthread.h>    /* for pthread_mutex_t */
 #include <ev.h>         /* for ev_io */
 #include "list.h"       /* for list_t */
 #include "irc.h"        /* for IRC_FOO_MAX, etc */
+#include "slab.h"       /* for slab_t */
+#include "hash.h"       /* for struct hash_table */
+#include "wheel.h"      /* for wheel_timer_t */
+
+#define IRCD_VERSION "ircd-0.1"
+
+/* where we listen, bench/loadgen connects here too */
+#define IRCD_HOST   "0.0.0.0"
+#define IRCD_PORT   6667
 
 /* non RFC based constants */
-/* TODO: find out how much address space is taken if we prealloc
- * enough memory to handle these maximums */
+/* the slab pools (slab.c) reserve address space for all of these up
+ * front, memory is only used as objects are actually handed out */
 #define IRCD_CLIENTS_MAX    10000
 #define IRCD_USERS_MAX      100000
 #define IRCD_SERVERS_MAX    100
 #define IRCD_CHANS_MAX      500
+#define IRCD_MEMBERSHIPS_MAX (IRCD_USERS_MAX * 10)
+
+/* timeouts in seconds: a client quiet for PING_FREQ gets a PING, and
+ * has PING_TIMEOUT to answer. new connections have REGISTER_TIMEOUT to
+ * get through NICK and USER */
+#define IRCD_PING_FREQ          120
+#define IRCD_PING_TIMEOUT       60
+#define IRCD_REGISTER_TIMEOUT   30
+
+/* how long registration may wait on a client's hostname lookup by
+ * default, -R on the command line, give or take a tick of the wheel.
+ * the client is known by its address if it takes any longer */
+#define IRCD_RESOLVE_DEADLINE   5
+
+/* default sendq limits in bytes, per client class, these can be
+ * overridden on the command line with -q class=bytes */
+#define SENDQ_UNREGISTERED  (16 * 1024)
+#define SENDQ_USER          (256 * 1024)
+#define SENDQ_SERVER        (8 * 1024 * 1024)
 
 typedef struct client client_t;
 typedef struct user user_t;
 typedef struct chan chan_t;
 typedef struct server server_t;
-typedef struct user_ref user_ref_t;
-typedef struct chan_ref chan_ref_t;
+typedef struct member member_t;
+typedef struct class class_t;
+typedef struct worker worker_t;
+typedef struct banlist banlist_t;
 #include "net.h"        /* for recv/send_buffer_t */
 
 /* client types */
@@ -30,71 +61,126 @@ enum {
     CLIENT_SERVER = 2
 };
 
-/* quit reasons */
+/* quit reasons, drop() is handed either one of these or an errno value,
+ * so they're negative to keep the two apart */
 enum {
-    QUIT_MAX_SENDQ_EXCEEDED = 1,
-    QUIT_OUT_OF_MEMORY = 2,
-    QUIT_USER_MSG = 3
+    QUIT_MAX_SENDQ_EXCEEDED = -1,
+    QUIT_OUT_OF_MEMORY = -2,
+    QUIT_USER_MSG = -3,
+    QUIT_EOF = -4,
+    QUIT_PING_TIMEOUT = -5,
+    QUIT_REGISTER_TIMEOUT = -6
+};
+
+/* struct class holds the per connection class limits an operator can
+ * tune, ircd_classes[] is indexed by client type */
+struct class {
+    const char  *name;
+    size_t      sendq;
 };
 
+extern class_t ircd_classes[];
+
 /* struct client represents a connected client
  * list_head is a *next, *prev, providing a doubly linked list
+ * worker is the event loop that owns the client, only it touches the socket
+ * refs counts the owner plus any posts from other workers in flight,
+ *  and the worker's dirty list while it's on there
  * ev_io is for libev event handling
  * fd is the file descriptor for the client socket
- * timestamp indicates the time the connection was last active,
- *  if time(NULL) - timestamp > PING_TIMEOUT, drop the connection
+ * timestamp indicates the (ev_now()) time the connection was last
+ *  active, it's only looked at when timer goes off, see client_timeout()
+ * pinged is set while we're waiting for an answer to a PING
  * type indicates whether the client is a server or a user
- * more is a pointer to either a server_t or a user_t */
+ * more is a pointer to either a server_t or a user_t
+ * host is the client's address, or its name once that's been looked up,
+ *  resolving is set while the lookup holds up registration
+ * in_buf is only attached while there's unframed input, see net_recv()
+ * out_buf is the send queue, bounded by the sendq of the client's class
+ * dirty/dirty_next put the client on its worker's list of clients with
+ *  data queued during this loop iteration, see net_flush_dirty()
+ * reason is why it was dropped, kept for client_reap()
+ * seen is for spotting duplicates while building lists of clients */
 struct client {
     list_t      list_head;
+    worker_t    *worker;
+    int         refs;
     ev_io       w;
     int         fd;
-    time_t      timestamp;
+    ev_tstamp   timestamp;
+    wheel_timer_t   timer;
+    int         pinged;
     int         type;
     void        *more;
-    recv_buffer_t   in_buf;
-    send_buffer_t   *out_buf;
+    char        host[IRC_HOSTNAME_MAX+1];
+    int         resolving;
+    recv_buffer_t   *in_buf;
+    sendq_t         out_buf;
+    int             dirty;
+    client_t        *dirty_next;
+    int             reason;
+    unsigned long   seen;
 };
 
 /* struct user represents an IRC user, complete with nick, user, host,
  * channel references, possibly other misc info plus a backref
  * to the relevant client structure (which may be a server type
- * client in the case of remote users) */
+ * client in the case of remote users). prefix caches nick!user@host
+ * for relaying, prefix_len is 0 when it's stale, see reply.c */
 struct user {
     list_t      list_head;
     client_t    *client;
     char        nickname[IRC_NICKNAME_MAX+1];
+    char        folded[IRC_NICKNAME_MAX+1]; /* nick_table key, see casemap.c */
     char        user[IRC_USERNAME_MAX+1];
     char        host[IRC_HOSTNAME_MAX+1];
-    list_t      *chans;         /* typdef these to chan_ref_t */
+    char        prefix[IRC_PREFIX_MAX+1];
+    int         prefix_len;
+    member_t    **chans;        /* see member.c */
+    int         nr_chans;
+    int         max_chans;
 };
 
 /* struct chan represents an IRC channel, the name of the channel
- * and all users who are joined */
+ * and all users who are joined. members is dense, and clients holds
+ * the same users' clients in the same order, NULL terminated, ready
+ * for net_manysendvf(), see member.c */
 struct chan {
     list_t      list_head;
     char        name[IRC_CHANNAME_MAX+1];
+    char        folded[IRC_CHANNAME_MAX+1]; /* chan_table key */
     char        topic[IRC_TOPIC_MAX+1];
-    list_t      *users;         /* typedef these to user_ref_t */
-    list_t      *banmasks;      /* this will be an afterthought */
+    member_t    **members;
+    client_t    **clients;
+    int         nr_members;
+    int         max_members;
+    banlist_t   *bans;          /* NULL until the first one, see ban.c */
 };
 
+/* struct server is another server we're linked to, client is the
+ * connection to it, link is the link that made it if we connected out
+ * to it (see link.c), NULL if it connected to us */
 struct server {
     list_t      list_head;
     char        host[IRC_HOSTNAME_MAX+1];
+    client_t    *client;
+    struct link *link;
 };
 
-/* struct user_ref keep track of what users are in channel X */
-struct user_ref {
-    list_t      list_head;
-    int         modes;          /* for CHANMODE_O */
-    user_t      *user;
-};
+/* users, channels and servers are shared by every worker,
+ * hold ircd_lock while touching them */
+extern pthread_mutex_t ircd_lock;
+extern slab_t user_slab, chan_slab, server_slab, member_slab;
+extern struct hash_table nick_table, chan_table;
+extern user_t *user_list;
+extern int nr_users;
+extern chan_t *chan_list;
+extern int nr_chans;
 
-/* struct chan_ref keep track of what channels our user is joined to */
-struct chan_ref {
-    list_t      list_head;
-    chan_t      *chan;
-};
+extern char ircd_name[];
+extern char ircd_created[];
 
+void drop (client_t *, int);
+void client_reap (worker_t *);
+void client_unref (client_t *);
 #endif /* IRCD_H */
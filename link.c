@@ -0,0 +1,206 @@
+/* link.c - outgoing server links. a link connects without ever blocking
+ * its worker: the name is looked up by the resolver threads, the socket
+ * is non blocking and libev tells us when connect() is done, with a
+ * timer in case either never is. a failed attempt,
+ * or a link that's gone down, is retried after a backoff that doubles
+ * (with a bit of jitter) up to LINK_BACKOFF_MAX, so a peer that's down
+ * costs next to nothing while the clients we have carry on as normal.
+ * once connected the socket is handed to up_cb, which makes a server
+ * client out of it. Copyright Joe Doyle 2011 (See COPYING) */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <ev.h>         /* requires libev */
+#include "link.h"
+#include "worker.h"
+#include "unix.h"
+#include "resolve.h"
+#include "log.h"
+
+static void _attempt (link_t *);
+
+/* _close(link)
+ * stop watching and give up on whatever attempt is in progress */
+static void
+_close (link_t *link)
+{
+    ev_io_stop(link->worker->loop, &link->w);
+    ev_timer_stop(link->worker->loop, &link->timer);
+    link->lookup = NULL;    /* it'll be ignored when it turns up */
+    if (link->fd != -1)
+        close(link->fd);
+    link->fd = -1;
+}
+
+/* _retry(link)
+ * schedule another attempt, somewhere between 3/4 and 5/4 of the
+ * backoff so a bunch of links that went down together don't all come
+ * knocking at once */
+static void
+_retry (link_t *link)
+{
+    ev_tstamp delay;
+
+    _close(link);
+    delay = link->backoff * (0.75 + 0.5 * random() / RAND_MAX);
+    link->backoff *= 2;
+    if (link->backoff > LINK_BACKOFF_MAX)
+        link->backoff = LINK_BACKOFF_MAX;
+    log_info("link %s:%d: retrying in %.1fs", link->host,
+                                                    link->port, delay);
+    link->state = LINK_WAITING;
+    ev_timer_set(&link->timer, delay, 0.);
+    ev_timer_start(link->worker->loop, &link->timer);
+}
+
+static void
+io_cb (EV_P_ ev_io *w, int revents)
+{
+    link_t *link = w->data;
+    int fd = link->fd, err;
+
+    if ((err = unix_connect_error(fd)))
+    {
+        log_warn("link %s:%d: %s", link->host, link->port,
+                                                        strerror(err));
+        _retry(link);
+        return;
+    }
+    /* it's not ours any more */
+    link->fd = -1;
+    _close(link);
+    link->state = LINK_UP;
+    link->backoff = LINK_BACKOFF_MIN;
+    link->attempts = 0;
+    log_info("link %s:%d: connected on fd %d", link->host,
+                                                        link->port, fd);
+    link->up_cb(link, fd);
+}
+
+static void
+timer_cb (EV_P_ ev_timer *w, int revents)
+{
+    link_t *link = w->data;
+
+    if (link->state == LINK_WAITING)
+    {
+        _attempt(link);
+        return;
+    }
+    log_warn("link %s:%d: %s timed out", link->host, link->port,
+                    link->state == LINK_RESOLVING ? "lookup" : "connect");
+    _retry(link);
+}
+
+/* _resolved(lookup)
+ * the host's been looked up, start connecting if it's still wanted,
+ * io_cb or timer_cb will hear how it went */
+static void
+_resolved (lookup_t *lookup)
+{
+    link_t *link = lookup->data;
+
+    if (link->lookup != lookup)
+        return;
+    link->lookup = NULL;
+    if (!lookup->found
+        || inet_pton(AF_INET, lookup->addr, &link->addr.sin_addr) != 1)
+    {
+        log_warn("link %s:%d: no address", link->host, link->port);
+        _retry(link);
+        return;
+    }
+    stats_add(&link->worker->syscalls, 1);
+    if ((link->fd = unix_connect(&link->addr)) == -1)
+    {
+        log_warn("link %s:%d: %s", link->host, link->port,
+                                                        strerror(errno));
+        _retry(link);
+        return;
+    }
+    link->state = LINK_CONNECTING;
+    ev_io_set(&link->w, link->fd, EV_WRITE);
+    ev_io_start(link->worker->loop, &link->w);
+}
+
+/* _attempt(link)
+ * look the host up again, the timeout covers that and the connect */
+static void
+_attempt (link_t *link)
+{
+    link->attempts++;
+    if (!(link->lookup = resolve_forward(link->worker, link->host,
+                                                    &_resolved, link)))
+    {
+        log_warn("link %s:%d: resolver busy", link->host,
+                                                            link->port);
+        _retry(link);
+        return;
+    }
+    link->state = LINK_RESOLVING;
+    ev_timer_set(&link->timer, LINK_TIMEOUT, 0.);
+    ev_timer_start(link->worker->loop, &link->timer);
+}
+
+/* link_init(link, worker, host, port, up_cb)
+ * set up a link to host:port run by worker's loop */
+void
+link_init (link_t *link, worker_t *worker, const char *host, in_port_t port,
+           link_up_cb up_cb)
+{
+    memset(link, 0, sizeof(*link));
+    link->addr.sin_family = AF_INET;
+    link->addr.sin_port = htons(port);
+    link->worker = worker;
+    snprintf(link->host, sizeof(link->host), "%s", host);
+    link->port = port;
+    link->state = LINK_IDLE;
+    link->fd = -1;
+    link->backoff = LINK_BACKOFF_MIN;
+    link->up_cb = up_cb;
+    ev_init(&link->w, &io_cb);
+    link->w.data = link;
+    ev_init(&link->timer, &timer_cb);
+    link->timer.data = link;
+}
+
+/* link_start(link)
+ * make the first attempt, called by the link's worker */
+void
+link_start (link_t *link)
+{
+    if (link->state == LINK_IDLE)
+        _attempt(link);
+}
+
+/* link_adopt(link)
+ * the link's server client was handed over by the old process, see
+ * upgrade.c, so it's up without our having connected */
+void
+link_adopt (link_t *link)
+{
+    link->state = LINK_UP;
+}
+
+/* link_lost(link)
+ * the server client up_cb made is gone, try again after the backoff */
+void
+link_lost (link_t *link)
+{
+    if (link->state != LINK_UP)
+        return;
+    log_warn("link %s:%d: lost", link->host, link->port);
+    _retry(link);
+}
+
+/* link_stop(link)
+ * stop trying, a server client already made is left alone */
+void
+link_stop (link_t *link)
+{
+    _close(link);
+    link->state = LINK_IDLE;
+}
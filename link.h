@@ -0,0 +1,52 @@
+#ifndef LINK_H
+#define LINK_H
+/* link.h - outgoing server links, see link.c
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#include <netinet/in.h> /* for struct sockaddr_in */
+#include <ev.h>         /* for ev_io, ev_timer */
+#include "ircd.h"       /* for worker_t */
+#include "irc.h"        /* for IRC_HOSTNAME_MAX */
+
+#define LINK_TIMEOUT        10.0    /* seconds to look up and connect */
+#define LINK_BACKOFF_MIN    2.0     /* first retry after this, doubling */
+#define LINK_BACKOFF_MAX    300.0   /* up to this */
+
+/* link states */
+enum {
+    LINK_IDLE = 0,      /* stopped */
+    LINK_RESOLVING,     /* waiting for the resolver */
+    LINK_CONNECTING,    /* waiting for connect() to finish */
+    LINK_WAITING,       /* backing off before the next attempt */
+    LINK_UP             /* handed over, a server client has the socket */
+};
+
+typedef struct link link_t;
+typedef struct lookup lookup_t;
+typedef void (*link_up_cb) (link_t *, int);
+
+/* struct link is one peer we keep connecting to. host is looked up
+ * afresh for every attempt, lookup is the one we're waiting on. w
+ * watches the socket while connect() is in progress, timer is the
+ * attempt's timeout or the backoff, whichever state we're in. up_cb
+ * gets the connected socket */
+struct link {
+    worker_t        *worker;
+    char            host[IRC_HOSTNAME_MAX+1];
+    in_port_t       port;
+    struct sockaddr_in addr;
+    int             state;
+    int             fd;
+    lookup_t        *lookup;
+    ev_io           w;
+    ev_timer        timer;
+    ev_tstamp       backoff;
+    unsigned long   attempts;   /* since it was last up */
+    link_up_cb      up_cb;
+};
+
+void link_init (link_t *, worker_t *, const char *, in_port_t, link_up_cb);
+void link_start (link_t *);
+void link_adopt (link_t *);
+void link_lost (link_t *);
+void link_stop (link_t *);
+#endif /* LINK_H */
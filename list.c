@@ -12,7 +12,8 @@ list_pop (list_t **n0)
     if (*n0)
     {
         *n0 = (*n0)->next;
-        (*n0)->prev = NULL;
+        if (*n0)
+            (*n0)->prev = NULL;
         ret->next = NULL;
     }
     return ret;
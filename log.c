@@ -0,0 +1,249 @@
+/* log.c - the daemon's log. stderr is unbuffered, so every fprintf() to
+ * it was a write() on whichever loop made it, and a storm of connections
+ * coming and going had the loops spending their time in the filesystem.
+ * now log_write() formats the record into a slot of a fixed size ring and
+ * goes back to work, and a thread of our own copies records out of the
+ * ring in batches, stamps them and writes them out a buffer at a time.
+ * any thread can write, slots are claimed with a compare and swap on the
+ * head and each slot's sequence number says whose turn it is (the writer
+ * or the next lap of writers), so nothing ever takes a lock or waits. if
+ * the ring fills up records are dropped rather than making a loop wait,
+ * and the writer says how many went missing the next time it catches up.
+ * before log_init() and after log_shutdown() records go straight to stderr
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+
+#if LOG_SLOTS & (LOG_SLOTS - 1)
+#error "LOG_SLOTS must be a power of 2"
+#endif
+
+/* struct log_record is one slot of the ring. seq is the head position a
+ * writer can claim it at, or that plus one once it's been written and the
+ * log thread can have it */
+struct log_record {
+    unsigned long   seq;
+    int             level;
+    int             len;
+    struct timespec when;
+    char            text[LOG_LINE_MAX];
+};
+
+int log_level = LEVEL_INFO;
+
+static const char *level_names[] = { "error", "warn", "info", "debug" };
+
+static struct log_record    ring[LOG_SLOTS];
+static unsigned long        head = 0;   /* next slot to claim */
+static unsigned long        tail = 0;   /* next slot to write, ours only */
+static unsigned long        dropped = 0;
+static int                  log_fd = 2;
+static int                  running = 0;
+static int                  stopping = 0;
+static pthread_t            thread;
+
+/* _format(buf, record)
+ * the record as it goes in the file, returns its length */
+static int
+_format (char *buf, const struct log_record *record)
+{
+    struct tm tm;
+    int len;
+
+    localtime_r(&record->when.tv_sec, &tm);
+    len = strftime(buf, 32, "%Y-%m-%d %H:%M:%S", &tm);
+    len += sprintf(buf + len, ".%03ld %s: ", record->when.tv_nsec / 1000000,
+                                            level_names[record->level]);
+    memcpy(buf + len, record->text, record->len);
+    len += record->len;
+    buf[len++] = '\n';
+    return len;
+}
+
+/* _write_all(buf, len)
+ * nothing we can do if the disk's full, but carry on */
+static void
+_write_all (const char *buf, size_t len)
+{
+    ssize_t ret;
+
+    while (len)
+    {
+        ret = write(log_fd, buf, len);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return;
+        buf += ret;
+        len -= ret;
+    }
+}
+
+/* _fill(record, level, fmt, ap)
+ * format the text into the record and stamp it */
+static void
+_fill (struct log_record *record, int level, const char *fmt, va_list ap)
+{
+    int len;
+
+    clock_gettime(CLOCK_REALTIME_COARSE, &record->when);
+    record->level = level;
+    len = vsnprintf(record->text, LOG_LINE_MAX, fmt, ap);
+    if (len < 0)
+        len = 0;
+    if (len >= LOG_LINE_MAX)
+        len = LOG_LINE_MAX - 1;
+    record->len = len;
+}
+
+/* log_write(level, fmt, ...)
+ * use the log_*() macros in log.h, which check the level first */
+void
+log_write (int level, const char *fmt, ...)
+{
+    struct log_record *record, direct;
+    char buf[LOG_LINE_MAX + 64];
+    unsigned long pos, seq;
+    va_list ap;
+
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+    {
+        va_start(ap, fmt);
+        _fill(&direct, level, fmt, ap);
+        va_end(ap);
+        _write_all(buf, _format(buf, &direct));
+        return;
+    }
+
+    pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        record = &ring[pos & (LOG_SLOTS - 1)];
+        seq = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos)
+        {
+            if (__atomic_compare_exchange_n(&head, &pos, pos + 1, 1,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if ((long)(seq - pos) < 0)
+        {
+            /* a lap behind, the log thread hasn't got to it yet */
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        else
+            pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    }
+
+    va_start(ap, fmt);
+    _fill(record, level, fmt, ap);
+    va_end(ap);
+    __atomic_store_n(&record->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/* _drain(buf)
+ * copy as many records out of the ring as fit in buf, returns the length */
+static size_t
+_drain (char *buf)
+{
+    static unsigned long reported = 0;
+    struct log_record *record, note;
+    unsigned long lost;
+    size_t len = 0;
+
+    while (len + LOG_LINE_MAX + 64 <= LOG_BATCH)
+    {
+        record = &ring[tail & (LOG_SLOTS - 1)];
+        if (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) != tail + 1)
+            break;
+        len += _format(buf + len, record);
+        /* the slot's free for the next lap */
+        __atomic_store_n(&record->seq, tail + LOG_SLOTS, __ATOMIC_RELEASE);
+        tail++;
+    }
+
+    lost = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+    if (lost != reported && len + LOG_LINE_MAX + 64 <= LOG_BATCH)
+    {
+        clock_gettime(CLOCK_REALTIME_COARSE, &note.when);
+        note.level = LEVEL_WARN;
+        note.len = sprintf(note.text, "log: %lu records dropped, ring full",
+                                                        lost - reported);
+        len += _format(buf + len, &note);
+        reported = lost;
+    }
+    return len;
+}
+
+static void *
+_log_main (void *arg)
+{
+    static char buf[LOG_BATCH];
+    struct timespec idle = { 0, LOG_IDLE_NS };
+    size_t len;
+    int stop;
+
+    for (;;)
+    {
+        /* anything logged before we saw stopping is in by now */
+        stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+        if ((len = _drain(buf)))
+        {
+            _write_all(buf, len);
+            continue;
+        }
+        if (stop)
+            return NULL;
+        nanosleep(&idle, NULL);
+    }
+}
+
+/* log_init(fd)
+ * start logging to fd through the ring, log_shutdown() is called at exit
+ * returns -1 if the log thread won't start, and records carry on going
+ * straight to stderr */
+int
+log_init (int fd)
+{
+    unsigned long i;
+    int ret;
+
+    for (i = 0; i < LOG_SLOTS; ++i)
+        ring[i].seq = i;
+    log_fd = fd;
+    if ((ret = pthread_create(&thread, NULL, &_log_main, NULL)))
+    {
+        log_error("log: pthread_create: %s", strerror(ret));
+        return -1;
+    }
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    atexit(&log_shutdown);
+    return 0;
+}
+
+/* log_shutdown()
+ * write out whatever's still in the ring and stop the log thread */
+void
+log_shutdown (void)
+{
+    if (!__atomic_exchange_n(&running, 0, __ATOMIC_ACQ_REL))
+        return;
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+}
+
+/* log_dropped()
+ * records lost to a full ring so far */
+unsigned long
+log_dropped (void)
+{
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
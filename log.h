@@ -0,0 +1,47 @@
+#ifndef LOG_H
+#define LOG_H
+/* log.h - the daemon's log, ircd.err. records go into a ring and a thread
+ * of their own writes them out, so logging never blocks a loop, see log.c
+ * Copyright Joe Doyle 2011 (See COPYING) */
+
+/* levels, each includes the ones above it. not LOG_ to keep out of
+ * syslog.h's way */
+#define LEVEL_ERROR     0
+#define LEVEL_WARN      1
+#define LEVEL_INFO      2
+#define LEVEL_DEBUG     3
+
+/* anything above LEVEL_MAX isn't compiled in at all, eg
+ * make CPPFLAGS=-DLEVEL_MAX=LEVEL_INFO */
+#ifndef LEVEL_MAX
+#define LEVEL_MAX       LEVEL_DEBUG
+#endif
+
+#define LOG_LINE_MAX    256     /* longer records are truncated */
+#define LOG_SLOTS       4096    /* records in the ring, power of 2 */
+#define LOG_BATCH       (64 * 1024) /* the writer's buffer */
+#define LOG_IDLE_NS     10000000    /* writer naps this long when idle */
+
+extern int log_level;
+
+/* log_at(level, fmt, ...)
+ * a disabled level costs a compare and a branch, the arguments aren't
+ * evaluated, and levels above LEVEL_MAX compile to nothing */
+#define log_at(level, ...) \
+    do { \
+        if ((level) <= LEVEL_MAX && (level) <= log_level) \
+            log_write((level), __VA_ARGS__); \
+    } while (0)
+
+#define log_error(...)  log_at(LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...)   log_at(LEVEL_WARN, __VA_ARGS__)
+#define log_info(...)   log_at(LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...)  log_at(LEVEL_DEBUG, __VA_ARGS__)
+
+int log_init (int fd);
+void log_shutdown (void);
+unsigned long log_dropped (void);
+void log_write (int level, const char *fmt, ...)
+                        __attribute__((format(printf, 2, 3)));
+
+#endif /* LOG_H */
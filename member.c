@@ -0,0 +1,134 @@
+/* member.c - channel membership. each channel keeps its members in a
+ * dense array, plus the matching client_t * array ready to hand to
+ * net_manysendvf(), so a channel message walks contiguous memory instead
+ * of chasing a list around the heap. every membership knows where it
+ * sits in both its channel's and its user's arrays, so parting is a
+ * swap with the last entry. Copyright Joe Doyle 2011 (See COPYING)
+ * NB: all of this is shared state, hold ircd_lock */
+#include <stdlib.h>
+#include "member.h"
+#include "ircd.h"
+#include "slab.h"
+
+/* _resize(array, size)
+ * realloc() *array to size bytes, leaving it alone if that fails */
+static int
+_resize (void *array, size_t size)
+{
+    void *p;
+
+    if (!(p = realloc(*(void **)array, size)))
+        return -1;
+    *(void **)array = p;
+    return 0;
+}
+
+/* member_join(user, chan, modes)
+ * add user to chan, returns the new membership or NULL if we're out of
+ * memory, already being a member is the caller's problem */
+member_t *
+member_join (user_t *user, chan_t *chan, int modes)
+{
+    member_t *member;
+    int n;
+
+    /* make room on both sides first, so there's nothing to undo */
+    if (user->nr_chans == user->max_chans)
+    {
+        n = user->max_chans ? user->max_chans * 2 : MEMBER_MIN_SLOTS;
+        if (_resize(&user->chans, n * sizeof(*user->chans)))
+            return NULL;
+        user->max_chans = n;
+    }
+    if (chan->nr_members == chan->max_members)
+    {
+        /* the clients array has a spare slot for its NULL terminator */
+        n = chan->max_members ? chan->max_members * 2 : MEMBER_MIN_SLOTS;
+        if (_resize(&chan->members, n * sizeof(*chan->members))
+            || _resize(&chan->clients, (n + 1) * sizeof(*chan->clients)))
+            return NULL;
+        chan->max_members = n;
+    }
+    if (!(member = slab_alloc(&member_slab)))
+        return NULL;
+
+    member->user = user;
+    member->chan = chan;
+    member->modes = modes;
+    member->ban_gen = 0;
+    member->user_pos = user->nr_chans;
+    user->chans[user->nr_chans++] = member;
+    member->chan_pos = chan->nr_members;
+    chan->members[chan->nr_members] = member;
+    chan->clients[chan->nr_members++] = user->client;
+    chan->clients[chan->nr_members] = NULL;
+    return member;
+}
+
+/* member_find(user, chan)
+ * look up user's membership of chan, or NULL if there isn't one. this
+ * walks whichever side is shorter, which is nearly always the user's */
+member_t *
+member_find (user_t *user, chan_t *chan)
+{
+    int i;
+
+    if (user->nr_chans <= chan->nr_members)
+    {
+        for (i = 0; i < user->nr_chans; ++i)
+            if (user->chans[i]->chan == chan)
+                return user->chans[i];
+    }
+    else
+    {
+        for (i = 0; i < chan->nr_members; ++i)
+            if (chan->members[i]->user == user)
+                return chan->members[i];
+    }
+    return NULL;
+}
+
+/* member_part(member)
+ * take a user out of a channel, the last entry on each side is moved
+ * into the hole so the arrays stay dense */
+void
+member_part (member_t *member)
+{
+    user_t *user = member->user;
+    chan_t *chan = member->chan;
+    member_t *last;
+
+    last = user->chans[--user->nr_chans];
+    user->chans[member->user_pos] = last;
+    last->user_pos = member->user_pos;
+
+    last = chan->members[--chan->nr_members];
+    chan->members[member->chan_pos] = last;
+    chan->clients[member->chan_pos] = last->user->client;
+    chan->clients[chan->nr_members] = NULL;
+    last->chan_pos = member->chan_pos;
+
+    slab_free(&member_slab, member);
+}
+
+/* member_free_chan(chan)
+ * release an empty channel's arrays */
+void
+member_free_chan (chan_t *chan)
+{
+    free(chan->members);
+    free(chan->clients);
+    chan->members = NULL;
+    chan->clients = NULL;
+    chan->nr_members = chan->max_members = 0;
+}
+
+/* member_free_user(user)
+ * release a user's channel array, once it's out of every channel */
+void
+member_free_user (user_t *user)
+{
+    free(user->chans);
+    user->chans = NULL;
+    user->nr_chans = user->max_chans = 0;
+}
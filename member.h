@@ -0,0 +1,31 @@
+#ifndef MEMBER_H
+#define MEMBER_H
+/* member.h - channel membership, who is joined to what
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#include "ircd.h"       /* for user_t, chan_t */
+
+#define MEMBER_MIN_SLOTS    4
+
+/* member modes */
+#define MEMBER_OP           1
+
+/* struct member is one user joined to one channel. it sits in both the
+ * channel's and the user's array, chan_pos and user_pos are where, so
+ * either side can let go of it without searching. banned is whether the
+ * channel's bans match the user, as of ban_gen, see ban.c */
+struct member {
+    user_t          *user;
+    chan_t          *chan;
+    int             modes;          /* for CHANMODE_O */
+    int             chan_pos;
+    int             user_pos;
+    int             banned;
+    unsigned long   ban_gen;
+};
+
+member_t *member_join (user_t *, chan_t *, int);
+member_t *member_find (user_t *, chan_t *);
+void member_part (member_t *);
+void member_free_chan (chan_t *);
+void member_free_user (user_t *);
+#endif /* MEMBER_H */
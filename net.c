@@ -1,172 +1,497 @@
 /* net.c - networking layer, note that unix specific network handling
  * is found in unix.c. Copyright Joe Doyle 2011 (See COPYING) */
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "net.h"
 #include "ircd.h"
 #include "list.h"
 #include "irc.h"
+#include "worker.h"
+#include "pool.h"
+#include "reply.h"
+#include "uring.h"
+#include "upgrade.h"
 
-static send_buffer_t *send_buffer_pool = NULL;
-static int pool_size = 0;
+/* most recipients _post_foreign() gathers for a worker per post, as
+ * many as fit in a POOL_4K buffer */
+#define POST_BATCH  ((int)(4096 / sizeof(client_t *)))
+
+/* net_alloc_recvbuf(void)
+ * take a receive buffer from the pool, receive buffers are only
+ * attached to clients while they have unframed input */
+recv_buffer_t *
+net_alloc_recvbuf (void)
+{
+    recv_buffer_t *buffer;
+
+    if (!(buffer = pool_alloc(pool_class(sizeof(*buffer)))))
+        return NULL;
+    buffer->start = buffer->end = buffer->skip = 0;
+    return buffer;
+}
+
+/* net_free_recvbuf(buffer)
+ * give a receive buffer back to the pool */
+void
+net_free_recvbuf (recv_buffer_t *buffer)
+{
+    pool_free(buffer, pool_class(sizeof(*buffer)));
+}
 
 /* net_free_sendbuf(buffer)
- * puts a send buffer back on the queue, unless
- * pool_size > MAX_POOL_SIZE, in which case the buffer is given
- * to free() */
+ * give a send queue block back to the pool */
 void
 net_free_sendbuf (send_buffer_t *buffer)
 {
-    if (pool_size == MAX_POOL_SIZE)
-        free(buffer);
-    else
-    {
-        list_push((list_t **)&send_buffer_pool, (list_t *)buffer);
-        pool_size++;
-    }
+    pool_free(buffer, pool_class(sizeof(*buffer)));
 }
 
 /* net_alloc_sendbuf(void)
- * pops a send buffer off the pool, malloc()s one if the pool is exhausted */
+ * take a send queue block from the pool */
 send_buffer_t *
 net_alloc_sendbuf (void)
 {
-    send_buffer_t *buffer;
+    return pool_alloc(pool_class(sizeof(send_buffer_t)));
+}
+
+/* net_alloc_msg(void)
+ * take a message segment from the pool, the caller owns the single
+ * reference it comes back with */
+msg_t *
+net_alloc_msg (void)
+{
+    msg_t *msg;
 
-    if (pool_size)
+    if ((msg = pool_alloc(pool_class(sizeof(*msg)))))
     {
-        buffer = (send_buffer_t *)list_pop((list_t **)&send_buffer_pool);
-        pool_size--;
+        msg->refs = 1;
+        msg->len = 0;
     }
-    else
-        buffer = malloc(sizeof(*buffer));
-    return buffer;
+    return msg;
+}
+
+/* net_unref_msg(msg)
+ * drops a reference to a segment, the last one out returns it to the
+ * pool. segments can be shared between workers, so the count is atomic */
+void
+net_unref_msg (msg_t *msg)
+{
+    if (__atomic_sub_fetch(&msg->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+    pool_free(msg, pool_class(sizeof(*msg)));
+}
+
+/* net_free_sendq(client)
+ * drop every reference on the client's send queue and give its
+ * blocks back to the pool, used when a client goes away */
+void
+net_free_sendq (client_t *client)
+{
+    sendq_t *sendq = &client->out_buf;
+    send_buffer_t *block;
+
+    /* the kernel still has some of it, the completion frees it */
+    if (sendq->inflight)
+        return;
+
+    while ((block = sendq->first))
+    {
+        while (block->head < block->index)
+            net_unref_msg(block->refs[block->head++]);
+        sendq->first = (send_buffer_t *)block->list_head.next;
+        net_free_sendbuf(block);
+    }
+    sendq->last = NULL;
+    sendq->offset = 0;
+    sendq->bytes = 0;
+}
+
+/* _queue_msg(client, msg, offset)
+ * take a reference to msg and put it on the tail of the client's send
+ * queue, offset bytes of it have already been sent. returns -1 and drops
+ * the client if that would take it over its sendq or a block can't be
+ * allocated */
+static int
+_queue_msg (client_t *client, msg_t *msg, int offset)
+{
+    sendq_t *sendq = &client->out_buf;
+    send_buffer_t *block;
+
+    if (sendq->bytes + msg->len - offset > sendq->max)
+    {
+        /* looks like the connection isnt reading from us,
+         * or lagging too much or something */
+        drop(client, QUIT_MAX_SENDQ_EXCEEDED);
+        return -1;
+    }
+    block = sendq->last;
+    if (!block || block->index == SENDQ_BLOCK_REFS)
+    {
+        if (!(block = net_alloc_sendbuf()))
+        {
+            /* this probably means we're out of memory, we can mitigate
+             * this problem by dropping the client */
+            drop(client, QUIT_OUT_OF_MEMORY);
+            return -1;
+        }
+        block->list_head.next = NULL;
+        block->head = 0;
+        block->index = 0;
+        if (sendq->last)
+            sendq->last->list_head.next = (list_t *)block;
+        else
+        {
+            sendq->first = block;
+            sendq->offset = offset;
+        }
+        sendq->last = block;
+    }
+    __atomic_add_fetch(&msg->refs, 1, __ATOMIC_RELAXED);
+    block->refs[block->index++] = msg;
+    sendq->bytes += msg->len - offset;
+    return 0;
+}
+
+/* _want_write(client, on)
+ * only watch for writeability while there's a backlog, otherwise every
+ * loop iteration would wake us for every idle client */
+static void
+_want_write (client_t *client, int on)
+{
+    int events = EV_READ | (on ? EV_WRITE : 0);
+
+    if ((client->w.events & (EV_READ | EV_WRITE)) == events)
+        return;
+    ev_io_stop(client->worker->loop, &client->w);
+    ev_io_set(&client->w, client->fd, events);
+    ev_io_start(client->worker->loop, &client->w);
+}
+
+/* _mark_dirty(client)
+ * put a client with freshly queued data on its worker's dirty list so
+ * net_flush_dirty() gets to it at the end of this loop iteration. the
+ * list holds a reference, so a drop() in the meantime is harmless */
+static void
+_mark_dirty (client_t *client)
+{
+    worker_t *worker = client->worker;
+
+    if (client->dirty)
+        return;
+    client->dirty = 1;
+    __atomic_add_fetch(&client->refs, 1, __ATOMIC_RELAXED);
+    client->dirty_next = worker->dirty_list;
+    worker->dirty_list = client;
+}
+
+/* net_gather(client, iov, max)
+ * point up to max iovecs at the client's queued segments, across blocks,
+ * starting with whatever is left of the head segment. returns how many */
+int
+net_gather (client_t *client, struct iovec *iov, int max)
+{
+    sendq_t *sendq = &client->out_buf;
+    send_buffer_t *block;
+    msg_t *msg;
+    int i, nr_iov = 0;
+
+    for (block = sendq->first; block && nr_iov < max;
+            block = (send_buffer_t *)block->list_head.next)
+    {
+        for (i = block->head; i < block->index && nr_iov < max; ++i)
+        {
+            msg = block->refs[i];
+            iov[nr_iov].iov_base = msg->buffer;
+            iov[nr_iov].iov_len = msg->len;
+            nr_iov++;
+        }
+    }
+    if (nr_iov)
+    {
+        iov[0].iov_base = (char *)iov[0].iov_base + sendq->offset;
+        iov[0].iov_len -= sendq->offset;
+    }
+    return nr_iov;
+}
+
+/* net_sent(client, bytes)
+ * bytes from the front of the client's queue have gone out, release
+ * every segment that went completely and remember how far into the new
+ * head segment we got */
+void
+net_sent (client_t *client, size_t bytes)
+{
+    sendq_t *sendq = &client->out_buf;
+    send_buffer_t *block;
+    size_t left;
+
+    sendq->bytes -= bytes;
+    stats_add(&client->worker->stats.bytes_out, bytes);
+    while ((block = sendq->first))
+    {
+        left = block->refs[block->head]->len - sendq->offset;
+        if (bytes < left)
+            break;
+        bytes -= left;
+        net_unref_msg(block->refs[block->head++]);
+        sendq->offset = 0;
+        if (block->head == block->index)
+        {
+            /* block drained, unless it's the tail there's more after it */
+            sendq->first = (send_buffer_t *)block->list_head.next;
+            if (!sendq->first)
+                sendq->last = NULL;
+            net_free_sendbuf(block);
+        }
+    }
+    sendq->offset += bytes;
 }
 
 /* net_flush(client)
- * attempts to send any data in client->out_buf, if there is any */
+ * attempts to writev() as much of client->out_buf as the socket takes,
+ * the head offset means a partial write never moves queued data. if
+ * anything is left EV_WRITE is armed until it's gone
+ * NB: if this returns -1, client no longer points to valid memory! */
 ssize_t
 net_flush (client_t *client)
 {
-    ssize_t bytes_sent = 0;
+    struct iovec iov[NET_IOV_MAX];
+    sendq_t *sendq = &client->out_buf;
+    ssize_t bytes_sent, gathered, total = 0;
+    int i, nr_iov;
 
-    if (client->out_buf)
+#ifdef HAVE_IO_URING
+    /* the ring does its own waiting for the socket */
+    if (client->worker->ring)
+        return uring_send(client);
+#endif
+    while (sendq->first)
     {
-        bytes_sent = recv(client->fd, client->out_buf->buffer,
-                            client->out_buf->index, 0);
+        nr_iov = net_gather(client, iov, NET_IOV_MAX);
+        for (gathered = i = 0; i < nr_iov; ++i)
+            gathered += iov[i].iov_len;
+
+        stats_add(&client->worker->syscalls, 1);
+        bytes_sent = writev(client->fd, iov, nr_iov);
         if (bytes_sent <= 0) /* faaaail */
         {
             if (bytes_sent == -1 && !(errno == EAGAIN || errno == EWOULDBLOCK))
+            {
                 drop(client, errno);    /* unexpected error :O */
-            else
-                bytes_sent = 0;         /* nothing sent */
-        }
-        else if (bytes_sent < client->out_buf->index)
-        {
-            /* move unsent data to start of buffer */
-            client->out_buf->index -= bytes_sent;
-            memmove(client->out_buf->buffer,
-                    client->out_buf->buffer + bytes_sent,
-                    client->out_buf->index);
-        }
-        else
-        {
-            /* bytes_sent must be == index */
-            net_free_sendbuf(client->out_buf);
-            client->out_buf = NULL;
+                return -1;
+            }
+            break;                      /* nothing sent */
         }
+        net_sent(client, bytes_sent);
+        total += bytes_sent;
+
+        /* the socket's full, no point asking again */
+        if (bytes_sent < gathered)
+            break;
     }
-    return bytes_sent;
+    _want_write(client, sendq->first != NULL);
+    return total;
+}
+
+/* net_flush_dirty(worker)
+ * flush every client that had something queued during this loop
+ * iteration, one writev() each, called from the worker's ev_prepare */
+void
+net_flush_dirty (worker_t *worker)
+{
+    client_t *client;
+
+    while ((client = worker->dirty_list))
+    {
+        worker->dirty_list = client->dirty_next;
+        client->dirty = 0;
+        /* it may have been dropped since it was queued to */
+        if (client->fd != -1)
+            net_flush(client);
+        client_unref(client);
+    }
+}
+
+/* net_send_msg(client, msg)
+ * queue a reference to a shared segment for the client, nothing is
+ * written until the end of the loop iteration, so whatever else the
+ * client gets meanwhile goes out in the same writev()
+ * NB: if this returns -1, client no longer points to valid memory! */
+ssize_t
+net_send_msg (client_t *client, msg_t *msg)
+{
+    /* someone else's client, let its worker do the sending */
+    if (client->worker != worker_self)
+        return worker_post(client->worker, msg, &client, 1) ? -1 : msg->len;
+    /* dropped, but still in a channel until client_reap() */
+    if (client->fd == -1)
+        return -1;
+
+    if (_queue_msg(client, msg, 0) == -1)
+        return -1;
+    _mark_dirty(client);
+    return msg->len;
+}
+
+/* _nomem(client)
+ * a send to client failed for want of memory, so it goes, unless it's
+ * another worker's or already on its way out */
+static void
+_nomem (client_t *client)
+{
+    if (client->worker == worker_self && client->fd != -1)
+        drop(client, QUIT_OUT_OF_MEMORY);
 }
 
 /* net_send(client, message, size)
- * send a message, size bytes long, to the client. if send() fails beacuse it
- * would block, tack the message on the client's send buffer for a later write
+ * send a message, size bytes long, to the client. it's copied into
+ * private segments and queued, see net_send_msg()
  * NB: if this returns -1, client no longer points to valid memory! */
 ssize_t
 net_send (client_t *client, const char *message, ssize_t size)
 {
-    ssize_t bytes_sent;
-    if (client->out_buf)
+    ssize_t bytes = 0, chunk, ret = size;
+    msg_t *msg;
+
+    for (; bytes < size; bytes += chunk)
     {
-        /* append message to out buffer */
-        if (client->out_buf->index + size > BUFFER_SIZE)
+        if (!(msg = net_alloc_msg()))
         {
-            /* looks like the connection isnt reading from us,
-             * or lagging too much or something */
-            drop(client, QUIT_MAX_SENDQ_EXCEEDED);
+            _nomem(client);
             return -1;
         }
-        memcpy(client->out_buf->buffer + client->out_buf->index,
-                message, size);
-        client->out_buf->index += size;
-        return net_flush(client);
-    }
-    /* send() data, this may fail innocuously if it would block, in which
-     * case queue the message on a send buffer to be flushed when libev
-     * detects writeability */
-    bytes_sent = send(client->fd, message, size, 0);
-    if (bytes_sent <= 0)
-    {
-        /* set this to 0 so line 56 copies the right number of bytes */
-        bytes_sent = 0;
-        if (!(errno == EAGAIN || errno == EWOULDBLOCK))
+        chunk = size - bytes;
+        if (chunk > (ssize_t)sizeof(msg->buffer))
+            chunk = sizeof(msg->buffer);
+        memcpy(msg->buffer, message + bytes, chunk);
+        msg->len = chunk;
+        if (net_send_msg(client, msg) == -1)
+            ret = -1;
+        net_unref_msg(msg);
+        if (ret == -1)
+            break;
+    }
+    return ret;
+}
+
+/* _format_msg(fmt, ap)
+ * format a line straight into a new segment, \r\n and all */
+static msg_t *
+_format_msg (const char *fmt, va_list ap)
+{
+    msg_t *msg;
+    ssize_t size;
+
+    if (!(msg = net_alloc_msg()))
+        return NULL;
+
+    /* make string from format */
+    size = vsnprintf(msg->buffer, IRC_MESSAGE_MAX, fmt, ap);
+
+    /* add \r\n to the end of the message */
+    if (size > IRC_MESSAGE_MAX - 2)
+        size = IRC_MESSAGE_MAX - 2;
+    strcpy(msg->buffer + size, "\r\n");
+    msg->len = size + 2;
+    return msg;
+}
+
+/* _post_foreign(clients, msg)
+ * in worker mode, hand msg to every client in the NULL terminated list
+ * that belongs to another worker. one pass sorts them into a pooled
+ * batch per worker, posted whenever it fills and once more at the end.
+ * the list is left alone, it may well be a channel's cached array */
+static int
+_post_foreign (client_t **clients, msg_t *msg)
+{
+    client_t **batch[IRCD_WORKERS_MAX] = { NULL };
+    int count[IRCD_WORKERS_MAX] = { 0 };
+    worker_t *worker;
+    int i, w, ret = 0;
+
+    for (i = 0; clients[i]; ++i)
+    {
+        if ((worker = clients[i]->worker) == worker_self)
+            continue;
+        w = worker->id;
+        if (!batch[w] && !(batch[w] = pool_alloc(POOL_4K)))
         {
-            /* unexpected error... close connection */
-            drop(client, errno);
-            return -1;
+            ret = -1;
+            break;
         }
-    }   
-    if (bytes_sent != size)
+        batch[w][count[w]++] = clients[i];
+        if (count[w] < POST_BATCH)
+            continue;
+        if (worker_post(worker, msg, batch[w], count[w]))
+            ret = -1;
+        count[w] = 0;
+    }
+    for (w = 0; w < nr_workers; ++w)
     {
-        /* queue unsent data on a send buffer */
-        client->out_buf = (send_buffer_t *)net_alloc_sendbuf();
-        if (!client->out_buf)
-        {  
-            /* this probably means we're out of memory, we can mitigate
-             * this problem by dropping the client */
-            drop(client, QUIT_OUT_OF_MEMORY);
-            return -1;
-        }
-        client->out_buf->index = 0;
-        memcpy(client->out_buf->buffer + client->out_buf->index,
-                message + bytes_sent, size - bytes_sent);
-        client->out_buf->index += size - bytes_sent;
+        if (!batch[w])
+            continue;
+        if (count[w] && worker_post(&workers[w], msg, batch[w], count[w]))
+            ret = -1;
+        pool_free(batch[w], POOL_4K);
     }
-    return size;
+    return ret;
 }
 
-/* net_manysendvf(client_t **clients, fmt, ap)
- * send format string to a number of clients */
+/* net_manysend_msg(client_t **clients, except, msg)
+ * hand a reference to msg to each of a NULL terminated list of clients,
+ * apart from except (one of ours) if it's not NULL. clients isn't
+ * modified, so a channel's cached array can be passed */
 ssize_t
-net_manysendvf (client_t **clients, const char *fmt, va_list ap)
+net_manysend_msg (client_t **clients, client_t *except, msg_t *msg)
 {
-    char text[IRC_MESSAGE_MAX + 1];
+    unsigned long start = stats_nsecs();
     int i;
-    ssize_t size, ret, ret2;
-    
-    /* make string from format */
-    size = vsnprintf(text, IRC_MESSAGE_MAX, fmt, ap);
+    ssize_t ret, ret2;
 
-    /* add \r\n to the end of the message */
-    if (size > IRC_MESSAGE_MAX - 2)
-        size = IRC_MESSAGE_MAX - 2;
-    strcpy(text + size, "\r\n");
-    size += 2;
+    ret = 0;
+    if (nr_workers > 1)
+        ret = _post_foreign(clients, msg);
 
     /* for each client, do send */
-    ret = 0;
     for (i = 0; clients[i]; ++i)
     {
-        ret2 = net_send(clients[i], text, size);
+        /* already posted to their own worker */
+        if (clients[i]->worker != worker_self || clients[i] == except)
+            continue;
+        ret2 = net_send_msg(clients[i], msg);
         /* if any send returns an error, then we return an error */
         if (ret != -1)
             ret = ret2;
     }
+    hist_add(&worker_self->stats.fanout, stats_nsecs() - start);
+    return ret;
+}
+
+/* net_manysendvf(client_t **clients, fmt, ap)
+ * send format string to a number of clients, the line is formatted
+ * once into a shared segment and each client gets a reference to it */
+ssize_t
+net_manysendvf (client_t **clients, const char *fmt, va_list ap)
+{
+    msg_t *msg;
+    ssize_t ret;
+
+    if (!(msg = _format_msg(fmt, ap)))
+        return -1;
+    ret = net_manysend_msg(clients, NULL, msg);
+
+    /* let go of our own reference, queued copies keep it alive */
+    net_unref_msg(msg);
     return ret;
 }
 
@@ -185,28 +510,29 @@ net_manysendf (client_t **clients, const char *fmt, ...)
 }
 
 /* net_sendvf(*client, fmt, ap)
- * send format string to a client */
+ * send format string to a client, formatted straight into a segment
+ * NB: if this returns -1, client no longer points to valid memory! */
 ssize_t
 net_sendvf (client_t *client, const char *fmt, va_list ap)
 {
-    char text[IRC_MESSAGE_MAX + 1];
-    ssize_t size;
-
-    /* make format string */
-    size = vsnprintf(text, IRC_MESSAGE_MAX, fmt, ap);
+    msg_t *msg;
+    ssize_t ret;
 
-    /* add \r\n to end of message */
-    if (size > IRC_MESSAGE_MAX - 2)
-        size = IRC_MESSAGE_MAX - 2;
-    strcpy(text + size, "\r\n");
-    size += 2;
+    if (!(msg = _format_msg(fmt, ap)))
+    {
+        _nomem(client);
+        return -1;
+    }
 
     /* do send */
-    return net_send(client, text, size);
+    ret = net_send_msg(client, msg);
+    net_unref_msg(msg);
+    return ret;
 }
 
 /* net_sendf(*client, fmt, ...)
- * wrapper for net_sendvf() */
+ * wrapper for net_sendvf()
+ * NB: if this returns -1, client no longer points to valid memory! */
 ssize_t
 net_sendf (client_t *client, const char *fmt, ...)
 {
@@ -218,3 +544,325 @@ net_sendf (client_t *client, const char *fmt, ...)
     va_end(ap);
     return ret;
 }
+
+/* _line(client, eol, line_cb)
+ * the byte at eol ends the line starting at in_buf.start, consume it and
+ * pass it on, a \r\n pair just shows up as an empty line and is skipped */
+static inline int
+_line (client_t *client, int eol, net_line_cb line_cb)
+{
+    recv_buffer_t *in = client->in_buf;
+    int start = in->start;
+
+    in->start = eol + 1;
+    if (eol == start)
+        return 0;
+    stats_add(&client->worker->stats.lines_in, 1);
+    return line_cb(client, in->buffer + start, eol - start);
+}
+
+/* _frame_lines(client, from, line_cb)
+ * find every \r or \n in in_buf between from and end, 32 or 16 bytes at
+ * a time where the compiler lets us, and hand the lines they end to
+ * line_cb in a single pass. returns -1 if line_cb dropped the client */
+static int
+_frame_lines (client_t *client, int from, net_line_cb line_cb)
+{
+    const char *buf = client->in_buf->buffer;
+    int pos = from, end = client->in_buf->end;
+    unsigned int mask;
+
+#if defined(__AVX2__)
+    const __m256i cr32 = _mm256_set1_epi8('\r'), lf32 = _mm256_set1_epi8('\n');
+    __m256i chunk32;
+
+    for (; pos + 32 <= end; pos += 32)
+    {
+        chunk32 = _mm256_loadu_si256((const __m256i *)(buf + pos));
+        mask = _mm256_movemask_epi8(_mm256_or_si256(
+                    _mm256_cmpeq_epi8(chunk32, cr32),
+                    _mm256_cmpeq_epi8(chunk32, lf32)));
+        for (; mask; mask &= mask - 1)
+            if (_line(client, pos + __builtin_ctz(mask), line_cb) == -1)
+                return -1;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i cr16 = _mm_set1_epi8('\r'), lf16 = _mm_set1_epi8('\n');
+    __m128i chunk16;
+
+    for (; pos + 16 <= end; pos += 16)
+    {
+        chunk16 = _mm_loadu_si128((const __m128i *)(buf + pos));
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk16, cr16),
+                                              _mm_cmpeq_epi8(chunk16, lf16)));
+        for (; mask; mask &= mask - 1)
+            if (_line(client, pos + __builtin_ctz(mask), line_cb) == -1)
+                return -1;
+    }
+#endif
+    /* whatever is left, or everything without SIMD */
+    for (; pos < end; ++pos)
+    {
+        if (buf[pos] == '\r' || buf[pos] == '\n')
+            if (_line(client, pos, line_cb) == -1)
+                return -1;
+    }
+    return 0;
+}
+
+/* _make_room(in)
+ * once the window runs into the end of the buffer, move the leftover
+ * partial line to the front */
+static void
+_make_room (recv_buffer_t *in)
+{
+    if ((size_t)in->end < RECV_BUFFER_SIZE)
+        return;
+    if (in->start == 0)
+    {
+        /* a buffer full and no line ending, throw it away, and the rest
+         * of the line with it, or it would pass for one of its own */
+        in->end = 0;
+        in->skip = 1;
+    }
+    else
+    {
+        in->end -= in->start;
+        memmove(in->buffer, in->buffer + in->start, in->end);
+        in->start = 0;
+    }
+}
+
+/* _received(client, bytes, line_cb)
+ * bytes more have landed at the end of the window, frame them
+ * NB: if this returns -1, client no longer points to valid memory! */
+static int
+_received (client_t *client, ssize_t bytes, net_line_cb line_cb)
+{
+    recv_buffer_t *in = client->in_buf;
+    const char *eol, *cr;
+    int from;
+
+    /* everything between start and the old end has been scanned
+     * already and holds no line ending */
+    from = in->end;
+    in->end += bytes;
+    stats_add(&client->worker->stats.bytes_in, bytes);
+    if (in->skip)
+    {
+        /* \r ends a line too, as far as _frame_lines() is concerned */
+        cr = memchr(in->buffer + from, '\r', bytes);
+        if (!(eol = memchr(in->buffer + from, '\n',
+                                cr ? cr - (in->buffer + from) : bytes)))
+            eol = cr;
+        if (!eol)
+        {
+            in->start = in->end = 0;
+            return 0;
+        }
+        in->skip = 0;
+        in->start = from = eol - in->buffer + 1;
+    }
+    if (_frame_lines(client, from, line_cb) == -1)
+        return -1;
+    if (in->start == in->end)
+        in->start = in->end = 0;
+    return 0;
+}
+
+/* _detach(client)
+ * hand the receive buffer back if every byte was framed, and we're not
+ * still skipping the end of an overlong line */
+static void
+_detach (client_t *client)
+{
+    recv_buffer_t *in = client->in_buf;
+
+    if (in->start == in->end && !in->skip)
+    {
+        net_free_recvbuf(client->in_buf);
+        client->in_buf = NULL;
+    }
+}
+
+/* net_recv(client, line_cb)
+ * read as much as the socket has for us into client->in_buf and hand every
+ * complete line to line_cb. nothing is moved as lines are consumed, only
+ * a leftover partial line gets moved to the front, and only once the
+ * window runs into the end of the buffer. the buffer is attached for the
+ * duration and handed back if every byte was framed, so idle clients
+ * don't sit on one
+ * NB: if this returns -1, client no longer points to valid memory! */
+ssize_t
+net_recv (client_t *client, net_line_cb line_cb)
+{
+    recv_buffer_t *in = client->in_buf;
+    ssize_t bytes, space, total = 0;
+
+    if (!in && !(in = client->in_buf = net_alloc_recvbuf()))
+    {
+        drop(client, QUIT_OUT_OF_MEMORY);
+        return -1;
+    }
+    for (;;)
+    {
+        _make_room(in);
+        space = RECV_BUFFER_SIZE - in->end;
+        stats_add(&client->worker->syscalls, 1);
+        bytes = recv(client->fd, in->buffer + in->end, space, 0);
+        if (bytes == 0)
+        {
+            drop(client, QUIT_EOF);
+            return -1;
+        }
+        else if (bytes == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            drop(client, errno);
+            return -1;
+        }
+        total += bytes;
+        if (_received(client, bytes, line_cb) == -1)
+            return -1;
+        if (bytes < space)
+            break;      /* that's all the socket had */
+    }
+    _detach(client);
+    return total;
+}
+
+/* net_recv_data(client, data, len, line_cb)
+ * the same as net_recv() for len bytes someone else has already read
+ * off the client's socket, see uring.c
+ * NB: if this returns -1, client no longer points to valid memory! */
+ssize_t
+net_recv_data (client_t *client, const char *data, size_t len,
+                                                    net_line_cb line_cb)
+{
+    recv_buffer_t *in = client->in_buf;
+    size_t bytes, total = len;
+
+    if (!in && !(in = client->in_buf = net_alloc_recvbuf()))
+    {
+        drop(client, QUIT_OUT_OF_MEMORY);
+        return -1;
+    }
+    while (len)
+    {
+        _make_room(in);
+        bytes = RECV_BUFFER_SIZE - in->end;
+        if (bytes > len)
+            bytes = len;
+        memcpy(in->buffer + in->end, data, bytes);
+        data += bytes;
+        len -= bytes;
+        if (_received(client, bytes, line_cb) == -1)
+            return -1;
+    }
+    _detach(client);
+    return total;
+}
+
+/* net_save(u, client)
+ * the client's unframed input and unsent output as they stand, for the
+ * next process, see upgrade.c. there's nothing in flight without io_uring */
+void
+net_save (upgrade_t *u, client_t *client)
+{
+    recv_buffer_t *in = client->in_buf;
+    sendq_t *sendq = &client->out_buf;
+    send_buffer_t *block;
+    int i, offset = sendq->offset;
+
+    upgrade_put_int(u, in && in->skip);
+    if (in)
+        upgrade_put_data(u, in->buffer + in->start, in->end - in->start);
+    else
+        upgrade_put_data(u, NULL, 0);
+    upgrade_put_int(u, sendq->bytes);
+    for (block = sendq->first; block;
+            block = (send_buffer_t *)block->list_head.next)
+    {
+        for (i = block->head; i < block->index; ++i, offset = 0)
+            upgrade_put(u, block->refs[i]->buffer + offset,
+                                            block->refs[i]->len - offset);
+    }
+}
+
+/* net_restore(u, client, line_cb)
+ * put back what net_save() saved, the output goes out once the client's
+ * worker gets going, and must be the worker we're running as
+ * NB: if this returns -1, client no longer points to valid memory! */
+int
+net_restore (upgrade_t *u, client_t *client, net_line_cb line_cb)
+{
+    const char *data;
+    size_t len;
+
+    if (upgrade_get_int(u))
+    {
+        if (!client->in_buf && !(client->in_buf = net_alloc_recvbuf()))
+        {
+            drop(client, QUIT_OUT_OF_MEMORY);
+            return -1;
+        }
+        client->in_buf->skip = 1;
+    }
+    if ((data = upgrade_get_data(u, &len)) && len
+        && net_recv_data(client, data, len, line_cb) == -1)
+        return -1;
+    if ((data = upgrade_get_data(u, &len)) && len
+        && net_send(client, data, len) == -1)
+        return -1;
+    return u->failed ? -1 : 0;
+}
+
+/* _template_msg(id, args, nr_args)
+ * build reply template id into a new segment, see reply_build() */
+static msg_t *
+_template_msg (int id, const slice_t *args, int nr_args)
+{
+    msg_t *msg;
+
+    if (!(msg = net_alloc_msg()))
+        return NULL;
+    msg->len = reply_build(msg->buffer, id, args, nr_args);
+    return msg;
+}
+
+/* net_sendt(*client, id, args, nr_args)
+ * send a canned reply (reply.h) to a client
+ * NB: if this returns -1, client no longer points to valid memory! */
+ssize_t
+net_sendt (client_t *client, int id, const slice_t *args, int nr_args)
+{
+    msg_t *msg;
+    ssize_t ret;
+
+    if (!(msg = _template_msg(id, args, nr_args)))
+    {
+        _nomem(client);
+        return -1;
+    }
+    ret = net_send_msg(client, msg);
+    net_unref_msg(msg);
+    return ret;
+}
+
+/* net_manysendt(client_t **clients, except, id, args, nr_args)
+ * send a canned reply (reply.h) to a number of clients, bar except */
+ssize_t
+net_manysendt (client_t **clients, client_t *except, int id,
+                                        const slice_t *args, int nr_args)
+{
+    msg_t *msg;
+    ssize_t ret;
+
+    if (!(msg = _template_msg(id, args, nr_args)))
+        return -1;
+    ret = net_manysend_msg(clients, except, msg);
+    net_unref_msg(msg);
+    return ret;
+}
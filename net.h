@@ -2,34 +2,97 @@
 #define NET_H
 /* net.h - header file for network layer
  * Copyright Joe Doyle 2011 (See COPYING) */
+#include <sys/types.h>  /* for ssize_t */
+#include <stdarg.h>     /* for va_list */
+#include <sys/uio.h>    /* for struct iovec */
 #include "list.h"
+#include "irc.h"        /* for IRC_MESSAGE_MAX */
+#include "parse.h"      /* for slice_t */
 
 #define BUFFER_SIZE (4 * 4096)
-#define MAX_POOL_SIZE (IRCD_CLIENTS_MAX / 10)
+/* so a whole recv_buffer_t is exactly one 16K pool buffer */
+#define RECV_BUFFER_SIZE (BUFFER_SIZE - 3 * sizeof(int))
+#define SENDQ_BLOCK_REFS 64 /* segment references per send queue block */
+#define NET_IOV_MAX 256     /* segments handed to a single writev() */
 
 typedef struct recv_buffer recv_buffer_t;
 typedef struct send_buffer send_buffer_t;
+typedef struct sendq sendq_t;
+typedef struct msg msg_t;
 
-/* message buffers */
+/* struct recv_buffer holds what we've read from a client, buffer[start]
+ * up to buffer[end] is a window of bytes not yet framed into lines, so
+ * consuming a line just moves start along. skip is set once a line has
+ * overflowed the buffer, the rest of it is thrown away up to its \n */
 struct recv_buffer {
-    int     index;
-    char    buffer[BUFFER_SIZE];
+    int     start;
+    int     end;
+    int     skip;
+    char    buffer[RECV_BUFFER_SIZE];
+};
+
+/* struct msg is a refcounted message segment, a line is formatted into
+ * one of these once and every send queue it goes on just holds a
+ * reference, the last net_unref_msg() puts it back in the pool */
+struct msg {
+    int     refs;
+    int     len;
+    char    buffer[IRC_MESSAGE_MAX + 1];
 };
 
+/* struct send_buffer is one block of a chained send queue, list_head.next
+ * is the following block, refs[head] up to refs[index] are still to go */
 struct send_buffer {
     list_t  list_head;
+    int     head;
     int     index;
-    char    buffer[BUFFER_SIZE];
+    msg_t   *refs[SENDQ_BLOCK_REFS];
+};
+
+/* struct sendq is a client's send queue, blocks are appended at last and
+ * drained from first, offset is how many bytes of the head segment have
+ * already gone out so a partial write never moves anything. bytes is
+ * what's still queued, max is the limit for the client's class. inflight
+ * is set while the kernel is sending from it on our behalf (io_uring) */
+struct sendq {
+    send_buffer_t   *first;
+    send_buffer_t   *last;
+    int             offset;
+    size_t          bytes;
+    size_t          max;
+    int             inflight;
 };
 
 /* moved include "ircd.h" down here because ircd.h requires
  * the above types */
 #include "ircd.h"
+/* net_recv() hands every complete line to one of these, without its
+ * \r\n, returning -1 means the client has been dropped */
+typedef int (*net_line_cb) (client_t *, const char *, int);
+typedef struct upgrade upgrade_t;
+
+ssize_t net_recv (client_t *, net_line_cb);
+ssize_t net_recv_data (client_t *, const char *, size_t, net_line_cb);
+int net_gather (client_t *, struct iovec *, int);
+void net_sent (client_t *, size_t);
+ssize_t net_flush (client_t *);
+void net_flush_dirty (worker_t *);
 ssize_t net_send (client_t *, const char *, ssize_t);
+ssize_t net_send_msg (client_t *, msg_t *);
+ssize_t net_manysend_msg (client_t **, client_t *, msg_t *);
 ssize_t net_manysendvf (client_t **, const char *, va_list);
 ssize_t net_manysendf (client_t **, const char *, ...);
 ssize_t net_sendvf (client_t *, const char *, va_list);
 ssize_t net_sendf (client_t *, const char *, ...);
+ssize_t net_sendt (client_t *, int, const slice_t *, int);
+ssize_t net_manysendt (client_t **, client_t *, int, const slice_t *, int);
+recv_buffer_t *net_alloc_recvbuf (void);
+void net_free_recvbuf (recv_buffer_t *);
 send_buffer_t *net_alloc_sendbuf (void);
 void net_free_sendbuf (send_buffer_t *);
+void net_free_sendq (client_t *);
+msg_t *net_alloc_msg (void);
+void net_unref_msg (msg_t *);
+void net_save (upgrade_t *, client_t *);
+int net_restore (upgrade_t *, client_t *, net_line_cb);
 #endif /* NET_H */
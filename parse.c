@@ -0,0 +1,113 @@
+/* parse.c - zero-copy IRC message tokenizer, splits a line into prefix,
+ * command and params as slices of the line itself, nothing is copied,
+ * allocated or written to. Copyright Joe Doyle 2011 (See COPYING) */
+#include <string.h>
+#include "parse.h"
+#include "irc.h"
+
+/* _skip_spaces(p, end)
+ * RFC 2812 says one space, real clients say otherwise */
+static inline const char *
+_skip_spaces (const char *p, const char *end)
+{
+    while (p < end && *p == ' ')
+        p++;
+    return p;
+}
+
+/* _token(slice, p, end)
+ * fill slice with everything from p up to the next space or end,
+ * returns a pointer to the byte after it */
+static inline const char *
+_token (slice_t *slice, const char *p, const char *end)
+{
+    const char *space;
+
+    space = memchr(p, ' ', end - p);
+    if (!space)
+        space = end;
+    slice->ptr = p;
+    slice->len = space - p;
+    return space;
+}
+
+/* _valid_command(command)
+ * a command is letters only, or a three digit numeric */
+static int
+_valid_command (const slice_t *command)
+{
+    int i;
+    char c;
+
+    if (command->len == 0 || command->len > IRC_COMMAND_MAX)
+        return 0;
+    if (command->ptr[0] >= '0' && command->ptr[0] <= '9')
+    {
+        if (command->len != 3)
+            return 0;
+        for (i = 1; i < 3; ++i)
+            if (command->ptr[i] < '0' || command->ptr[i] > '9')
+                return 0;
+        return 1;
+    }
+    for (i = 0; i < command->len; ++i)
+    {
+        c = command->ptr[i] | 0x20;     /* ascii lowercase */
+        if (c < 'a' || c > 'z')
+            return 0;
+    }
+    return 1;
+}
+
+/* parse_message(msg, line, len)
+ * tokenize a line (without its \r\n) into msg, the irc.h limits are
+ * checked as we go. the 15th param, or anything after a " :", runs to
+ * the end of the line. returns 0 on success, otherwise a PARSE_ error,
+ * in which case msg is garbage */
+int
+parse_message (message_t *msg, const char *line, int len)
+{
+    const char *p = line, *end = line + len;
+
+    /* IRC_MESSAGE_MAX counts the \r\n we've already stripped */
+    if (len > IRC_MESSAGE_MAX - 2)
+        return PARSE_TOO_LONG;
+
+    p = _skip_spaces(p, end);
+    if (p == end)
+        return PARSE_EMPTY;
+
+    msg->prefix.ptr = NULL;
+    msg->prefix.len = 0;
+    if (*p == ':')
+    {
+        p = _token(&msg->prefix, p + 1, end);
+        if (msg->prefix.len == 0 || msg->prefix.len > IRC_PREFIX_MAX)
+            return PARSE_BAD_PREFIX;
+        p = _skip_spaces(p, end);
+    }
+
+    p = _token(&msg->command, p, end);
+    if (!_valid_command(&msg->command))
+        return PARSE_BAD_COMMAND;
+
+    msg->nr_params = 0;
+    for (;;)
+    {
+        p = _skip_spaces(p, end);
+        if (p == end)
+            break;
+        if (*p == ':' || msg->nr_params == IRC_PARAMS_MAX - 1)
+        {
+            /* trailing param, spaces and all */
+            if (*p == ':')
+                p++;
+            msg->params[msg->nr_params].ptr = p;
+            msg->params[msg->nr_params].len = end - p;
+            msg->nr_params++;
+            break;
+        }
+        p = _token(&msg->params[msg->nr_params++], p, end);
+    }
+    return 0;
+}
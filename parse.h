@@ -0,0 +1,36 @@
+#ifndef PARSE_H
+#define PARSE_H
+/* parse.h - zero-copy IRC message tokenizer
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#include "irc.h"        /* for IRC_PARAMS_MAX */
+
+typedef struct slice slice_t;
+typedef struct message message_t;
+
+/* struct slice is a view into someone else's buffer, it is NOT
+ * NUL terminated, always go by len */
+struct slice {
+    const char  *ptr;
+    int         len;
+};
+
+/* struct message is a tokenized line, every slice points into the line
+ * that was parsed so it's only good for as long as that buffer is,
+ * prefix.len is 0 if there was no prefix */
+struct message {
+    slice_t     prefix;
+    slice_t     command;
+    int         nr_params;
+    slice_t     params[IRC_PARAMS_MAX];
+};
+
+/* parse errors */
+enum {
+    PARSE_EMPTY = -1,
+    PARSE_TOO_LONG = -2,
+    PARSE_BAD_PREFIX = -3,
+    PARSE_BAD_COMMAND = -4
+};
+
+int parse_message (message_t *, const char *, int);
+#endif /* PARSE_H */
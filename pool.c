@@ -0,0 +1,314 @@
+/* pool.c - size classed buffer pool, replaces the old single list of 16 KB
+ * send buffers. each thread keeps a small cache per class so the common
+ * case takes no lock, caches refill from and spill to a shared LIFO stack
+ * per class. the cold end of that stack is trimmed with MADV_DONTNEED once
+ * too much memory sits idle, so what we hold follows actual load rather
+ * than the worst burst we've seen. a thread's cache goes back to the
+ * shared stacks when it exits, worker threads come and go across a failed
+ * upgrade. Copyright Joe Doyle 2011 (See COPYING) */
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "pool.h"
+#include "log.h"
+
+typedef struct pool_cache pool_cache_t;
+typedef struct pool_thread pool_thread_t;
+typedef struct pool_class pool_class_t;
+
+/* struct pool_cache is one thread's stash of one class */
+struct pool_cache {
+    void            *objs[POOL_CACHE_MAX];
+    int             nr;
+    unsigned long   hits;
+    unsigned long   misses;
+};
+
+struct pool_thread {
+    int             registered;
+    pool_cache_t    caches[POOL_CLASSES];
+};
+
+/* struct pool_class is the shared side of a class. stack holds every idle
+ * buffer, the hot end on top, stack[0] up to stack[trimmed] have had their
+ * pages handed back to the kernel. new buffers are carved out of chunk */
+struct pool_class {
+    size_t          size;
+    pthread_mutex_t lock;
+    void            **stack;
+    size_t          top;
+    size_t          cap;
+    size_t          trimmed;
+    char            *chunk;
+    size_t          chunk_left;
+    size_t          carved;
+    unsigned long   trims;
+};
+
+static pool_class_t classes[POOL_CLASSES] = {
+    { .size = 1024,  .lock = PTHREAD_MUTEX_INITIALIZER },
+    { .size = 4096,  .lock = PTHREAD_MUTEX_INITIALIZER },
+    { .size = 16384, .lock = PTHREAD_MUTEX_INITIALIZER },
+    { .size = 65536, .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+
+static __thread pool_thread_t pool_self;
+static pool_thread_t *threads[POOL_THREADS_MAX];
+static int nr_threads = 0;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+/* hits and misses of threads that have exited, so the totals don't drop */
+static unsigned long retired_hits[POOL_CLASSES];
+static unsigned long retired_misses[POOL_CLASSES];
+static pthread_key_t pool_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void _unregister (void *);
+static void _spill (pool_class_t *, pool_cache_t *, int);
+
+static void
+_key_init (void)
+{
+    pthread_key_create(&pool_key, &_unregister);
+}
+
+/* _register(void)
+ * make this thread's caches visible to pool_stats(), and have them
+ * handed back when it exits */
+static void
+_register (void)
+{
+    pthread_once(&pool_once, &_key_init);
+    pthread_setspecific(pool_key, &pool_self);
+    pthread_mutex_lock(&threads_lock);
+    if (nr_threads < POOL_THREADS_MAX)
+        threads[nr_threads++] = &pool_self;
+    pthread_mutex_unlock(&threads_lock);
+    pool_self.registered = 1;
+}
+
+/* _unregister(self)
+ * a thread is exiting, its cached buffers go back to the shared stacks
+ * and it drops out of threads[] before its pool_self goes away */
+static void
+_unregister (void *arg)
+{
+    pool_thread_t *self = arg;
+    pool_cache_t *cache;
+    int i;
+
+    for (i = 0; i < POOL_CLASSES; ++i)
+    {
+        cache = &self->caches[i];
+        _spill(&classes[i], cache, 0);
+        if (cache->nr)
+            log_warn("pool: dropping %d %zu byte buffers", cache->nr,
+                                                        classes[i].size);
+    }
+    pthread_mutex_lock(&threads_lock);
+    for (i = 0; i < POOL_CLASSES; ++i)
+    {
+        retired_hits[i] += self->caches[i].hits;
+        retired_misses[i] += self->caches[i].misses;
+    }
+    for (i = 0; i < nr_threads; ++i)
+    {
+        if (threads[i] == self)
+        {
+            threads[i] = threads[--nr_threads];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&threads_lock);
+    self->registered = 0;
+}
+
+/* _carve(class)
+ * cut a new buffer out of the current chunk, mapping a new chunk if
+ * that one is used up. chunks are page aligned and every class above
+ * 1K is a multiple of the page size, so those buffers can be trimmed
+ * individually. called with the class locked */
+static void *
+_carve (pool_class_t *class)
+{
+    void *obj;
+
+    if (class->chunk_left < class->size)
+    {
+        class->chunk = mmap(NULL, POOL_CHUNK, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (class->chunk == MAP_FAILED)
+        {
+            class->chunk = NULL;
+            class->chunk_left = 0;
+            return NULL;
+        }
+        class->chunk_left = POOL_CHUNK;
+    }
+    obj = class->chunk;
+    class->chunk += class->size;
+    class->chunk_left -= class->size;
+    class->carved++;
+    return obj;
+}
+
+/* _trim(class)
+ * if more than the high watermark is sitting idle, give the pages of the
+ * coldest buffers back until we're down to the low one. they stay on the
+ * stack and fault back in, zeroed, if we ever get that far down it
+ * called with the class locked */
+static void
+_trim (pool_class_t *class)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    size_t idle = (class->top - class->trimmed) * class->size;
+
+    if (class->size < (size_t)page || idle <= POOL_HIGH_WATERMARK)
+        return;
+    while (idle > POOL_LOW_WATERMARK)
+    {
+        madvise(class->stack[class->trimmed++], class->size, MADV_DONTNEED);
+        idle -= class->size;
+        class->trims++;
+    }
+}
+
+/* _refill(class, cache, fresh)
+ * move a batch of buffers from the shared stack to a thread's cache,
+ * carving new ones if the stack runs dry. fresh is set if any of them
+ * needed new or trimmed memory. returns how many it got */
+static int
+_refill (pool_class_t *class, pool_cache_t *cache, int *fresh)
+{
+    void *obj;
+
+    *fresh = 0;
+    pthread_mutex_lock(&class->lock);
+    while (cache->nr < POOL_BATCH)
+    {
+        if (class->top)
+        {
+            obj = class->stack[--class->top];
+            if (class->top < class->trimmed)
+            {
+                class->trimmed--;
+                *fresh = 1;
+            }
+        }
+        else if (!(obj = _carve(class)))
+            break;
+        else
+            *fresh = 1;
+        cache->objs[cache->nr++] = obj;
+    }
+    pthread_mutex_unlock(&class->lock);
+    return cache->nr;
+}
+
+/* _spill(class, cache, keep)
+ * move a thread's cache back to the shared stack until keep are left,
+ * trimming if that leaves too much idle. if the stack can't grow the
+ * buffers just stay cached */
+static void
+_spill (pool_class_t *class, pool_cache_t *cache, int keep)
+{
+    void **stack;
+    size_t cap;
+
+    pthread_mutex_lock(&class->lock);
+    if (class->top + cache->nr > class->cap)
+    {
+        cap = class->cap ? class->cap * 2 : 1024;
+        if ((stack = realloc(class->stack, cap * sizeof(*stack))))
+        {
+            class->stack = stack;
+            class->cap = cap;
+        }
+    }
+    while (cache->nr > keep && class->top < class->cap)
+        class->stack[class->top++] = cache->objs[--cache->nr];
+    _trim(class);
+    pthread_mutex_unlock(&class->lock);
+}
+
+/* pool_alloc(class)
+ * hand out a buffer of the given class, NULL if we're out of memory.
+ * the contents are garbage */
+void *
+pool_alloc (int nr_class)
+{
+    pool_cache_t *cache = &pool_self.caches[nr_class];
+    int fresh;
+
+    if (!pool_self.registered)
+        _register();
+    if (cache->nr)
+    {
+        cache->hits++;
+        return cache->objs[--cache->nr];
+    }
+    if (!_refill(&classes[nr_class], cache, &fresh))
+        return NULL;
+    /* a refill that needed memory we didn't have counts as a miss */
+    if (fresh)
+        cache->misses++;
+    else
+        cache->hits++;
+    return cache->objs[--cache->nr];
+}
+
+/* pool_free(obj, class)
+ * give a buffer back, it goes to this thread's cache whichever thread
+ * it came from */
+void
+pool_free (void *obj, int nr_class)
+{
+    pool_cache_t *cache = &pool_self.caches[nr_class];
+
+    if (!pool_self.registered)
+        _register();
+    if (cache->nr == POOL_CACHE_MAX)
+        _spill(&classes[nr_class], cache, POOL_CACHE_MAX - POOL_BATCH);
+    if (cache->nr == POOL_CACHE_MAX)
+    {
+        /* couldn't spill, better to leak than to crash */
+        log_warn("pool: dropping a %zu byte buffer",
+                                        classes[nr_class].size);
+        return;
+    }
+    cache->objs[cache->nr++] = obj;
+}
+
+/* pool_stats(class, stats)
+ * fill stats in for one class, the per thread numbers are read without
+ * stopping anyone so they're only approximately in step */
+void
+pool_stats (int nr_class, pool_stats_t *stats)
+{
+    pool_class_t *class = &classes[nr_class];
+    pool_cache_t *cache;
+    size_t cached = 0;
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->size = class->size;
+    pthread_mutex_lock(&threads_lock);
+    stats->hits = retired_hits[nr_class];
+    stats->misses = retired_misses[nr_class];
+    for (i = 0; i < nr_threads; ++i)
+    {
+        cache = &threads[i]->caches[nr_class];
+        stats->hits += __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+        stats->misses += __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+        cached += __atomic_load_n(&cache->nr, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&threads_lock);
+
+    pthread_mutex_lock(&class->lock);
+    stats->trims = class->trims;
+    stats->resident = (class->carved - class->trimmed) * class->size;
+    stats->idle = (class->top - class->trimmed + cached) * class->size;
+    pthread_mutex_unlock(&class->lock);
+}
@@ -0,0 +1,59 @@
+#ifndef POOL_H
+#define POOL_H
+/* pool.h - size classed buffer pool
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#include <stddef.h>     /* for size_t */
+
+/* size classes */
+enum {
+    POOL_1K = 0,
+    POOL_4K,
+    POOL_16K,
+    POOL_64K,
+    POOL_CLASSES
+};
+
+#define POOL_CHUNK      (1024 * 1024)   /* carved into buffers */
+#define POOL_CACHE_MAX  64              /* per thread, per class */
+#define POOL_BATCH      (POOL_CACHE_MAX / 2)
+#define POOL_THREADS_MAX 128
+/* idle memory per class above the high watermark is trimmed back to
+ * the low one with madvise(MADV_DONTNEED) */
+#define POOL_HIGH_WATERMARK (8 * 1024 * 1024)
+#define POOL_LOW_WATERMARK  (2 * 1024 * 1024)
+
+typedef struct pool_stats pool_stats_t;
+
+/* struct pool_stats is what pool_stats() reports for one class, hits
+ * were served from memory we already had, misses had to carve out new
+ * buffers or fault trimmed ones back in */
+struct pool_stats {
+    size_t          size;
+    unsigned long   hits;
+    unsigned long   misses;
+    unsigned long   trims;
+    size_t          resident;       /* bytes */
+    size_t          idle;           /* bytes of that sitting in the pool */
+};
+
+/* pool_class(size)
+ * the smallest class a size bytes object fits in, -1 if none does,
+ * folds to a constant for sizeof() arguments */
+static inline int
+pool_class (size_t size)
+{
+    if (size <= 1024)
+        return POOL_1K;
+    if (size <= 4096)
+        return POOL_4K;
+    if (size <= 16384)
+        return POOL_16K;
+    if (size <= 65536)
+        return POOL_64K;
+    return -1;
+}
+
+void *pool_alloc (int);
+void pool_free (void *, int);
+void pool_stats (int, pool_stats_t *);
+#endif /* POOL_H */
@@ -0,0 +1,133 @@
+/* reply.c - canned server replies and relayed commands. the common lines
+ * are templates split at their %s holes once at startup, building one is
+ * a handful of memcpy()s rather than another trip through vsnprintf().
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#include <stdio.h>
+#include <string.h>
+#include "reply.h"
+#include "ircd.h"
+#include "irc.h"
+
+typedef struct template template_t;
+
+/* struct template is a format with nothing but %s in it, cut into the
+ * literal pieces between them, there's one more piece than holes */
+struct template {
+    int         nr_parts;
+    const char  *parts[REPLY_ARGS_MAX+1];
+    int         lens[REPLY_ARGS_MAX+1];
+};
+
+static template_t templates[REPLY_MAX];
+
+/* indexed by the RPL_/ERR_/REPLY_ enum in reply.h */
+static const char *formats[REPLY_MAX] = {
+    ":%s 001 %s :Welcome to the Internet Relay Network %s",
+    ":%s 002 %s :Your host is %s, running version %s",
+    ":%s 003 %s :This server was created %s",
+    ":%s 004 %s %s %s %s %s",
+    ":%s 212 %s %s %s",
+    ":%s 219 %s %s :End of STATS report",
+    ":%s 242 %s :Server Up %s",
+    ":%s 249 %s :%s",
+    ":%s 332 %s %s :%s",
+    ":%s 353 %s = %s :%s",
+    ":%s 366 %s %s :End of NAMES list",
+    ":%s 324 %s %s %s",
+    ":%s 367 %s %s %s %s %s",
+    ":%s 368 %s %s :End of channel ban list",
+    ":%s 401 %s %s :No such nick/channel",
+    ":%s 403 %s %s :No such channel",
+    ":%s 404 %s %s :Cannot send to channel",
+    ":%s 405 %s %s :You have joined too many channels",
+    ":%s 421 %s %s :Unknown command",
+    ":%s 431 %s :No nickname given",
+    ":%s 432 %s %s :Erroneous nickname",
+    ":%s 433 %s %s :Nickname is already in use",
+    ":%s 442 %s %s :You're not on that channel",
+    ":%s 451 %s :You have not registered",
+    ":%s 461 %s %s :Not enough parameters",
+    ":%s 462 %s :Unauthorized command (already registered)",
+    ":%s 472 %s %s :is unknown mode char to me for %s",
+    ":%s 474 %s %s :Cannot join channel (+b)",
+    ":%s 478 %s %s %s :Channel list is full",
+    ":%s 482 %s %s :You're not channel operator",
+    ":%s PRIVMSG %s :%s",
+    ":%s NOTICE %s :%s",
+    ":%s JOIN %s",
+    ":%s PART %s :%s",
+    ":%s QUIT :%s",
+    ":%s NICK %s",
+    ":%s MODE %s %s %s",
+    ":%s PONG %s :%s",
+    "PING :%s"
+};
+
+/* reply_init()
+ * split every template at its holes, call once before any replies */
+void
+reply_init (void)
+{
+    template_t *t;
+    const char *p, *hole;
+    int i;
+
+    for (i = 0; i < REPLY_MAX; ++i)
+    {
+        t = &templates[i];
+        t->nr_parts = 0;
+        for (p = formats[i]; (hole = strstr(p, "%s")); p = hole + 2)
+        {
+            t->parts[t->nr_parts] = p;
+            t->lens[t->nr_parts++] = hole - p;
+        }
+        t->parts[t->nr_parts] = p;
+        t->lens[t->nr_parts++] = strlen(p);
+    }
+}
+
+/* reply_build(buf, id, args, nr_args)
+ * fill in template id with args, missing ones are left empty, into buf
+ * (at least IRC_MESSAGE_MAX+1 bytes) and add \r\n. anything past
+ * IRC_MESSAGE_MAX is cut off, same as net_sendvf(). returns the length */
+int
+reply_build (char *buf, int id, const slice_t *args, int nr_args)
+{
+    const template_t *t = &templates[id];
+    char *p = buf, *end = buf + IRC_MESSAGE_MAX - 2;
+    int i, n;
+
+    for (i = 0; i < t->nr_parts; ++i)
+    {
+        n = t->lens[i];
+        if (n > end - p)
+            n = end - p;
+        memcpy(p, t->parts[i], n);
+        p += n;
+        if (i + 1 == t->nr_parts || i >= nr_args)
+            continue;
+        n = args[i].len;
+        if (n > end - p)
+            n = end - p;
+        memcpy(p, args[i].ptr, n);
+        p += n;
+    }
+    memcpy(p, "\r\n", 3);
+    return p + 2 - buf;
+}
+
+/* user_prefix(user)
+ * the user's nick!user@host, serialized on first use after a change
+ * and kept until user_touch() */
+slice_t
+user_prefix (user_t *user)
+{
+    slice_t prefix;
+
+    if (!user->prefix_len)
+        user->prefix_len = snprintf(user->prefix, sizeof(user->prefix),
+                        "%s!%s@%s", user->nickname, user->user, user->host);
+    prefix.ptr = user->prefix;
+    prefix.len = user->prefix_len;
+    return prefix;
+}
@@ -0,0 +1,69 @@
+#ifndef REPLY_H
+#define REPLY_H
+/* reply.h - canned server replies and relayed commands
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#include "ircd.h"       /* for user_t */
+#include "parse.h"      /* for slice_t */
+
+#define REPLY_ARGS_MAX  6
+
+/* reply templates, numerics take the server name and the target nick
+ * as their first two arguments, relayed commands take the sender's
+ * prefix (see user_prefix()) first */
+enum {
+    /* numerics */
+    RPL_WELCOME = 0,
+    RPL_YOURHOST,
+    RPL_CREATED,
+    RPL_MYINFO,
+    RPL_STATSCOMMANDS,
+    RPL_ENDOFSTATS,
+    RPL_STATSUPTIME,
+    RPL_STATSDEBUG,
+    RPL_TOPIC,
+    RPL_NAMREPLY,
+    RPL_ENDOFNAMES,
+    RPL_CHANNELMODEIS,
+    RPL_BANLIST,
+    RPL_ENDOFBANLIST,
+    ERR_NOSUCHNICK,
+    ERR_NOSUCHCHANNEL,
+    ERR_CANNOTSENDTOCHAN,
+    ERR_TOOMANYCHANNELS,
+    ERR_UNKNOWNCOMMAND,
+    ERR_NONICKNAMEGIVEN,
+    ERR_ERRONEUSNICKNAME,
+    ERR_NICKNAMEINUSE,
+    ERR_NOTONCHANNEL,
+    ERR_NOTREGISTERED,
+    ERR_NEEDMOREPARAMS,
+    ERR_ALREADYREGISTRED,
+    ERR_UNKNOWNMODE,
+    ERR_BANNEDFROMCHAN,
+    ERR_BANLISTFULL,
+    ERR_CHANOPRIVSNEEDED,
+    /* relayed */
+    REPLY_PRIVMSG,
+    REPLY_NOTICE,
+    REPLY_JOIN,
+    REPLY_PART,
+    REPLY_QUIT,
+    REPLY_NICK,
+    REPLY_MODE,
+    REPLY_PONG,
+    REPLY_PING,
+    REPLY_MAX
+};
+
+void reply_init (void);
+int reply_build (char *, int, const slice_t *, int);
+slice_t user_prefix (user_t *);
+
+/* user_touch(user)
+ * the cached prefix is stale, call on any nick/user/host change */
+static inline void
+user_touch (user_t *user)
+{
+    user->prefix_len = 0;
+}
+#endif /* REPLY_H */
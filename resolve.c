@@ -0,0 +1,433 @@
+/* resolve.c - asynchronous name lookups. getaddrinfo() and getnameinfo()
+ * block, so a few threads of our own sit on them and a worker that wants
+ * something looked up queues a lookup and carries on, the answer comes
+ * back through the worker's resolve_w (an ev_async) and its callback runs
+ * on the worker's own loop like everything else. reverse lookups are
+ * confirmed forward, a PTR anyone can set up is only believed if the
+ * name it gives resolves back to the address, and the outcome either way
+ * is remembered for a while by address. with a hosts file every lookup
+ * is answered from that instead of DNS, which makes it easy to test.
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ev.h>         /* requires libev */
+#include "resolve.h"
+#include "worker.h"
+#include "hash.h"
+#include "casemap.h"
+#include "log.h"
+
+/* struct cache_entry remembers what an address resolved to, name is
+ * empty if it didn't. the cache is a ring, when it's full the oldest
+ * entry makes way, which as every entry lives as long as the next is
+ * also about the first to expire */
+struct cache_entry {
+    char            addr[INET_ADDRSTRLEN];
+    char            name[IRC_HOSTNAME_MAX+1];
+    time_t          expires;
+};
+
+static pthread_t            threads[RESOLVE_THREADS];
+static int                  nr_threads = 0;
+static pthread_mutex_t      queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t       queue_cond = PTHREAD_COND_INITIALIZER;
+static lookup_t             *queue_head = NULL;
+static lookup_t             *queue_tail = NULL;
+static int                  queue_len = 0;
+static int                  stopping = 0;
+
+static pthread_mutex_t      cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_entry   cache[RESOLVE_CACHE_MAX];
+static struct hash_table    cache_table;
+static int                  cache_next = 0;
+
+/* hosts file mode, both tables point into hosts, whose names are kept
+ * folded as hostnames don't care about case and the tables do */
+static int                  use_hosts = 0;
+static struct hash_table    hosts_by_addr;
+static struct hash_table    hosts_by_name;
+static struct cache_entry   *hosts = NULL;
+
+/* _valid_name(name)
+ * only letters, digits, '-' and '.' are any use to us in a host, a
+ * PTR record can hold anything at all */
+static int
+_valid_name (const char *name)
+{
+    const char *p;
+
+    if (!*name || *name == '.' || *name == '-')
+        return 0;
+    for (p = name; *p; ++p)
+        if (!((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z')
+              || (*p >= '0' && *p <= '9') || *p == '-' || *p == '.'))
+            return 0;
+    return 1;
+}
+
+/* _forward(name, addr)
+ * does name resolve to addr? if addr is empty, it's filled in with the
+ * first address name resolves to instead. returns 1 if so */
+static int
+_forward (const char *name, char *addr)
+{
+    struct addrinfo hints, *res, *ai;
+    char text[INET_ADDRSTRLEN], key[IRC_HOSTNAME_MAX+1];
+    const char *found;
+    int ret = 0;
+
+    if (use_hosts)
+    {
+        if (strlen(name) > IRC_HOSTNAME_MAX)
+            return 0;
+        casemap_fold(key, name, strlen(name));
+        if (!(found = hash_lookup(&hosts_by_name, key)))
+            return 0;
+        if (!*addr)
+            strcpy(addr, found);
+        return !strcmp(addr, found);
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(name, NULL, &hints, &res))
+        return 0;
+    for (ai = res; ai && !ret; ai = ai->ai_next)
+    {
+        inet_ntop(AF_INET, &((struct sockaddr_in *)ai->ai_addr)->sin_addr,
+                                                        text, sizeof(text));
+        if (!*addr)
+            strcpy(addr, text);
+        ret = !strcmp(addr, text);
+    }
+    freeaddrinfo(res);
+    return ret;
+}
+
+/* _reverse(addr, name)
+ * find addr's name and check it resolves back to addr
+ * returns 1 if it does */
+static int
+_reverse (char *addr, char *name)
+{
+    struct sockaddr_in sin;
+    const char *found;
+
+    if (use_hosts)
+    {
+        if (!(found = hash_lookup(&hosts_by_addr, addr)))
+            return 0;
+        snprintf(name, IRC_HOSTNAME_MAX + 1, "%s", found);
+    }
+    else
+    {
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        if (inet_pton(AF_INET, addr, &sin.sin_addr) != 1
+            || getnameinfo((struct sockaddr *)&sin, sizeof(sin), name,
+                            IRC_HOSTNAME_MAX + 1, NULL, 0, NI_NAMEREQD))
+            return 0;
+    }
+    return _valid_name(name) && _forward(name, addr);
+}
+
+/* _cache_put(addr, name)
+ * remember what addr resolved to, NULL if nothing */
+static void
+_cache_put (const char *addr, const char *name)
+{
+    struct cache_entry *entry;
+
+    pthread_mutex_lock(&cache_lock);
+    if ((entry = hash_lookup(&cache_table, addr)))
+        hash_remove(&cache_table, addr);
+    else
+    {
+        entry = &cache[cache_next];
+        cache_next = (cache_next + 1) % RESOLVE_CACHE_MAX;
+        if (entry->addr[0])
+            hash_remove(&cache_table, entry->addr);
+        strcpy(entry->addr, addr);
+    }
+    strcpy(entry->name, name ? name : "");
+    entry->expires = time(NULL) + (name ? RESOLVE_TTL : RESOLVE_NEG_TTL);
+    if (hash_insert(&cache_table, entry->addr, entry))
+        entry->addr[0] = '\0';
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* resolve_cached(addr, name)
+ * look addr up in the cache only, if there's a name for it it's copied
+ * into name, which has room for IRC_HOSTNAME_MAX. an address known not
+ * to resolve gives an empty name
+ * returns 1 if the cache knew, 0 if it's worth a lookup */
+int
+resolve_cached (const char *addr, char *name)
+{
+    struct cache_entry *entry;
+    int ret = 0;
+
+    pthread_mutex_lock(&cache_lock);
+    if ((entry = hash_lookup(&cache_table, addr))
+        && entry->expires > time(NULL))
+    {
+        strcpy(name, entry->name);
+        ret = 1;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+/* _finish(lookup)
+ * send a finished lookup back to its worker, a lock free push onto
+ * its resolved stack, resolve_deliver() takes the lot at once */
+static void
+_finish (lookup_t *lookup)
+{
+    worker_t *worker = lookup->worker;
+
+    lookup->next = __atomic_load_n(&worker->resolved, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&worker->resolved, &lookup->next,
+                        lookup, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    ev_async_send(worker->loop, &worker->resolve_w);
+}
+
+static void *
+_resolver_main (void *arg)
+{
+    lookup_t *lookup;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&queue_lock);
+        while (!queue_head && !stopping)
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        if (stopping)
+        {
+            pthread_mutex_unlock(&queue_lock);
+            return NULL;
+        }
+        lookup = queue_head;
+        if (!(queue_head = lookup->next))
+            queue_tail = NULL;
+        queue_len--;
+        pthread_mutex_unlock(&queue_lock);
+
+        if (lookup->type == LOOKUP_FORWARD)
+            lookup->found = _forward(lookup->name, lookup->addr);
+        else
+        {
+            lookup->found = _reverse(lookup->addr, lookup->name);
+            _cache_put(lookup->addr, lookup->found ? lookup->name : NULL);
+        }
+        _finish(lookup);
+    }
+}
+
+/* _submit(worker, type, what, cb, data)
+ * queue a lookup of what for the threads
+ * returns NULL if the queue is full or we're out of memory */
+static lookup_t *
+_submit (worker_t *worker, int type, const char *what, lookup_cb cb,
+         void *data)
+{
+    lookup_t *lookup;
+
+    if (!nr_threads || !(lookup = calloc(1, sizeof(*lookup))))
+        return NULL;
+    lookup->worker = worker;
+    lookup->type = type;
+    lookup->cb = cb;
+    lookup->data = data;
+    if (type == LOOKUP_FORWARD)
+        snprintf(lookup->name, sizeof(lookup->name), "%s", what);
+    else
+        snprintf(lookup->addr, sizeof(lookup->addr), "%s", what);
+
+    pthread_mutex_lock(&queue_lock);
+    if (queue_len == RESOLVE_QUEUE_MAX)
+    {
+        pthread_mutex_unlock(&queue_lock);
+        free(lookup);
+        return NULL;
+    }
+    if (queue_tail)
+        queue_tail->next = lookup;
+    else
+        queue_head = lookup;
+    queue_tail = lookup;
+    queue_len++;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    return lookup;
+}
+
+/* resolve_forward(worker, name, cb, data)
+ * look up name's address, cb is called from worker's loop once it's
+ * done. returns the lookup, or NULL if it couldn't be queued */
+lookup_t *
+resolve_forward (worker_t *worker, const char *name, lookup_cb cb,
+                 void *data)
+{
+    return _submit(worker, LOOKUP_FORWARD, name, cb, data);
+}
+
+/* resolve_reverse(worker, addr, cb, data)
+ * look up the name for addr, a dotted quad, cb is called from worker's
+ * loop once it's done. check resolve_cached() first, this always asks
+ * returns the lookup, or NULL if it couldn't be queued */
+lookup_t *
+resolve_reverse (worker_t *worker, const char *addr, lookup_cb cb,
+                 void *data)
+{
+    return _submit(worker, LOOKUP_REVERSE, addr, cb, data);
+}
+
+/* resolve_deliver(worker)
+ * call back for every lookup finished for worker, called from the
+ * worker's resolve_w */
+void
+resolve_deliver (worker_t *worker)
+{
+    lookup_t *lookup, *next, *list = NULL;
+
+    /* the stack comes newest first, put it back in order */
+    lookup = __atomic_exchange_n(&worker->resolved, NULL, __ATOMIC_ACQUIRE);
+    for (; lookup; lookup = next)
+    {
+        next = lookup->next;
+        lookup->next = list;
+        list = lookup;
+    }
+    for (lookup = list; lookup; lookup = next)
+    {
+        next = lookup->next;
+        lookup->cb(lookup);
+        free(lookup);
+    }
+}
+
+/* _load_hosts(path)
+ * read a hosts(5) style file, address then names, the first name is
+ * what the address resolves to and every name resolves to the address
+ * returns -1 if it can't be read */
+static int
+_load_hosts (const char *path)
+{
+    char line[512], *addr, *name, *save;
+    struct in_addr in;
+    int nr = 0, max = 0;
+    struct cache_entry *entry;
+    FILE *file;
+
+    if (!(file = fopen(path, "r")))
+    {
+        log_error("%s: %s", path, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file))
+    {
+        if ((name = strchr(line, '#')))
+            *name = '\0';
+        if (!(addr = strtok_r(line, " \t\r\n", &save))
+            || inet_pton(AF_INET, addr, &in) != 1)
+            continue;
+        while ((name = strtok_r(NULL, " \t\r\n", &save)))
+        {
+            if (strlen(name) > IRC_HOSTNAME_MAX || !_valid_name(name))
+                continue;
+            if (nr == max)
+            {
+                max = max ? max * 2 : 64;
+                if (!(entry = realloc(hosts, max * sizeof(*hosts))))
+                    goto nomem;
+                hosts = entry;
+            }
+            strcpy(hosts[nr].addr, addr);
+            casemap_fold(hosts[nr].name, name, strlen(name));
+            nr++;
+        }
+    }
+    fclose(file);
+
+    /* the array's done moving, so now the tables can point into it */
+    hash_init(&hosts_by_addr);
+    hash_init(&hosts_by_name);
+    for (entry = hosts; entry < hosts + nr; ++entry)
+    {
+        if ((!hash_lookup(&hosts_by_addr, entry->addr)
+             && hash_insert(&hosts_by_addr, entry->addr, entry->name))
+            || (!hash_lookup(&hosts_by_name, entry->name)
+                && hash_insert(&hosts_by_name, entry->name, entry->addr)))
+        {
+            log_error("%s: out of memory", path);
+            return -1;
+        }
+    }
+    use_hosts = 1;
+    return 0;
+
+nomem:
+    log_error("%s: out of memory", path);
+    fclose(file);
+    return -1;
+}
+
+/* resolve_init(hosts)
+ * start the resolver threads, with a hosts file every lookup is
+ * answered from that, otherwise it's the system resolver
+ * returns -1 if the hosts file is no good or no threads would start */
+int
+resolve_init (const char *hosts_path)
+{
+    int ret;
+
+    hash_init(&cache_table);
+    if (hosts_path && _load_hosts(hosts_path))
+        return -1;
+    for (nr_threads = 0; nr_threads < RESOLVE_THREADS; ++nr_threads)
+    {
+        ret = pthread_create(&threads[nr_threads], NULL, &_resolver_main,
+                                                                    NULL);
+        if (ret)
+        {
+            log_error("resolver: pthread_create: %s", strerror(ret));
+            break;
+        }
+    }
+    return nr_threads ? 0 : -1;
+}
+
+/* resolve_shutdown()
+ * stop the threads once they've finished what they're on, lookups
+ * still queued are forgotten, call after the workers have stopped */
+void
+resolve_shutdown (void)
+{
+    lookup_t *lookup;
+    int i;
+
+    pthread_mutex_lock(&queue_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    for (i = 0; i < nr_threads; ++i)
+        pthread_join(threads[i], NULL);
+    nr_threads = 0;
+    while ((lookup = queue_head))
+    {
+        queue_head = lookup->next;
+        free(lookup);
+    }
+    queue_tail = NULL;
+    queue_len = 0;
+}
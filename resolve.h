@@ -0,0 +1,44 @@
+#ifndef RESOLVE_H
+#define RESOLVE_H
+/* resolve.h - asynchronous name lookups, see resolve.c
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#include <netinet/in.h> /* for INET_ADDRSTRLEN */
+#include "ircd.h"       /* for worker_t */
+#include "irc.h"        /* for IRC_HOSTNAME_MAX */
+
+#define RESOLVE_THREADS     4
+#define RESOLVE_QUEUE_MAX   1024    /* lookups waiting for a thread */
+#define RESOLVE_CACHE_MAX   4096    /* addresses we remember */
+#define RESOLVE_TTL         300     /* seconds a name is remembered */
+#define RESOLVE_NEG_TTL     60      /* seconds a lack of one is */
+
+typedef struct lookup lookup_t;
+typedef void (*lookup_cb) (lookup_t *);
+
+/* lookup types */
+enum {
+    LOOKUP_FORWARD,     /* name to addr */
+    LOOKUP_REVERSE      /* addr to name, confirmed forward */
+};
+
+/* struct lookup is one request, it's handed to a resolver thread and
+ * comes back to worker, which calls cb with it from its own loop and
+ * frees it afterwards. found is 1 if name and addr are both filled in */
+struct lookup {
+    lookup_t        *next;
+    worker_t        *worker;
+    int             type;
+    int             found;
+    char            name[IRC_HOSTNAME_MAX+1];
+    char            addr[INET_ADDRSTRLEN];
+    lookup_cb       cb;
+    void            *data;
+};
+
+int resolve_init (const char *);
+void resolve_shutdown (void);
+int resolve_cached (const char *, char *);
+lookup_t *resolve_forward (worker_t *, const char *, lookup_cb, void *);
+lookup_t *resolve_reverse (worker_t *, const char *, lookup_cb, void *);
+void resolve_deliver (worker_t *);
+#endif /* RESOLVE_H */
@@ -0,0 +1,107 @@
+/* slab.c - fixed size object pools, sized from the IRCD_FOO_MAX limits.
+ * each pool reserves address space for its maximum up front, which costs
+ * nothing until objects are actually handed out, and allocating or
+ * freeing is a couple of pointer moves. Copyright Joe Doyle 2011
+ * (See COPYING) */
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "slab.h"
+#include "log.h"
+
+/* _map(len, flags)
+ * reserve len bytes of address space, huge pages first if asked,
+ * falling back to normal pages (and transparent huge pages) */
+static void *
+_map (size_t len, int *hugepages)
+{
+    void *base = MAP_FAILED;
+
+    if (*hugepages)
+    {
+        /* no MAP_NORESERVE here, if the huge page pool can't cover us
+         * we want to hear about it now rather than SIGBUS later */
+        base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (base != MAP_FAILED)
+            return base;
+        *hugepages = 0;
+        base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base != MAP_FAILED)
+            madvise(base, len, MADV_HUGEPAGE);
+        return base;
+    }
+    return mmap(NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+}
+
+/* slab_init(slab, name, size, nr_objects, flags)
+ * set up a pool of nr_objects objects, size bytes each
+ * returns -1 if the address space can't be reserved */
+int
+slab_init (slab_t *slab, const char *name, size_t size, size_t nr_objects,
+                                                                int flags)
+{
+    memset(slab, 0, sizeof(*slab));
+    slab->name = name;
+    /* every object has to be able to hold the free list link, and be
+     * aligned for anything we might put in it */
+    if (size < sizeof(void *))
+        size = sizeof(void *);
+    slab->size = (size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+    slab->nr_objects = nr_objects;
+    slab->mapped = slab->size * nr_objects;
+    slab->hugepages = flags & SLAB_HUGEPAGES;
+    if (slab->hugepages)
+        slab->mapped = (slab->mapped + SLAB_HUGEPAGE - 1)
+                                & ~(size_t)(SLAB_HUGEPAGE - 1);
+    slab->base = _map(slab->mapped, &slab->hugepages);
+    if (slab->base == MAP_FAILED)
+    {
+        log_error("slab %s: mmap %zu bytes: %s",
+                            name, slab->mapped, strerror(errno));
+        slab->base = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* slab_alloc(slab)
+ * hand out an object, NULL if the pool is exhausted. the memory is NOT
+ * cleared */
+void *
+slab_alloc (slab_t *slab)
+{
+    void *obj;
+
+    if ((obj = slab->free_list))
+        slab->free_list = *(void **)obj;
+    else if (slab->next < slab->nr_objects)
+        obj = slab->base + slab->next++ * slab->size;
+    else
+        return NULL;
+    slab->nr_used++;
+    return obj;
+}
+
+/* slab_free(slab, obj)
+ * give an object back, it's the next one handed out */
+void
+slab_free (slab_t *slab, void *obj)
+{
+    *(void **)obj = slab->free_list;
+    slab->free_list = obj;
+    slab->nr_used--;
+}
+
+/* slab_destroy(slab)
+ * unmap the whole pool, everything in it is gone */
+void
+slab_destroy (slab_t *slab)
+{
+    if (slab->base)
+        munmap(slab->base, slab->mapped);
+    slab->base = NULL;
+}
@@ -0,0 +1,36 @@
+#ifndef SLAB_H
+#define SLAB_H
+/* slab.h - fixed size object pools for the core structures
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#include <stddef.h>     /* for size_t */
+
+#define SLAB_ALIGN      16
+#define SLAB_HUGEPAGE   (2 * 1024 * 1024)
+
+/* slab_init() flags */
+#define SLAB_HUGEPAGES  1   /* back the pool with huge pages if we can */
+
+typedef struct slab slab_t;
+
+/* struct slab is a pool of nr_objects objects of one size, carved out of
+ * a single mapping reserved up front. only the pages objects have
+ * actually been handed out from use any memory. freed objects go on
+ * free_list (the link lives in the object itself) and are reused
+ * before we carve out any more */
+struct slab {
+    const char  *name;
+    size_t      size;
+    size_t      nr_objects;
+    size_t      nr_used;
+    size_t      next;           /* objects carved out so far */
+    char        *base;
+    size_t      mapped;
+    void        *free_list;
+    int         hugepages;
+};
+
+int slab_init (slab_t *, const char *, size_t, size_t, int);
+void *slab_alloc (slab_t *);
+void slab_free (slab_t *, void *);
+void slab_destroy (slab_t *);
+#endif /* SLAB_H */
@@ -0,0 +1,447 @@
+/* stats.c - what the daemon's been up to. each worker counts bytes, lines
+ * and drops on its own stats_t and keeps histograms of how long its loop
+ * spends running callbacks per wakeup, how long handing a line out to a
+ * channel takes, and how long posts to it from other workers wait in the
+ * inbox, nothing shared is touched on the way. the commands keep their
+ * own counters (see command.c) and so does the buffer pool. all of it is
+ * gathered up on demand, for STATS z as lines of text and for anything
+ * that connects to the metrics socket (-m) as a Prometheus text dump,
+ * eg socat - UNIX-CONNECT:ircd.metrics
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <ev.h>         /* requires libev */
+#include "stats.h"
+#include "ircd.h"
+#include "worker.h"
+#include "command.h"
+#include "pool.h"
+#include "unix.h"
+#include "log.h"
+
+#define STATS_LINE_MAX  256
+/* the Prometheus buckets, powers of 2 from 256ns to about 17s, they
+ * fall on bucket boundaries of ours so they're exact */
+#define PROM_LE_MIN     8
+#define PROM_LE_MAX     34
+
+static time_t       started;
+static int          metrics_fd = -1;
+static const char   *metrics_path;
+static ev_io        metrics_w;
+
+/* struct text is a growing buffer for the Prometheus dump */
+struct text {
+    char    *buf;
+    size_t  len;
+    size_t  size;
+};
+
+/* stats_init()
+ * call once at startup, uptime counts from here */
+void
+stats_init (void)
+{
+    started = time(NULL);
+}
+
+/* stats_uptime()
+ * in seconds */
+long
+stats_uptime (void)
+{
+    return time(NULL) - started;
+}
+
+static unsigned long
+_load (const unsigned long *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void
+_merge (hist_t *into, const hist_t *hist)
+{
+    unsigned long max = _load(&hist->max);
+    int i;
+
+    into->count += _load(&hist->count);
+    into->sum += _load(&hist->sum);
+    if (max > into->max)
+        into->max = max;
+    for (i = 0; i < HIST_BUCKETS; ++i)
+        into->buckets[i] += _load(&hist->buckets[i]);
+}
+
+/* stats_gather(into)
+ * every worker's counters and histograms added up */
+void
+stats_gather (stats_t *into)
+{
+    const stats_t *stats;
+    int i;
+
+    memset(into, 0, sizeof(*into));
+    for (i = 0; i < nr_workers; ++i)
+    {
+        stats = &workers[i].stats;
+        into->bytes_in += _load(&stats->bytes_in);
+        into->bytes_out += _load(&stats->bytes_out);
+        into->lines_in += _load(&stats->lines_in);
+        into->drops += _load(&stats->drops);
+        into->sendq_drops += _load(&stats->sendq_drops);
+        _merge(&into->callbacks, &stats->callbacks);
+        _merge(&into->fanout, &stats->fanout);
+        _merge(&into->posts, &stats->posts);
+    }
+}
+
+/* _bucket_low(bucket)
+ * the smallest value hist_bucket() puts in bucket */
+static unsigned long
+_bucket_low (int bucket)
+{
+    int shift;
+
+    if (bucket < HIST_SUB_BUCKETS)
+        return bucket;
+    shift = (bucket >> HIST_SUB_BITS) - 1;
+    return (unsigned long)((bucket & (HIST_SUB_BUCKETS - 1))
+                                        + HIST_SUB_BUCKETS) << shift;
+}
+
+/* hist_percentile(hist, fraction)
+ * the value fraction (0 to 1) of the samples are no bigger than, to
+ * within a bucket, or 0 if there are none */
+unsigned long
+hist_percentile (const hist_t *hist, double fraction)
+{
+    unsigned long want, seen = 0, value;
+    int i;
+
+    if (!hist->count)
+        return 0;
+    want = fraction * hist->count + 0.5;
+    if (want < 1)
+        want = 1;
+    for (i = 0; i < HIST_BUCKETS - 1; ++i)
+    {
+        seen += hist->buckets[i];
+        if (seen >= want)
+            break;
+    }
+    /* the top of the bucket, but nothing went in above max */
+    value = i < HIST_BUCKETS - 1 ? _bucket_low(i + 1) - 1 : hist->max;
+    return value < hist->max ? value : hist->max;
+}
+
+static void
+_line (stats_line_cb cb, void *data, const char *fmt, ...)
+                                    __attribute__((format(printf, 3, 4)));
+
+static void
+_line (stats_line_cb cb, void *data, const char *fmt, ...)
+{
+    char line[STATS_LINE_MAX];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    cb(data, line);
+}
+
+static void
+_hist_line (stats_line_cb cb, void *data, const char *name,
+                                                        const hist_t *hist)
+{
+    _line(cb, data, "%s: %lu, mean %luns, p50 %luns, p99 %luns, "
+                    "p99.9 %luns, max %luns", name, hist->count,
+                    hist->count ? hist->sum / hist->count : 0,
+                    hist_percentile(hist, 0.5), hist_percentile(hist, 0.99),
+                    hist_percentile(hist, 0.999), hist->max);
+}
+
+/* stats_lines(cb, data)
+ * everything we know as lines of text, one call of cb each, for STATS z.
+ * the caller holds ircd_lock */
+void
+stats_lines (stats_line_cb cb, void *data)
+{
+    static stats_t total;   /* the histograms are a bit big for the stack */
+    const stats_t *stats;
+    const worker_t *worker;
+    pool_stats_t pool;
+    int i;
+
+    _line(cb, data, "users %d, chans %d, log records dropped %lu",
+                                        nr_users, nr_chans, log_dropped());
+    for (i = 0; i < nr_workers; ++i)
+    {
+        worker = &workers[i];
+        stats = &worker->stats;
+        _line(cb, data, "worker %d: %d clients, in %lu bytes %lu lines, "
+                        "out %lu bytes, %lu drops (%lu sendq)", i,
+                        __atomic_load_n(&worker->nr_clients, __ATOMIC_RELAXED),
+                        _load(&stats->bytes_in), _load(&stats->lines_in),
+                        _load(&stats->bytes_out), _load(&stats->drops),
+                        _load(&stats->sendq_drops));
+        _line(cb, data, "worker %d: %lu accepts in %lu wakeups, at most %d, "
+                        "%lu socket syscalls", i,
+                        _load(&worker->accepts), _load(&worker->accept_wakeups),
+                        __atomic_load_n(&worker->accept_batch_max,
+                                                        __ATOMIC_RELAXED),
+                        _load(&worker->syscalls));
+    }
+    for (i = 0; i < POOL_CLASSES; ++i)
+    {
+        pool_stats(i, &pool);
+        _line(cb, data, "pool %zu: %lu hits, %lu misses, %lu trims, "
+                        "%zu resident, %zu idle", pool.size, pool.hits,
+                        pool.misses, pool.trims, pool.resident, pool.idle);
+    }
+    stats_gather(&total);
+    _hist_line(cb, data, "callbacks", &total.callbacks);
+    _hist_line(cb, data, "fanout", &total.fanout);
+    _hist_line(cb, data, "posts", &total.posts);
+}
+
+static void
+_printf (struct text *text, const char *fmt, ...)
+                                    __attribute__((format(printf, 2, 3)));
+
+static void
+_printf (struct text *text, const char *fmt, ...)
+{
+    va_list ap;
+    char *buf;
+    int len;
+
+    if (!text->buf)
+        return;     /* ran out of memory earlier */
+    for (;;)
+    {
+        va_start(ap, fmt);
+        len = vsnprintf(text->buf + text->len, text->size - text->len, fmt,
+                                                                        ap);
+        va_end(ap);
+        if ((size_t)len < text->size - text->len)
+            break;
+        if (!(buf = realloc(text->buf, text->size * 2)))
+        {
+            free(text->buf);
+            text->buf = NULL;
+            return;
+        }
+        text->buf = buf;
+        text->size *= 2;
+    }
+    text->len += len;
+}
+
+/* _metric(text, name, type, help)
+ * the HELP and TYPE lines that go before a metric's samples */
+static void
+_metric (struct text *text, const char *name, const char *type,
+                                                        const char *help)
+{
+    _printf(text, "# HELP ircd_%s %s\n# TYPE ircd_%s %s\n", name, help,
+                                                            name, type);
+}
+
+static void
+_hist_metric (struct text *text, const char *name, const char *help,
+                                                        const hist_t *hist)
+{
+    unsigned long below = 0;
+    int i = 0, k;
+
+    _metric(text, name, "histogram", help);
+    for (k = PROM_LE_MIN; k <= PROM_LE_MAX; ++k)
+    {
+        /* le is inclusive, so count the bucket 2^k falls in too */
+        for (; i <= hist_bucket(1UL << k); ++i)
+            below += hist->buckets[i];
+        _printf(text, "ircd_%s_bucket{le=\"%.10g\"} %lu\n", name,
+                                            (1UL << k) / 1e9, below);
+    }
+    _printf(text, "ircd_%s_bucket{le=\"+Inf\"} %lu\n", name, hist->count);
+    _printf(text, "ircd_%s_sum %.9f\n", name, hist->sum / 1e9);
+    _printf(text, "ircd_%s_count %lu\n", name, hist->count);
+}
+
+/* the per worker counters, in a table so the dump can go metric by
+ * metric rather than worker by worker */
+#define WORKER_STAT(field)  offsetof(worker_t, field)
+static const struct {
+    const char  *name;
+    const char  *help;
+    size_t      offset;
+} worker_metrics[] = {
+    { "received_bytes_total", "Bytes read from clients.",
+                                        WORKER_STAT(stats.bytes_in) },
+    { "received_lines_total", "Lines read from clients.",
+                                        WORKER_STAT(stats.lines_in) },
+    { "sent_bytes_total", "Bytes written to clients.",
+                                        WORKER_STAT(stats.bytes_out) },
+    { "drops_total", "Clients dropped.", WORKER_STAT(stats.drops) },
+    { "sendq_drops_total", "Clients dropped for exceeding their sendq.",
+                                        WORKER_STAT(stats.sendq_drops) },
+    { "accepts_total", "Connections accepted.", WORKER_STAT(accepts) },
+    { "accept_wakeups_total", "Times the listener woke the loop.",
+                                        WORKER_STAT(accept_wakeups) },
+    { "socket_syscalls_total", "Syscalls made on sockets.",
+                                        WORKER_STAT(syscalls) },
+    { NULL, NULL, 0 }
+};
+
+/* stats_prometheus(len)
+ * everything we know in Prometheus' text format, a malloc()ed string
+ * of *len bytes, or NULL if we're out of memory */
+char *
+stats_prometheus (size_t *len)
+{
+    static stats_t total;
+    struct text text;
+    const command_t *cmd;
+    pool_stats_t pool;
+    int i, pos, users, chans;
+
+    text.len = 0;
+    text.size = 16384;
+    if (!(text.buf = malloc(text.size)))
+        return NULL;
+
+    pthread_mutex_lock(&ircd_lock);
+    users = nr_users;
+    chans = nr_chans;
+    pthread_mutex_unlock(&ircd_lock);
+
+    _metric(&text, "start_time_seconds", "gauge", "When the server started.");
+    _printf(&text, "ircd_start_time_seconds %ld\n", (long)started);
+    _metric(&text, "users", "gauge", "Registered users.");
+    _printf(&text, "ircd_users %d\n", users);
+    _metric(&text, "channels", "gauge", "Channels.");
+    _printf(&text, "ircd_channels %d\n", chans);
+    _metric(&text, "clients", "gauge", "Connections, by worker.");
+    for (i = 0; i < nr_workers; ++i)
+        _printf(&text, "ircd_clients{worker=\"%d\"} %d\n", i,
+                __atomic_load_n(&workers[i].nr_clients, __ATOMIC_RELAXED));
+    for (pos = 0; worker_metrics[pos].name; ++pos)
+    {
+        _metric(&text, worker_metrics[pos].name, "counter",
+                                            worker_metrics[pos].help);
+        for (i = 0; i < nr_workers; ++i)
+            _printf(&text, "ircd_%s{worker=\"%d\"} %lu\n",
+                    worker_metrics[pos].name, i, _load((unsigned long *)
+                    ((char *)&workers[i] + worker_metrics[pos].offset)));
+    }
+
+    _metric(&text, "commands_total", "counter", "Commands handled.");
+    for (pos = 0; (cmd = command_iter(&pos)); )
+        _printf(&text, "ircd_commands_total{command=\"%s\"} %lu\n",
+                                        cmd->name, _load(&cmd->calls));
+    _metric(&text, "command_seconds_total", "counter",
+                                        "Time spent in command handlers.");
+    for (pos = 0; (cmd = command_iter(&pos)); )
+        _printf(&text, "ircd_command_seconds_total{command=\"%s\"} %.9f\n",
+                                        cmd->name, _load(&cmd->nsecs) / 1e9);
+
+    _metric(&text, "pool_hits_total", "counter",
+                                        "Buffers reused from the pool.");
+    for (i = 0; i < POOL_CLASSES; ++i)
+    {
+        pool_stats(i, &pool);
+        _printf(&text, "ircd_pool_hits_total{size=\"%zu\"} %lu\n",
+                                                    pool.size, pool.hits);
+    }
+    _metric(&text, "pool_misses_total", "counter",
+                                    "Buffers the pool had to make.");
+    for (i = 0; i < POOL_CLASSES; ++i)
+    {
+        pool_stats(i, &pool);
+        _printf(&text, "ircd_pool_misses_total{size=\"%zu\"} %lu\n",
+                                                    pool.size, pool.misses);
+    }
+    _metric(&text, "pool_resident_bytes", "gauge",
+                                    "Memory held by the pool.");
+    for (i = 0; i < POOL_CLASSES; ++i)
+    {
+        pool_stats(i, &pool);
+        _printf(&text, "ircd_pool_resident_bytes{size=\"%zu\"} %zu\n",
+                                                    pool.size, pool.resident);
+    }
+    _metric(&text, "log_dropped_total", "counter",
+                                    "Log records lost to a full ring.");
+    _printf(&text, "ircd_log_dropped_total %lu\n", log_dropped());
+
+    stats_gather(&total);
+    _hist_metric(&text, "callback_seconds",
+                "Time a loop spent running callbacks, per wakeup.",
+                &total.callbacks);
+    _hist_metric(&text, "fanout_seconds",
+                "Time to hand a line to a channel.", &total.fanout);
+    _hist_metric(&text, "post_seconds",
+                "Time posts to another worker waited to be delivered.",
+                &total.posts);
+    *len = text.len;
+    return text.buf;
+}
+
+/* metrics_cb
+ * somebody connected to the metrics socket, give them the dump and hang
+ * up. it goes in one write, it's well short of a socket buffer and we'd
+ * rather cut it short than have the loop wait on someone */
+static void
+metrics_cb (EV_P_ ev_io *w, int revents)
+{
+    char *dump;
+    size_t len;
+    int fd;
+
+    while ((fd = unix_accept(metrics_fd, NULL, 0)) != -1)
+    {
+        if ((dump = stats_prometheus(&len)))
+        {
+            if (write(fd, dump, len) != (ssize_t)len)
+                log_warn("metrics: short write");
+            free(dump);
+        }
+        close(fd);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED
+        && errno != EINTR)
+        log_error("metrics: accept: %s", strerror(errno));
+}
+
+/* stats_listen(path)
+ * serve the Prometheus dump on a unix domain socket at path, on the
+ * first worker's loop. returns -1 if it can't be bound */
+int
+stats_listen (const char *path)
+{
+    if ((metrics_fd = unix_listen_local(path)) == -1)
+        return -1;
+    metrics_path = path;
+    ev_io_init(&metrics_w, &metrics_cb, metrics_fd, EV_READ);
+    ev_io_start(workers[0].loop, &metrics_w);
+    return 0;
+}
+
+/* stats_close()
+ * take the metrics socket down, if there is one */
+void
+stats_close (void)
+{
+    if (metrics_fd == -1)
+        return;
+    ev_io_stop(workers[0].loop, &metrics_w);
+    close(metrics_fd);
+    unlink(metrics_path);
+    metrics_fd = -1;
+}
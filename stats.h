@@ -0,0 +1,93 @@
+#ifndef STATS_H
+#define STATS_H
+/* stats.h - counters and latency histograms, each worker keeps its own
+ * and they're summed when someone asks, see stats.c
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#include <time.h>       /* for clock_gettime */
+
+/* histograms are HDR style, a power of 2 range is split into
+ * HIST_SUB_BUCKETS linear buckets, so any value is recorded to within
+ * 1 / HIST_SUB_BUCKETS of itself whatever its size */
+#define HIST_SUB_BITS       4
+#define HIST_SUB_BUCKETS    (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS        ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+typedef struct hist hist_t;
+typedef struct stats stats_t;
+
+/* struct hist is a histogram of nanoseconds */
+struct hist {
+    unsigned long   count;
+    unsigned long   sum;
+    unsigned long   max;
+    unsigned long   buckets[HIST_BUCKETS];
+};
+
+/* struct stats is one worker's counters. only the worker writes them
+ * but anyone may read them, see stats_add() */
+struct stats {
+    unsigned long   bytes_in;
+    unsigned long   bytes_out;
+    unsigned long   lines_in;
+    unsigned long   drops;
+    unsigned long   sendq_drops;
+    hist_t          callbacks;  /* per loop wakeup, running callbacks */
+    hist_t          fanout;     /* handing a line to a list of clients */
+    hist_t          posts;      /* from worker_post() to delivery */
+};
+
+/* stats_add(counter, n)
+ * a relaxed load and store is as cheap as += with only one writer, and
+ * keeps readers on other threads well defined */
+static inline void
+stats_add (unsigned long *counter, unsigned long n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline unsigned long
+stats_nsecs (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* hist_bucket(value)
+ * the first HIST_SUB_BUCKETS values get a bucket each, after that it's
+ * the top HIST_SUB_BITS + 1 bits of the value */
+static inline int
+hist_bucket (unsigned long value)
+{
+    int shift;
+
+    if (value < HIST_SUB_BUCKETS)
+        return value;
+    shift = 63 - __builtin_clzl(value) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS)
+                        + (int)(value >> shift) - HIST_SUB_BUCKETS;
+}
+
+/* hist_add(hist, nsecs)
+ * only the owning worker may call this */
+static inline void
+hist_add (hist_t *hist, unsigned long nsecs)
+{
+    stats_add(&hist->buckets[hist_bucket(nsecs)], 1);
+    stats_add(&hist->count, 1);
+    stats_add(&hist->sum, nsecs);
+    if (nsecs > hist->max)
+        __atomic_store_n(&hist->max, nsecs, __ATOMIC_RELAXED);
+}
+
+void stats_init (void);
+long stats_uptime (void);
+void stats_gather (stats_t *);
+unsigned long hist_percentile (const hist_t *, double);
+typedef void (*stats_line_cb) (void *, const char *);
+void stats_lines (stats_line_cb, void *);
+char *stats_prometheus (size_t *);
+int stats_listen (const char *);
+void stats_close (void);
+#endif /* STATS_H */
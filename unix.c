@@ -1,6 +1,8 @@
 /* unix.c - Copyright Joe Doyle 2011 (See COPYING)
  * Unix specific socket and pipe handling */
+#define _GNU_SOURCE     /* for accept4, SOCK_NONBLOCK */
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <netinet/in.h>
@@ -10,6 +12,8 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include "unix.h"
+#include "log.h"
 extern int h_errno;
 
 /* unix_set_nonblock sets the nonblocking flag on an open file
@@ -17,7 +21,7 @@ extern int h_errno;
 int
 unix_set_nonblock (int fd)
 {
-    int flags, ret;
+    int flags, ret = 0;
 
     flags = fcntl(fd, F_GETFL);
     if (flags == -1) ret = -1;
@@ -26,22 +30,23 @@ unix_set_nonblock (int fd)
     if (flags == -1) ret = -1;
     else if (ret != -1) ret = 0;
     if (ret == -1)
-        fprintf(stderr, "fcntl(): %s\n", strerror(errno));
+        log_error("fcntl(): %s", strerror(errno));
     return ret;
 }
 
-/* resolve takes a pointer to a sockaddr_in struct as well as a hostname
- * and portnumber and fills the structure with network address data
+/* unix_resolve takes a pointer to a sockaddr_in struct as well as a
+ * hostname and portnumber and fills the structure with network address
+ * data. NB: this blocks, only call it before the event loops are running
  * returns -1 on error, 0 on success */
-static int
-resolve (const char *host, in_port_t port, struct sockaddr_in *address)
+int
+unix_resolve (const char *host, in_port_t port, struct sockaddr_in *address)
 {
     struct hostent *host_p;
 
     host_p = gethostbyname(host);
     if (!host_p)
     {
-        fprintf(stderr, "Resolution of %s failed: %s\n",
+        log_error("Resolution of %s failed: %s",
                                     host, hstrerror(h_errno));
         return -1;
     }
@@ -54,51 +59,59 @@ resolve (const char *host, in_port_t port, struct sockaddr_in *address)
     return 0;
 }
 
-/* unix_connect takes host name and port number and attempts to
- * initiate a socket connection to a listener at the given address */
+/* unix_connect starts a connection to a listener at the given address
+ * and returns the socket without waiting for it to finish, it's
+ * writeable once the handshake is over one way or another, see
+ * unix_connect_error(). returns -1 with errno set if it failed outright */
 int
-unix_connect (const char *host, in_port_t port)
+unix_connect (const struct sockaddr_in *address)
 {
-    int fd;
-    struct sockaddr_in addr;
+    int fd, err;
 
-    fd = socket(AF_INET, SOCK_STREAM, 0);
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (fd == -1)
         return -1;
-    /*if (unix_set_nonblock(fd))
-    {
-        close(fd);
-        return -1;
-    }*/
-    if (resolve(host, port, &addr))
+    if (connect(fd, (const struct sockaddr *)address, sizeof(*address))
+        && errno != EINPROGRESS)
     {
+        err = errno;
         close(fd);
-        return -1;
-    }
-    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
-    {
-        fprintf(stderr, "Connect to %s:%d failed: %s\n",
-                               host, port, strerror(errno));
-        close(fd);
+        errno = err;
         return -1;
     }
     return fd;
 }
 
+/* unix_connect_error() tells how a connect started by unix_connect()
+ * went, 0 if we're connected, otherwise the errno it failed with */
+int
+unix_connect_error (int fd)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+        return errno;
+    return err;
+}
+
 /* unix_listen takes a host name and port number and attempts to bind a
  * socket to the address and tell the network stack to listen for
  * connections, simple! If successful, the bound socket descriptor
- * is returned, otherwise -1 */
+ * is returned, otherwise -1. with UNIX_REUSEPORT in flags several
+ * sockets can listen on the same port and the kernel balances
+ * incoming connections between them */
 int
-unix_listen (const char *host, in_port_t port)
+unix_listen (const char *host, in_port_t port, int flags)
 {
-    int fd, ret;
+    int fd, ret, one = 1;
     struct sockaddr_in sockaddr;
 
     /* NB: all sockets will be set to O_NONBLOCK here in unix.c as
      * I've not found anything in the glib GIOChannel docs regarding
-     * blocking vs non blocking operations */
-    fd = socket(AF_INET, SOCK_STREAM, 0);
+     * blocking vs non blocking operations. close on exec, or the next
+     * process after an upgrade would hold an extra copy, see upgrade.c */
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (fd == -1)
         return -1;
     /* NB: non blocking sockets are essential otherwise we might
@@ -110,8 +123,15 @@ unix_listen (const char *host, in_port_t port)
         close(fd);
         return -1;
     }
+    if (flags & UNIX_REUSEPORT
+        && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)))
+    {
+        log_error("SO_REUSEPORT: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
     /* resolve address into weird sockaddr_in structure */
-    ret = resolve(host, port, &sockaddr);
+    ret = unix_resolve(host, port, &sockaddr);
     if (ret == -1)
     {
         close(fd);
@@ -120,7 +140,7 @@ unix_listen (const char *host, in_port_t port)
     ret = bind(fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr));
     if (ret == -1)
     {
-        fprintf(stderr, "Could not bind %s:%d: %s\n",
+        log_error("Could not bind %s:%d: %s",
                             host, port, strerror(errno));
         close(fd);
         return -1;
@@ -128,7 +148,7 @@ unix_listen (const char *host, in_port_t port)
     ret = listen(fd, SOMAXCONN);
     if (ret == -1)
     {
-        fprintf(stderr, "Bound %s:%d but listen failed: %s\n",
+        log_error("Bound %s:%d but listen failed: %s",
                             host, port, strerror(errno));
         close(fd);
         return -1;
@@ -137,23 +157,75 @@ unix_listen (const char *host, in_port_t port)
     return fd;
 }
 
-/* unix_accept() creates and returns a new socket for an incoming
- * client connection */
+/* unix_listen_local() binds a non blocking unix domain socket to path
+ * and listens on it, anything already at path is removed first, most
+ * likely it's our own socket left behind by an earlier run. returns the
+ * socket or -1 */
 int
-unix_accept (int listenfd)
+unix_listen_local (const char *path)
 {
-    socklen_t length;
-    struct sockaddr address;
+    struct sockaddr_un sockaddr;
     int fd;
 
-    length = sizeof(address);
-    fd = accept(listenfd, &address, &length);
+    if (strlen(path) >= sizeof(sockaddr.sun_path))
+    {
+        log_error("%s: path too long for a socket", path);
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (fd == -1)
-        fprintf(stderr, "Accept failed: %s\n", strerror(errno));
-    else if (unix_set_nonblock(fd))
     {
+        log_error("%s: socket: %s", path, strerror(errno));
+        return -1;
+    }
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sun_family = AF_UNIX;
+    strcpy(sockaddr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1
+        || listen(fd, SOMAXCONN) == -1)
+    {
+        log_error("Could not listen on %s: %s", path, strerror(errno));
         close(fd);
-        fd = -1;
+        return -1;
     }
     return fd;
 }
+
+/* unix_accept() creates and returns a new socket for an incoming
+ * client connection, already non blocking and close-on-exec so it's
+ * one syscall per connection. unless addr is NULL the peer's address is
+ * written into it (len bytes) as text, or "" if it isn't IPv4. this is
+ * on the hot path during connection storms so it doesn't log, -1 and
+ * errno are the caller's to deal with */
+int
+unix_accept (int listenfd, char *addr, size_t len)
+{
+    struct sockaddr_in address;
+    socklen_t addrlen = sizeof(address);
+    int fd;
+
+    if (!addr)
+        return accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    fd = accept4(listenfd, (struct sockaddr *)&address, &addrlen,
+                                            SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd != -1 && (address.sin_family != AF_INET
+                || !inet_ntop(AF_INET, &address.sin_addr, addr, len)))
+        addr[0] = '\0';
+    return fd;
+}
+
+/* unix_peer() writes the address at the other end of a connected
+ * socket into buf as text, returns -1 if there isn't one. for sockets
+ * that didn't come from unix_accept(), io_uring's and outgoing links */
+int
+unix_peer (int fd, char *buf, size_t len)
+{
+    struct sockaddr_in address;
+    socklen_t addrlen = sizeof(address);
+
+    if (getpeername(fd, (struct sockaddr *)&address, &addrlen) == -1
+        || address.sin_family != AF_INET)
+        return -1;
+    return inet_ntop(AF_INET, &address.sin_addr, buf, len) ? 0 : -1;
+}
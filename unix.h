@@ -1,11 +1,19 @@
 #ifndef UNIX_H
 #define UNIX_H
 /* unix.h header file - Copyright Joe Doyle (See COPYING) */
+#include <stddef.h>     /* for size_t */
 #include <netinet/in.h>
 
-int unix_listen (const char *, in_port_t);
-int unix_connect (const char *, in_port_t);
-int unix_accept (int);
+/* unix_listen() flags */
+#define UNIX_REUSEPORT  1   /* share the port with other listeners */
+
+int unix_listen (const char *, in_port_t, int);
+int unix_listen_local (const char *);
+int unix_resolve (const char *, in_port_t, struct sockaddr_in *);
+int unix_connect (const struct sockaddr_in *);
+int unix_connect_error (int);
+int unix_accept (int, char *, size_t);
+int unix_peer (int, char *, size_t);
 int unix_set_nonblock (int);
 
 #endif /* UNIX_H */
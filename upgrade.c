@@ -0,0 +1,487 @@
+/* upgrade.c - replacing the running binary without dropping anyone. on
+ * SIGHUP the loops stop where they are and the daemon writes out all of
+ * its state, clients with their unframed input and unsent output, users
+ * and channels, into one buffer. then it forks and execs its own command
+ * line again, with UPGRADE_ENV telling the new process which fd to read
+ * from, and sends it the listening sockets and every client's socket
+ * (SCM_RIGHTS, UPGRADE_FDS_PER_MSG at a time) and then the buffer. the new
+ * process builds everything back up, acks, and carries on where we left
+ * off while we exit. nobody's connection notices, the kernel holds on to
+ * anything that arrives in the meantime. if the new process doesn't ack
+ * within UPGRADE_TIMEOUT, say it doesn't start or can't make sense of
+ * what we sent, we kill it and go back to running as before.
+ * the buffer is in our own byte order and layout, the new binary has to
+ * be built for the same machine and understand UPGRADE_MAGIC
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#define _GNU_SOURCE     /* for execvpe */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "upgrade.h"
+#include "log.h"
+
+extern char **environ;
+
+/* struct upgrade_header goes first, so the new process knows how much
+ * is coming */
+struct upgrade_header {
+    char        magic[8];
+    uint32_t    nr_fds;
+    uint64_t    len;
+};
+
+void
+upgrade_put (upgrade_t *u, const void *data, size_t len)
+{
+    size_t size;
+    char *buf;
+
+    if (u->failed)
+        return;
+    if (u->len + len > u->size)
+    {
+        for (size = u->size ? u->size : 65536; size < u->len + len; )
+            size *= 2;
+        if (!(buf = realloc(u->buf, size)))
+        {
+            u->failed = 1;
+            return;
+        }
+        u->buf = buf;
+        u->size = size;
+    }
+    memcpy(u->buf + u->len, data, len);
+    u->len += len;
+}
+
+void
+upgrade_put_int (upgrade_t *u, long n)
+{
+    int64_t n64 = n;
+
+    upgrade_put(u, &n64, sizeof(n64));
+}
+
+/* upgrade_put_data(u, data, len)
+ * len bytes, with their length in front, see upgrade_get_data() */
+void
+upgrade_put_data (upgrade_t *u, const void *data, size_t len)
+{
+    upgrade_put_int(u, len);
+    upgrade_put(u, data, len);
+}
+
+void
+upgrade_put_str (upgrade_t *u, const char *s)
+{
+    upgrade_put_data(u, s, strlen(s));
+}
+
+/* upgrade_put_fd(u, fd)
+ * fd goes across alongside the buffer, upgrade_get_fd() at the same
+ * point gets the new process' copy of it */
+void
+upgrade_put_fd (upgrade_t *u, int fd)
+{
+    int *fds;
+
+    if (u->failed)
+        return;
+    if (u->nr_fds == u->max_fds)
+    {
+        u->max_fds = u->max_fds ? u->max_fds * 2 : 256;
+        if (!(fds = realloc(u->fds, u->max_fds * sizeof(*fds))))
+        {
+            u->failed = 1;
+            return;
+        }
+        u->fds = fds;
+    }
+    u->fds[u->nr_fds++] = fd;
+}
+
+void
+upgrade_get (upgrade_t *u, void *data, size_t len)
+{
+    if (u->failed || len > u->len - u->pos)
+    {
+        u->failed = 1;
+        memset(data, 0, len);
+        return;
+    }
+    memcpy(data, u->buf + u->pos, len);
+    u->pos += len;
+}
+
+long
+upgrade_get_int (upgrade_t *u)
+{
+    int64_t n64;
+
+    upgrade_get(u, &n64, sizeof(n64));
+    return n64;
+}
+
+/* upgrade_get_data(u, len)
+ * points into the buffer rather than copying, NULL if it's not there */
+const char *
+upgrade_get_data (upgrade_t *u, size_t *len)
+{
+    const char *data;
+
+    *len = upgrade_get_int(u);
+    if (u->failed || *len > u->len - u->pos)
+    {
+        u->failed = 1;
+        *len = 0;
+        return NULL;
+    }
+    data = u->buf + u->pos;
+    u->pos += *len;
+    return data;
+}
+
+/* upgrade_get_str(u, s, size)
+ * a string that won't fit in size counts as running off the end */
+void
+upgrade_get_str (upgrade_t *u, char *s, size_t size)
+{
+    const char *data;
+    size_t len;
+
+    s[0] = '\0';
+    if (!(data = upgrade_get_data(u, &len)))
+        return;
+    if (len >= size)
+    {
+        u->failed = 1;
+        return;
+    }
+    memcpy(s, data, len);
+    s[len] = '\0';
+}
+
+int
+upgrade_get_fd (upgrade_t *u)
+{
+    if (u->failed || u->next_fd == u->nr_fds)
+    {
+        u->failed = 1;
+        return -1;
+    }
+    return u->fds[u->next_fd++];
+}
+
+/* _write_all(fd, buf, len)
+ * returns -1 if the other end has gone */
+static int
+_write_all (int fd, const char *buf, size_t len)
+{
+    ssize_t ret;
+
+    while (len)
+    {
+        if ((ret = write(fd, buf, len)) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int
+_read_all (int fd, char *buf, size_t len)
+{
+    ssize_t ret;
+
+    while (len)
+    {
+        if ((ret = read(fd, buf, len)) <= 0)
+        {
+            if (ret == -1 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/* _send_fds(sock, fds, nr)
+ * one byte carrying nr fds, see _recv_fds() */
+static int
+_send_fds (int sock, const int *fds, int nr)
+{
+    char cmsg[CMSG_SPACE(UPGRADE_FDS_PER_MSG * sizeof(int))], byte = 0;
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+    struct cmsghdr *c;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg;
+    msg.msg_controllen = CMSG_SPACE(nr * sizeof(int));
+    c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(nr * sizeof(int));
+    memcpy(CMSG_DATA(c), fds, nr * sizeof(int));
+    while (sendmsg(sock, &msg, 0) == -1)
+        if (errno != EINTR)
+            return -1;
+    return 0;
+}
+
+/* _recv_fds(sock, fds)
+ * the fds carried by the next byte, returns how many or -1 */
+static int
+_recv_fds (int sock, int *fds)
+{
+    char cmsg[CMSG_SPACE(UPGRADE_FDS_PER_MSG * sizeof(int))], byte;
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+    struct cmsghdr *c;
+    ssize_t ret;
+    int nr;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg;
+    msg.msg_controllen = sizeof(cmsg);
+    while ((ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1)
+        if (errno != EINTR)
+            return -1;
+    if (ret != 1 || msg.msg_flags & MSG_CTRUNC
+        || !(c = CMSG_FIRSTHDR(&msg)) || c->cmsg_type != SCM_RIGHTS)
+        return -1;
+    nr = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(c), nr * sizeof(int));
+    return nr;
+}
+
+/* _env(var)
+ * our environment with var in place of any UPGRADE_ENV already in it,
+ * made before fork() since there's no malloc()ing after */
+static char **
+_env (char *var)
+{
+    size_t n = 0, len = strlen(UPGRADE_ENV);
+    char **env, **p;
+
+    for (p = environ; *p; ++p)
+        n++;
+    if (!(env = malloc((n + 2) * sizeof(*env))))
+        return NULL;
+    for (n = 0, p = environ; *p; ++p)
+        if (strncmp(*p, UPGRADE_ENV, len) || (*p)[len] != '=')
+            env[n++] = *p;
+    env[n++] = var;
+    env[n] = NULL;
+    return env;
+}
+
+/* _handover(u, sock)
+ * everything in u down sock, then wait for the ack
+ * returns -1 if it didn't arrive */
+static int
+_handover (upgrade_t *u, int sock)
+{
+    struct upgrade_header header;
+    struct pollfd pfd;
+    char ack;
+    int i, nr, ret;
+
+    memcpy(header.magic, UPGRADE_MAGIC, sizeof(header.magic));
+    header.nr_fds = u->nr_fds;
+    header.len = u->len;
+    if (_write_all(sock, (char *)&header, sizeof(header)))
+        return -1;
+    for (i = 0; i < u->nr_fds; i += nr)
+    {
+        nr = u->nr_fds - i;
+        if (nr > UPGRADE_FDS_PER_MSG)
+            nr = UPGRADE_FDS_PER_MSG;
+        if (_send_fds(sock, u->fds + i, nr))
+            return -1;
+    }
+    if (_write_all(sock, u->buf, u->len))
+        return -1;
+
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    while ((ret = poll(&pfd, 1, UPGRADE_TIMEOUT * 1000)) == -1)
+        if (errno != EINTR)
+            return -1;
+    if (!ret || read(sock, &ack, 1) != 1)
+        return -1;
+    return 0;
+}
+
+/* upgrade_exec(u, argv)
+ * start argv, which had better be a new us, and hand it u
+ * returns 0 once the new process has taken over, which leaves us only
+ * to exit quietly, or -1 if it didn't and we're still in charge */
+int
+upgrade_exec (upgrade_t *u, char **argv)
+{
+    char var[sizeof(UPGRADE_ENV) + 16], **env;
+    sigset_t none;
+    int socks[2];
+    pid_t pid;
+
+    if (u->failed)
+    {
+        log_error("upgrade: out of memory");
+        return -1;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, socks) == -1)
+    {
+        log_error("upgrade: socketpair: %s", strerror(errno));
+        return -1;
+    }
+    snprintf(var, sizeof(var), "%s=%d", UPGRADE_ENV, socks[1]);
+    if (!(env = _env(var)))
+    {
+        log_error("upgrade: out of memory");
+        close(socks[0]);
+        close(socks[1]);
+        return -1;
+    }
+    sigemptyset(&none);
+
+    /* the new process and we share the log from here on, append so
+     * neither of us writes over the other */
+    fcntl(2, F_SETFL, fcntl(2, F_GETFL) | O_APPEND);
+    log_info("upgrade: starting %s", argv[0]);
+    switch ((pid = fork()))
+    {
+        case -1:
+            log_error("upgrade: fork: %s", strerror(errno));
+            break;
+        case 0:
+            /* libev may have signals blocked for its signalfd */
+            sigprocmask(SIG_SETMASK, &none, NULL);
+            fcntl(socks[1], F_SETFD, 0);
+            execvpe(argv[0], argv, env);
+            _exit(127);
+    }
+    free(env);
+    close(socks[1]);
+    if (pid == -1)
+    {
+        close(socks[0]);
+        return -1;
+    }
+    if (_handover(u, socks[0]))
+    {
+        log_error("upgrade: pid %d didn't take over, carrying on", pid);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        close(socks[0]);
+        return -1;
+    }
+    log_info("upgrade: pid %d has taken over", pid);
+    close(socks[0]);
+    return 0;
+}
+
+/* upgrade_pending()
+ * whether we were started by upgrade_exec() */
+int
+upgrade_pending (void)
+{
+    return getenv(UPGRADE_ENV) != NULL;
+}
+
+/* upgrade_receive(u)
+ * read what the old process sent into u, to be read back with
+ * upgrade_get*() then acked with upgrade_done()
+ * returns -1 if we didn't get it all, the old process carries on */
+int
+upgrade_receive (upgrade_t *u)
+{
+    struct upgrade_header header;
+    const char *var = getenv(UPGRADE_ENV);
+    int nr;
+
+    memset(u, 0, sizeof(*u));
+    u->sock = var ? atoi(var) : -1;
+    unsetenv(UPGRADE_ENV);
+    if (u->sock < 0)
+        return -1;
+    fcntl(u->sock, F_SETFD, FD_CLOEXEC);
+    if (_read_all(u->sock, (char *)&header, sizeof(header))
+        || memcmp(header.magic, UPGRADE_MAGIC, sizeof(header.magic)))
+    {
+        log_error("upgrade: nothing from the old process");
+        return -1;
+    }
+    u->max_fds = header.nr_fds;
+    if (!(u->fds = malloc((header.nr_fds + 1) * sizeof(*u->fds)))
+        || !(u->buf = malloc(header.len + 1)))
+    {
+        log_error("upgrade: out of memory");
+        return -1;
+    }
+    while (u->nr_fds < u->max_fds)
+    {
+        if ((nr = _recv_fds(u->sock, u->fds + u->nr_fds)) <= 0
+            || nr > u->max_fds - u->nr_fds)
+        {
+            log_error("upgrade: lost the old process' sockets");
+            return -1;
+        }
+        u->nr_fds += nr;
+    }
+    u->size = u->len = header.len;
+    if (_read_all(u->sock, u->buf, u->len))
+    {
+        log_error("upgrade: lost the old process' state");
+        return -1;
+    }
+    log_info("upgrade: %d sockets and %zu bytes of state", u->nr_fds, u->len);
+    return 0;
+}
+
+/* upgrade_done(u)
+ * everything's been read back, tell the old process it can go
+ * returns -1 if it's stopped listening, which means it's given up on us
+ * and carried on, so we mustn't */
+int
+upgrade_done (upgrade_t *u)
+{
+    char ack = 1;
+    int ret;
+
+    if ((ret = _write_all(u->sock, &ack, 1)))
+        log_error("upgrade: the old process gave up on us");
+    upgrade_free(u);
+    return ret;
+}
+
+void
+upgrade_free (upgrade_t *u)
+{
+    if (u->sock > 0)
+        close(u->sock);
+    free(u->buf);
+    free(u->fds);
+    memset(u, 0, sizeof(*u));
+    u->sock = -1;
+}
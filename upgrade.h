@@ -0,0 +1,50 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+/* upgrade.h - handing the daemon over to a new binary without dropping
+ * anyone, see upgrade.c
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#include <stddef.h>     /* for size_t */
+
+#define UPGRADE_ENV         "IRCD_UPGRADE_FD"
+#define UPGRADE_MAGIC       "ircdupg1"
+#define UPGRADE_TIMEOUT     10      /* seconds for the new process to ack */
+#define UPGRADE_FDS_PER_MSG 250     /* under the kernel's SCM_MAX_FD */
+
+typedef struct upgrade upgrade_t;
+
+/* struct upgrade is the state being handed over, buf holds everything
+ * but the file descriptors, which go alongside it. the old process
+ * builds it up with upgrade_put*(), the new one reads it back in the same
+ * order with upgrade_get*(), pos and next_fd are how far it's got.
+ * failed is set once a put runs out of memory or a get runs off the end,
+ * so callers only need to check once at the end */
+struct upgrade {
+    char    *buf;
+    size_t  len;
+    size_t  size;
+    size_t  pos;
+    int     *fds;
+    int     nr_fds;
+    int     max_fds;
+    int     next_fd;
+    int     sock;       /* to the other process */
+    int     failed;
+};
+
+void upgrade_put (upgrade_t *, const void *, size_t);
+void upgrade_put_int (upgrade_t *, long);
+void upgrade_put_str (upgrade_t *, const char *);
+void upgrade_put_data (upgrade_t *, const void *, size_t);
+void upgrade_put_fd (upgrade_t *, int);
+void upgrade_get (upgrade_t *, void *, size_t);
+long upgrade_get_int (upgrade_t *);
+void upgrade_get_str (upgrade_t *, char *, size_t);
+const char *upgrade_get_data (upgrade_t *, size_t *);
+int upgrade_get_fd (upgrade_t *);
+
+int upgrade_exec (upgrade_t *, char **);
+int upgrade_pending (void);
+int upgrade_receive (upgrade_t *);
+int upgrade_done (upgrade_t *);
+void upgrade_free (upgrade_t *);
+#endif /* UPGRADE_H */
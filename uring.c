@@ -0,0 +1,473 @@
+/* uring.c - io_uring backend for client sockets, picked at runtime with
+ * -U when built with -DHAVE_IO_URING. instead of a readiness callback and
+ * a syscall per read or write, each worker keeps a multishot accept on
+ * its listener and a multishot recv on every client, both running off
+ * a ring of kernel selected receive buffers, and everything a loop
+ * iteration wants sent goes to the kernel in one io_uring_enter(). the
+ * ring signals an eventfd, which is just another ev_io to libev.
+ * there's no liburing here, only the raw syscalls.
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#ifdef HAVE_IO_URING
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include "uring.h"
+#include "ircd.h"
+#include "net.h"
+#include "worker.h"
+#include "pool.h"
+#include "log.h"
+
+/* what a completion is for lives in the low bits of its user_data,
+ * everything user_data points at is at least 8 byte aligned */
+#define TAG_ACCEPT  0
+#define TAG_RECV    1
+#define TAG_SEND    2
+#define TAG_CANCEL  3
+#define TAG_MASK    7
+
+/* struct uring_send is what the kernel reads a sendmsg() from, it has to
+ * stay put until the completion, so it comes from the 4K pool */
+struct uring_send {
+    client_t        *client;
+    struct msghdr   hdr;
+    struct iovec    iov[URING_IOV_MAX];
+};
+
+static int
+_setup (unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+_enter (int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                                                                NULL, 0);
+}
+
+static int
+_register (int fd, unsigned op, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, op, arg, nr_args);
+}
+
+/* _sqe(ring)
+ * the next free submission entry, zeroed, or NULL if the queue is full
+ * even after handing what's in it to the kernel */
+static struct io_uring_sqe *
+_sqe (uring_t *ring)
+{
+    struct io_uring_sqe *sqe;
+
+    if (ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)
+                                                        == ring->sq_entries)
+    {
+        uring_submit(ring->worker);
+        if (ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)
+                                                        == ring->sq_entries)
+            return NULL;
+    }
+    sqe = &ring->sqes[ring->sq_tail++ & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/* _recycle(ring, bid)
+ * give receive buffer bid back to the kernel */
+static void
+_recycle (uring_t *ring, unsigned bid)
+{
+    struct io_uring_buf *buf;
+
+    buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFS - 1)];
+    buf->addr = (uintptr_t)(ring->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/* _accepted(ring, cqe)
+ * the listener's multishot accept has a new connection for us */
+static void
+_accepted (uring_t *ring, const struct io_uring_cqe *cqe)
+{
+    worker_t *worker = ring->worker;
+
+    if (cqe->res >= 0)
+    {
+        stats_add(&worker->accepts, 1);
+        /* a multishot accept has nowhere to put each address */
+        ring->accept_cb(worker, cqe->res, NULL);
+    }
+    else if (cqe->res != -ECANCELED)
+        log_error("accept failed unexpectedly: %s",
+                                                    strerror(-cqe->res));
+    /* the kernel gave up on it, start another */
+    if (!(cqe->flags & IORING_CQE_F_MORE) && worker->server_fd != -1
+        && uring_accept(worker))
+        log_error("can't accept on worker %d", worker->id);
+}
+
+/* _received(ring, client, cqe)
+ * the client's multishot recv filled a buffer, or finished */
+static void
+_received (uring_t *ring, client_t *client, const struct io_uring_cqe *cqe)
+{
+    unsigned bid;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        /* if it's been dropped there's nobody to give it to */
+        if (cqe->res > 0 && client->fd != -1)
+            net_recv_data(client, ring->bufs + (size_t)bid * URING_BUF_SIZE,
+                                                    cqe->res, ring->line_cb);
+        _recycle(ring, bid);
+    }
+    if (cqe->flags & IORING_CQE_F_MORE)
+        return;
+
+    /* that's the last we'll hear of this recv, and its reference */
+    if (client->fd != -1)
+    {
+        if (cqe->res == 0)
+            drop(client, QUIT_EOF);
+        else if (cqe->res < 0 && cqe->res != -ENOBUFS)
+            drop(client, -cqe->res);
+        else if (uring_recv(client))
+            drop(client, QUIT_OUT_OF_MEMORY);
+    }
+    client_unref(client);
+}
+
+/* _sent(ring, send, cqe)
+ * a sendmsg() finished, some or all of what it was given went out */
+static void
+_sent (uring_t *ring, struct uring_send *send, const struct io_uring_cqe *cqe)
+{
+    client_t *client = send->client;
+
+    pool_free(send, POOL_4K);
+    client->out_buf.inflight = 0;
+    if (client->fd == -1)
+        net_free_sendq(client);     /* drop() left it to us */
+    else if (cqe->res < 0)
+        drop(client, -cqe->res);
+    else
+    {
+        net_sent(client, cqe->res);
+        uring_send(client);
+    }
+    client_unref(client);
+}
+
+/* _reap(ring)
+ * deal with every completion waiting for us */
+static void
+_reap (uring_t *ring)
+{
+    struct io_uring_cqe cqe;
+    unsigned head, tail;
+    void *ptr;
+
+    for (;;)
+    {
+        head = *ring->cq_head;
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail)
+        {
+            /* the kernel kept whatever didn't fit, go and get it */
+            if (!(*ring->sq_flags & IORING_SQ_CQ_OVERFLOW))
+                break;
+            stats_add(&ring->worker->syscalls, 1);
+            _enter(ring->fd, 0, 0, IORING_ENTER_GETEVENTS);
+            continue;
+        }
+        for (; head != tail; ++head)
+        {
+            /* copy it out so the slot can go back before we act on it,
+             * handlers can submit and so on */
+            cqe = ring->cqes[head & ring->cq_mask];
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            ptr = (void *)(uintptr_t)(cqe.user_data & ~(uint64_t)TAG_MASK);
+            switch (cqe.user_data & TAG_MASK)
+            {
+                case TAG_ACCEPT:    _accepted(ring, &cqe);
+                                    break;
+                case TAG_RECV:      _received(ring, ptr, &cqe);
+                                    break;
+                case TAG_SEND:      _sent(ring, ptr, &cqe);
+                                    break;
+                default:            break;
+            }
+        }
+    }
+}
+
+static void
+event_cb (EV_P_ ev_io *w, int revents)
+{
+    uring_t *ring = w->data;
+    uint64_t count;
+
+    stats_add(&ring->worker->syscalls, 1);
+    if (read(ring->eventfd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+        log_error("eventfd: %s", strerror(errno));
+    _reap(ring);
+}
+
+/* _free(ring)
+ * tear down as much of a ring as got set up */
+static void
+_free (uring_t *ring)
+{
+    if (ring->eventfd != -1)
+        close(ring->eventfd);
+    if (ring->fd != -1)
+        close(ring->fd);
+    if (ring->ring && ring->ring != MAP_FAILED)
+        munmap(ring->ring, ring->ring_size);
+    if (ring->sqes && (void *)ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sq_entries * sizeof(*ring->sqes));
+    if (ring->buf_ring && (void *)ring->buf_ring != MAP_FAILED)
+        munmap(ring->buf_ring, URING_BUFS * sizeof(struct io_uring_buf));
+    free(ring->bufs);
+    free(ring);
+}
+
+/* uring_init(worker, accept_cb, line_cb)
+ * give the worker a ring, hooked into its loop. new connections go to
+ * accept_cb and lines clients send to line_cb. returns -1 if the kernel
+ * won't play */
+int
+uring_init (worker_t *worker, uring_accept_cb accept_cb, net_line_cb line_cb)
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    uring_t *ring;
+    char *base;
+    size_t sq_size, cq_size;
+    unsigned i;
+
+    if (!(ring = calloc(1, sizeof(*ring))))
+        return -1;
+    ring->worker = worker;
+    ring->eventfd = -1;
+    ring->accept_cb = accept_cb;
+    ring->line_cb = line_cb;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+    p.cq_entries = URING_CQ_ENTRIES;
+    if ((ring->fd = _setup(URING_ENTRIES, &p)) == -1)
+    {
+        log_error("io_uring_setup: %s", strerror(errno));
+        goto fail;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)
+        || !(p.features & IORING_FEAT_NODROP))
+    {
+        log_error("io_uring: kernel too old");
+        goto fail;
+    }
+
+    /* the submission and completion rings share a mapping */
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->sq_entries = p.sq_entries;
+    ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                                                        IORING_OFF_SQES);
+    if (ring->ring == MAP_FAILED || (void *)ring->sqes == MAP_FAILED)
+    {
+        log_error("io_uring mmap: %s", strerror(errno));
+        goto fail;
+    }
+    base = ring->ring;
+    ring->sq_head = (unsigned *)(base + p.sq_off.head);
+    ring->sq_ktail = (unsigned *)(base + p.sq_off.tail);
+    ring->sq_flags = (unsigned *)(base + p.sq_off.flags);
+    ring->sq_array = (unsigned *)(base + p.sq_off.array);
+    ring->sq_mask = *(unsigned *)(base + p.sq_off.ring_mask);
+    ring->sq_tail = *ring->sq_ktail;
+    ring->cq_head = (unsigned *)(base + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(base + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(base + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(base + p.cq_off.cqes);
+    /* sqes are used in order, so the indirection array never changes */
+    for (i = 0; i < p.sq_entries; ++i)
+        ring->sq_array[i] = i;
+
+    if ((ring->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1
+        || _register(ring->fd, IORING_REGISTER_EVENTFD, &ring->eventfd, 1))
+    {
+        log_error("io_uring eventfd: %s", strerror(errno));
+        goto fail;
+    }
+
+    /* receive buffers the kernel picks from as data arrives */
+    ring->buf_ring = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf),
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->bufs = malloc((size_t)URING_BUFS * URING_BUF_SIZE);
+    if ((void *)ring->buf_ring == MAP_FAILED || !ring->bufs)
+        goto fail;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring->buf_ring;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = URING_BGID;
+    if (_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+    {
+        log_error("io_uring buffer ring: %s", strerror(errno));
+        goto fail;
+    }
+    for (i = 0; i < URING_BUFS; ++i)
+        _recycle(ring, i);
+
+    ev_io_init(&ring->event_w, &event_cb, ring->eventfd, EV_READ);
+    ring->event_w.data = ring;
+    ev_io_start(worker->loop, &ring->event_w);
+    worker->ring = ring;
+    return 0;
+
+fail:
+    _free(ring);
+    return -1;
+}
+
+/* uring_destroy(worker)
+ * take the worker's ring away again, only once its loop has stopped */
+void
+uring_destroy (worker_t *worker)
+{
+    if (!worker->ring)
+        return;
+    ev_io_stop(worker->loop, &worker->ring->event_w);
+    _free(worker->ring);
+    worker->ring = NULL;
+}
+
+/* uring_accept(worker)
+ * start a multishot accept on the worker's listener */
+int
+uring_accept (worker_t *worker)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!(sqe = _sqe(worker->ring)))
+        return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = worker->server_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = (uintptr_t)worker | TAG_ACCEPT;
+    return 0;
+}
+
+/* uring_recv(client)
+ * start a multishot recv on a client, it holds a reference until the
+ * kernel's done with it */
+int
+uring_recv (client_t *client)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!(sqe = _sqe(client->worker->ring)))
+        return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = (uintptr_t)client | TAG_RECV;
+    __atomic_add_fetch(&client->refs, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* uring_send(client)
+ * queue a sendmsg() of as much of the client's send queue as fits in
+ * one, unless there's one on the go already. there's only ever one per
+ * client: sends on a stream socket can come up short, and a short send
+ * doesn't break a chain of linked sqes, so anything linked after it
+ * would go out with a hole in front of it
+ * NB: if this returns -1, client no longer points to valid memory! */
+ssize_t
+uring_send (client_t *client)
+{
+    sendq_t *sendq = &client->out_buf;
+    struct uring_send *send;
+    struct io_uring_sqe *sqe;
+
+    if (sendq->inflight || !sendq->first || client->fd == -1)
+        return 0;
+    if (!(send = pool_alloc(POOL_4K))
+        || !(sqe = _sqe(client->worker->ring)))
+    {
+        if (send)
+            pool_free(send, POOL_4K);
+        drop(client, QUIT_OUT_OF_MEMORY);
+        return -1;
+    }
+    send->client = client;
+    memset(&send->hdr, 0, sizeof(send->hdr));
+    send->hdr.msg_iov = send->iov;
+    send->hdr.msg_iovlen = net_gather(client, send->iov, URING_IOV_MAX);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = client->fd;
+    sqe->addr = (uintptr_t)&send->hdr;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)send | TAG_SEND;
+    sendq->inflight = 1;
+    __atomic_add_fetch(&client->refs, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* uring_cancel(client)
+ * cancel everything the kernel's doing for a client we're dropping,
+ * straight away, before the fd gets closed and maybe reused. the
+ * completions still arrive, and let go of their references */
+void
+uring_cancel (client_t *client)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!(sqe = _sqe(client->worker->ring)))
+        return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = client->fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = TAG_CANCEL;
+    uring_submit(client->worker);
+}
+
+/* uring_submit(worker)
+ * hand everything queued up to the kernel, one syscall for the lot,
+ * called at the end of every loop iteration */
+void
+uring_submit (worker_t *worker)
+{
+    uring_t *ring = worker->ring;
+    unsigned pending;
+
+    __atomic_store_n(ring->sq_ktail, ring->sq_tail, __ATOMIC_RELEASE);
+    pending = ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (!pending)
+        return;
+    stats_add(&worker->syscalls, 1);
+    if (_enter(ring->fd, pending, 0, 0) == -1 && errno != EINTR
+        && errno != EAGAIN && errno != EBUSY)
+        log_error("io_uring_enter: %s", strerror(errno));
+}
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,61 @@
+#ifndef URING_H
+#define URING_H
+/* uring.h - io_uring backend for client sockets, only built with
+ * -DHAVE_IO_URING (linux 6.0 or later), see uring.c
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#ifdef HAVE_IO_URING
+#include <ev.h>         /* for ev_io */
+#include <linux/io_uring.h>
+#include "ircd.h"       /* for client_t */
+#include "net.h"        /* for net_line_cb */
+
+#define URING_ENTRIES       1024    /* submission queue */
+#define URING_CQ_ENTRIES    8192    /* multishot ops complete a lot */
+#define URING_BUFS          512     /* receive buffer ring, power of 2 */
+#define URING_BUF_SIZE      2048
+#define URING_BGID          0
+#define URING_IOV_MAX       128     /* see struct uring_send in uring.c */
+
+typedef void (*uring_accept_cb) (worker_t *, int, const char *);
+
+/* struct uring is one worker's ring. the kernel signals eventfd for
+ * every completion, event_w hooks that into the worker's libev loop.
+ * sq_tail is ours, only published to the kernel by uring_submit().
+ * receives land in bufs, handed to the kernel through buf_ring */
+struct uring {
+    worker_t        *worker;
+    int             fd;
+    int             eventfd;
+    ev_io           event_w;
+    uring_accept_cb accept_cb;
+    net_line_cb     line_cb;
+
+    void            *ring;
+    size_t          ring_size;
+    unsigned        *sq_head;
+    unsigned        *sq_ktail;
+    unsigned        *sq_flags;
+    unsigned        *sq_array;
+    unsigned        sq_mask;
+    unsigned        sq_entries;
+    unsigned        sq_tail;
+    struct io_uring_sqe *sqes;
+    unsigned        *cq_head;
+    unsigned        *cq_tail;
+    unsigned        cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *buf_ring;
+    char            *bufs;
+    unsigned short  buf_tail;
+};
+
+int uring_init (worker_t *, uring_accept_cb, net_line_cb);
+void uring_destroy (worker_t *);
+int uring_accept (worker_t *);
+int uring_recv (client_t *);
+ssize_t uring_send (client_t *);
+void uring_cancel (client_t *);
+void uring_submit (worker_t *);
+#endif /* HAVE_IO_URING */
+#endif /* URING_H */
@@ -0,0 +1,130 @@
+/* wheel.c - hierarchical timing wheel. arming, re-arming and cancelling
+ * a timer is an unlink and a push, whatever the number of timers, and
+ * each tick only looks at the one slot that's due (plus, once per turn,
+ * the slot of the level above that's cascaded down into it). one of
+ * these per worker takes care of every client's timeouts off a single
+ * ev_timer. Copyright Joe Doyle 2011 (See COPYING) */
+#include <string.h>
+#include "wheel.h"
+#include "list.h"
+
+/* _ticks(t)
+ * convert ev_now() style time into wheel ticks */
+static unsigned long
+_ticks (ev_tstamp t)
+{
+    return (unsigned long)(t / WHEEL_TICK);
+}
+
+/* _insert(wheel, timer)
+ * put an unarmed timer in the slot for timer->expires, which mustn't be
+ * before now, anything past the top level is pulled in to the furthest
+ * we can hold */
+static void
+_insert (wheel_t *wheel, wheel_timer_t *timer)
+{
+    unsigned long delta;
+    int level;
+
+    delta = timer->expires - wheel->now;
+    if (delta >= 1UL << (WHEEL_BITS * WHEEL_LEVELS))
+        timer->expires = wheel->now + (1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+    for (level = 0; level < WHEEL_LEVELS - 1; ++level)
+        if (delta < 1UL << (WHEEL_BITS * (level + 1)))
+            break;
+    timer->slot = &wheel->slots[level][(timer->expires
+                                    >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    list_push(timer->slot, (list_t *)timer);
+}
+
+/* wheel_init(wheel, now)
+ * set up an empty wheel starting from now */
+void
+wheel_init (wheel_t *wheel, ev_tstamp now)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = _ticks(now);
+}
+
+/* wheel_timer_init(timer, cb, data)
+ * set up an unarmed timer */
+void
+wheel_timer_init (wheel_timer_t *timer, wheel_cb cb, void *data)
+{
+    timer->slot = NULL;
+    timer->cb = cb;
+    timer->data = data;
+}
+
+/* wheel_arm(wheel, timer, when)
+ * (re)arm timer to go off at ev_now() time when, or as close after as
+ * the tick allows */
+void
+wheel_arm (wheel_t *wheel, wheel_timer_t *timer, ev_tstamp when)
+{
+    wheel_cancel(wheel, timer);
+    timer->expires = _ticks(when + WHEEL_TICK - 1e-9);
+    /* anything already due goes off next tick, never this one, or a
+     * callback re-arming itself could keep wheel_advance() going */
+    if (timer->expires <= wheel->now)
+        timer->expires = wheel->now + 1;
+    _insert(wheel, timer);
+    wheel->nr_timers++;
+}
+
+/* wheel_cancel(wheel, timer)
+ * disarm timer if it's armed */
+void
+wheel_cancel (wheel_t *wheel, wheel_timer_t *timer)
+{
+    if (!timer->slot)
+        return;
+    list_unlink(timer->slot, (list_t *)timer);
+    timer->slot = NULL;
+    wheel->nr_timers--;
+}
+
+/* _cascade(wheel, level)
+ * the level below just came round, spread this level's current slot
+ * over it */
+static void
+_cascade (wheel_t *wheel, int level)
+{
+    list_t **slot;
+    wheel_timer_t *timer;
+
+    slot = &wheel->slots[level][(wheel->now >> (WHEEL_BITS * level))
+                                                            & WHEEL_MASK];
+    while ((timer = (wheel_timer_t *)list_pop(slot)))
+        _insert(wheel, timer);
+}
+
+/* wheel_advance(wheel, now)
+ * run every timer due up to ev_now() time now, callbacks are free to
+ * arm or cancel any timer, their own included */
+void
+wheel_advance (wheel_t *wheel, ev_tstamp now)
+{
+    unsigned long target = _ticks(now);
+    wheel_timer_t *timer;
+    list_t **slot;
+    int level;
+
+    while (wheel->now < target)
+    {
+        wheel->now++;
+        /* top down, so everything cascades as far as it should */
+        for (level = WHEEL_LEVELS - 1; level > 0; --level)
+            if (!(wheel->now & ((1UL << (WHEEL_BITS * level)) - 1)))
+                _cascade(wheel, level);
+
+        slot = &wheel->slots[0][wheel->now & WHEEL_MASK];
+        while ((timer = (wheel_timer_t *)list_pop(slot)))
+        {
+            timer->slot = NULL;
+            wheel->nr_timers--;
+            timer->cb(timer);
+        }
+    }
+}
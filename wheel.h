@@ -0,0 +1,43 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+/* wheel.h - hierarchical timing wheel
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#include <ev.h>         /* for ev_tstamp */
+#include "list.h"       /* for list_t */
+
+#define WHEEL_TICK      1.0     /* seconds */
+#define WHEEL_BITS      6
+#define WHEEL_SLOTS     (1 << WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS    3       /* so up to 64^3 ticks, about 3 days */
+
+typedef struct wheel wheel_t;
+typedef struct wheel_timer wheel_timer_t;
+typedef void (*wheel_cb) (wheel_timer_t *);
+
+/* struct wheel_timer is a single shot timer, embed it in whatever it's
+ * timing and point data back at that. slot is the list it's on, NULL
+ * while it's not armed */
+struct wheel_timer {
+    list_t          list_head;
+    list_t          **slot;
+    unsigned long   expires;    /* in ticks */
+    wheel_cb        cb;
+    void            *data;
+};
+
+/* struct wheel holds timers in slots by expiry, level 0 has a slot per
+ * tick and each level up a slot per whole turn of the one below. now
+ * is the last tick we've run */
+struct wheel {
+    unsigned long   now;
+    int             nr_timers;
+    list_t          *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+void wheel_init (wheel_t *, ev_tstamp);
+void wheel_timer_init (wheel_timer_t *, wheel_cb, void *);
+void wheel_arm (wheel_t *, wheel_timer_t *, ev_tstamp);
+void wheel_cancel (wheel_t *, wheel_timer_t *);
+void wheel_advance (wheel_t *, ev_tstamp);
+#endif /* WHEEL_H */
@@ -0,0 +1,274 @@
+/* worker.c - event loop workers, in worker mode each thread runs its own
+ * libev loop on its own SO_REUSEPORT listener and owns the clients it
+ * accepts, anything another worker wants sent to them is posted to the
+ * owner's inbox. Copyright Joe Doyle 2011 (See COPYING) */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ev.h>         /* requires libev */
+#include "worker.h"
+#include "ircd.h"
+#include "net.h"
+#include "uring.h"
+#include "resolve.h"
+#include "log.h"
+
+worker_t workers[IRCD_WORKERS_MAX];
+int nr_workers = 1;
+__thread worker_t *worker_self = NULL;
+
+/* _inbox_push(worker, post)
+ * Vyukov's intrusive MPSC queue, one atomic exchange per push, any
+ * thread may call this */
+static void
+_inbox_push (worker_t *worker, post_t *post)
+{
+    post_t *prev;
+
+    post->next = NULL;
+    prev = __atomic_exchange_n(&worker->head, post, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, post, __ATOMIC_RELEASE);
+}
+
+/* _inbox_pop(worker)
+ * take the oldest post off the inbox, only the owning thread may call
+ * this. returns NULL if it's empty, or if a producer is halfway through
+ * a push, in which case its ev_async_send() will bring us back */
+static post_t *
+_inbox_pop (worker_t *worker)
+{
+    post_t *tail = worker->tail, *next;
+
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &worker->stub)
+    {
+        if (!next)
+            return NULL;
+        worker->tail = tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+    if (next)
+    {
+        worker->tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&worker->head, __ATOMIC_ACQUIRE))
+        return NULL;
+    _inbox_push(worker, &worker->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next)
+    {
+        worker->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+/* _deliver(worker)
+ * everything other workers have posted to our clients, returns how many
+ * posts there were */
+static int
+_deliver (worker_t *worker)
+{
+    post_t *post;
+    int i, n = 0;
+
+    for (; (post = _inbox_pop(worker)); ++n)
+    {
+        for (i = 0; i < post->nr_clients; ++i)
+        {
+            /* it may have been dropped since it was posted */
+            if (post->clients[i]->fd != -1)
+                net_send_msg(post->clients[i], post->msg);
+            client_unref(post->clients[i]);
+        }
+        hist_add(&worker->stats.posts, stats_nsecs() - post->posted);
+        net_unref_msg(post->msg);
+        free(post);
+    }
+    return n;
+}
+
+static void
+inbox_cb (EV_P_ ev_async *w, int revents)
+{
+    _deliver(w->data);
+}
+
+/* flush_cb
+ * runs after every other callback in an iteration, just before the
+ * loop blocks, writes made during the iteration were only queued and
+ * all go out from here. users dropped along the way are forgotten
+ * first, their QUITs can go out in the same flush */
+static void
+flush_cb (EV_P_ ev_prepare *w, int revents)
+{
+    worker_t *worker = w->data;
+
+    client_reap(worker);
+    net_flush_dirty(worker);
+#ifdef HAVE_IO_URING
+    if (worker->ring)
+        uring_submit(worker);
+#endif
+}
+
+/* tick_cb
+ * one timer per worker, every client timeout hangs off the wheel */
+static void
+tick_cb (EV_P_ ev_timer *w, int revents)
+{
+    worker_t *worker = w->data;
+
+    wheel_advance(&worker->wheel, ev_now(EV_A));
+}
+
+/* resolve_cb
+ * lookups we asked for have come back from the resolver threads */
+static void
+resolve_cb (EV_P_ ev_async *w, int revents)
+{
+    resolve_deliver(w->data);
+}
+
+/* invoke_cb
+ * libev hands us each batch of pending callbacks to run, which is where
+ * we time them */
+static void
+invoke_cb (EV_P)
+{
+    worker_t *worker = ev_userdata(EV_A);
+    unsigned long start;
+
+    if (!ev_pending_count(EV_A))
+        return;
+    start = stats_nsecs();
+    ev_invoke_pending(EV_A);
+    hist_add(&worker->stats.callbacks, stats_nsecs() - start);
+}
+
+static void
+stop_cb (EV_P_ ev_async *w, int revents)
+{
+    ev_break(EV_A_ EVBREAK_ALL);
+}
+
+/* worker_init(worker, id, loop)
+ * set up a worker around an event loop, the caller still has to give it
+ * a listener. returns -1 if there's no loop */
+int
+worker_init (worker_t *worker, int id, struct ev_loop *loop)
+{
+    if (!loop)
+        return -1;
+    memset(worker, 0, sizeof(*worker));
+    worker->id = id;
+    worker->loop = loop;
+    worker->server_fd = -1;
+    worker->head = worker->tail = &worker->stub;
+    ev_set_userdata(loop, worker);
+    ev_set_invoke_pending_cb(loop, &invoke_cb);
+    ev_async_init(&worker->inbox_w, &inbox_cb);
+    worker->inbox_w.data = worker;
+    ev_async_start(loop, &worker->inbox_w);
+    ev_async_init(&worker->stop_w, &stop_cb);
+    ev_async_start(loop, &worker->stop_w);
+    ev_async_init(&worker->resolve_w, &resolve_cb);
+    worker->resolve_w.data = worker;
+    ev_async_start(loop, &worker->resolve_w);
+    ev_prepare_init(&worker->flush_w, &flush_cb);
+    worker->flush_w.data = worker;
+    ev_prepare_start(loop, &worker->flush_w);
+    wheel_init(&worker->wheel, ev_now(loop));
+    ev_timer_init(&worker->wheel_w, &tick_cb, WHEEL_TICK, WHEEL_TICK);
+    worker->wheel_w.data = worker;
+    ev_timer_start(loop, &worker->wheel_w);
+    return 0;
+}
+
+static void *
+_worker_main (void *arg)
+{
+    worker_t *worker = arg;
+
+    worker_self = worker;
+    ev_run(worker->loop, 0);
+    return NULL;
+}
+
+/* worker_spawn(worker)
+ * run the worker's loop on a thread of its own */
+int
+worker_spawn (worker_t *worker)
+{
+    int ret;
+
+    ret = pthread_create(&worker->thread, NULL, &_worker_main, worker);
+    if (ret)
+    {
+        log_error("worker %d: pthread_create: %s",
+                                worker->id, strerror(ret));
+        return -1;
+    }
+    return 0;
+}
+
+/* worker_stop(worker)
+ * break a spawned worker's loop from any thread and wait for it */
+void
+worker_stop (worker_t *worker)
+{
+    ev_async_send(worker->loop, &worker->stop_w);
+    pthread_join(worker->thread, NULL);
+}
+
+/* worker_quiesce(worker)
+ * for a worker whose loop has stopped, deliver what's in its inbox and
+ * forget the users it dropped. forgetting them posts QUITs to the other
+ * workers, so go round them all until this returns 0 for every one
+ * returns how much there was to do */
+int
+worker_quiesce (worker_t *worker)
+{
+    worker_t *self = worker_self;
+    int n;
+
+    worker_self = worker;
+    n = _deliver(worker);
+    if (worker->reap_list)
+    {
+        client_reap(worker);
+        n++;
+    }
+    worker_self = self;
+    return n;
+}
+
+/* worker_post(worker, msg, clients, nr_clients)
+ * hand a segment to some of another worker's clients. the post takes a
+ * reference to msg and one to each client, so the caller must know the
+ * clients are alive right now (ie hold ircd_lock while it found them)
+ * returns -1 if we're out of memory */
+int
+worker_post (worker_t *worker, msg_t *msg, client_t **clients, int nr_clients)
+{
+    post_t *post;
+    int i;
+
+    post = malloc(sizeof(*post) + nr_clients * sizeof(*clients));
+    if (!post)
+        return -1;
+    post->msg = msg;
+    post->posted = stats_nsecs();
+    __atomic_add_fetch(&msg->refs, 1, __ATOMIC_RELAXED);
+    post->nr_clients = nr_clients;
+    for (i = 0; i < nr_clients; ++i)
+    {
+        post->clients[i] = clients[i];
+        __atomic_add_fetch(&clients[i]->refs, 1, __ATOMIC_RELAXED);
+    }
+    _inbox_push(worker, post);
+    ev_async_send(worker->loop, &worker->inbox_w);
+    return 0;
+}
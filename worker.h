@@ -0,0 +1,74 @@
+#ifndef WORKER_H
+#define WORKER_H
+/* worker.h - event loop workers, each with its own listener and clients
+ * Copyright Joe Doyle 2011 (See COPYING) */
+#include <pthread.h>    /* for pthread_t */
+#include <ev.h>         /* for ev_io, ev_async */
+#include "ircd.h"       /* for client_t */
+#include "net.h"        /* for msg_t */
+#include "slab.h"       /* for slab_t */
+#include "wheel.h"      /* for wheel_t */
+#include "stats.h"      /* for stats_t */
+
+#define IRCD_WORKERS_MAX    64
+
+typedef struct post post_t;
+typedef struct uring uring_t;
+typedef struct lookup lookup_t;
+
+/* struct post carries one segment to some of another worker's clients,
+ * next links it into that worker's inbox. each client in it holds a
+ * reference taken by the poster, see worker_post(). posted is when, for
+ * the stats */
+struct post {
+    post_t * volatile   next;
+    msg_t               *msg;
+    unsigned long       posted;
+    int                 nr_clients;
+    client_t            *clients[];
+};
+
+/* struct worker is one event loop and everything it owns: a listening
+ * socket (SO_REUSEPORT spreads connections over the workers) and the
+ * clients accepted on it. other threads reach our clients through the
+ * inbox, a lock free multi producer single consumer queue of posts
+ * drained when inbox_w fires */
+struct worker {
+    int             id;
+    pthread_t       thread;
+    struct ev_loop  *loop;
+    int             server_fd;
+    ev_io           server_w;
+    ev_async        inbox_w;
+    ev_async        stop_w;
+    ev_async        resolve_w;  /* lookups are back, see resolve.c */
+    ev_prepare      flush_w;    /* end of iteration write flush */
+    ev_timer        wheel_w;    /* ticks the wheel */
+    wheel_t         wheel;      /* all our clients' timeouts */
+    client_t        *client_list;
+    client_t        *dirty_list;
+    client_t        *reap_list; /* dropped, see client_reap() */
+    int             nr_clients;
+    slab_t          client_slab;
+    unsigned long   accept_wakeups;     /* server_w callbacks */
+    unsigned long   accepts;            /* connections they accepted */
+    int             accept_batch_max;   /* most in one callback */
+    unsigned long   syscalls;   /* socket syscalls, for benchmarking */
+    stats_t         stats;      /* see stats.c */
+    uring_t         *ring;      /* NULL unless we're using io_uring */
+    lookup_t * volatile resolved;   /* finished lookups */
+    post_t * volatile head;     /* producers push here */
+    post_t          *tail;      /* we pop from here */
+    post_t          stub;
+};
+
+extern worker_t workers[];
+extern int nr_workers;
+extern __thread worker_t *worker_self;
+
+int worker_init (worker_t *, int, struct ev_loop *);
+int worker_spawn (worker_t *);
+void worker_stop (worker_t *);
+int worker_quiesce (worker_t *);
+int worker_post (worker_t *, msg_t *, client_t **, int);
+#endif /* WORKER_H */